@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __MQTTD_BENCH_H
+#define __MQTTD_BENCH_H
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+static inline int connect_client(unsigned short port)
+{
+    struct sockaddr_in addr;
+    int sock, enable = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return sock;
+}
+
+static inline void send_all(int sock, char *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len)
+    {
+        res = send(sock, buf, len, MSG_NOSIGNAL);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+
+        buf += res;
+        len -= res;
+    }
+}
+
+/* Blocks until count frames have arrived, returns the number of bytes read */
+static inline size_t wait_frames(int sock, size_t count)
+{
+    size_t seen = 0, total = 0;
+    char buf[4096];
+    ssize_t res, i;
+
+    while (seen < count)
+    {
+        res = recv(sock, buf, sizeof(buf), 0);
+        if (res <= 0)
+        {
+            fprintf(stderr, "connection closed after %zu of %zu frames\n", seen, count);
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < res; i++)
+            seen += buf[i] == '>';
+        total += res;
+    }
+
+    return total;
+}
+
+/* Asks the kernel for a port nobody is using */
+static inline unsigned short free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    unsigned short port;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        getsockname(sock, (struct sockaddr *)&addr, &len) == -1)
+    {
+        perror("free_port");
+        exit(EXIT_FAILURE);
+    }
+
+    port = ntohs(addr.sin_port);
+    close(sock);
+    return port;
+}
+
+/* Runs the broker given on the command line on its own port.
+ * args is NULL terminated and must leave room for the port */
+static inline pid_t start_broker(char *path, char **args, unsigned short *port)
+{
+    char port_str[16];
+    size_t num_args;
+    pid_t pid;
+    int sock, i;
+
+    *port = free_port();
+    snprintf(port_str, sizeof(port_str), "%hu", *port);
+
+    for (num_args = 0; args[num_args]; num_args++)
+        ;
+    args[num_args] = port_str;
+    args[num_args + 1] = NULL;
+
+    pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!pid)
+    {
+        if (!freopen("/dev/null", "w", stdout))
+            perror("freopen");
+        execv(path, args);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+
+    args[num_args] = NULL;
+
+    for (i = 0; i < 500; i++)
+    {
+        sock = connect_client(*port);
+        if (sock != -1)
+        {
+            close(sock);
+            return pid;
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "broker did not start\n");
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+static inline void stop_broker(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+#endif /* __MQTTD_BENCH_H */
@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+/* Floods one topic with publishes while other clients keep subscribing to
+ * and leaving it, and reports how both sides fare.
+ * Usage: contention_bench mqttd [publishers] [messages] [sub_threads] [mqttd options...] */
+
+enum
+{
+    DEFAULT_PUBLISHERS = 4,
+    DEFAULT_MESSAGES = 20000,
+    DEFAULT_SUB_THREADS = 4,
+    SUBS_PER_THREAD = 500,
+    PUB_BATCH = 100,
+};
+
+static unsigned short port;
+static size_t num_msgs = DEFAULT_MESSAGES;
+
+struct sub_stats
+{
+    pthread_t thread;
+    size_t index;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+static int connect_subscribed(char *name)
+{
+    char buf[256];
+    int sock, n;
+
+    sock = connect_client(port);
+    if (sock == -1)
+    {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+
+    n = snprintf(buf, sizeof(buf), "<%s, CONN><%s, SUB, NEWS>", name, name);
+    send_all(sock, buf, n);
+    wait_frames(sock, 2);
+
+    return sock;
+}
+
+static void *publish(void *arg)
+{
+    size_t id = (size_t)arg, i, len;
+    char name[32], batch[PUB_BATCH * 64];
+    int sock;
+
+    snprintf(name, sizeof(name), "pub%zu", id);
+    sock = connect_subscribed(name);
+
+    /* Echoes are never read, the broker drops them past the watermark */
+    for (i = 0, len = 0; i < num_msgs; i++)
+    {
+        len += sprintf(batch + len, "<%s, PUB, NEWS, %zu>", name, i);
+        if ((i + 1) % PUB_BATCH == 0 || i + 1 == num_msgs)
+        {
+            send_all(sock, batch, len);
+            len = 0;
+        }
+    }
+
+    return (void *)(intptr_t)sock;
+}
+
+/* Subscribes without connecting, so each client leaves the topic again on close */
+static void *subscribe(void *arg)
+{
+    struct sub_stats *stats = arg;
+    uint64_t start, elapsed;
+    char buf[64];
+    int sock, n;
+    size_t i;
+
+    for (i = 0; i < SUBS_PER_THREAD; i++)
+    {
+        sock = connect_client(port);
+        if (sock == -1)
+        {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+
+        n = snprintf(buf, sizeof(buf), "<storm%zu_%zu, SUB, NEWS>", stats->index, i);
+
+        start = now_ns();
+        send_all(sock, buf, n);
+        wait_frames(sock, 1);
+        elapsed = now_ns() - start;
+
+        stats->total_ns += elapsed;
+        if (elapsed > stats->max_ns)
+            stats->max_ns = elapsed;
+
+        close(sock);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    char *broker_args[16] = {"mqttd", "-m", "epoll", "-w", "1073741824", NULL};
+    size_t num_pubs = DEFAULT_PUBLISHERS, num_sub_threads = DEFAULT_SUB_THREADS;
+    uint64_t start, pub_elapsed, sub_total = 0, sub_max = 0;
+    struct sub_stats *sub_stats;
+    size_t i, seen = 0, expected;
+    pthread_t *pub_threads;
+    struct rlimit limit;
+    char buf[65536];
+    void *pub_sock;
+    int probe, j;
+    ssize_t res;
+    pid_t pid;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: contention_bench mqttd [publishers] [messages] [sub_threads] [mqttd options...]\n");
+        return EXIT_FAILURE;
+    }
+    if (argc > 2)
+        num_pubs = atol(argv[2]);
+    if (argc > 3)
+        num_msgs = atol(argv[3]);
+    if (argc > 4)
+        num_sub_threads = atol(argv[4]);
+    for (j = 5; j < argc && j < 14; j++)
+        broker_args[j] = argv[j];
+    broker_args[j] = NULL;
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit))
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    pid = start_broker(argv[1], broker_args, &port);
+
+    /* Sees every publish, its arrival times the publishing side */
+    probe = connect_subscribed("probe");
+
+    pub_threads = calloc(num_pubs, sizeof(*pub_threads));
+    sub_stats = calloc(num_sub_threads, sizeof(*sub_stats));
+    if (!pub_threads || !sub_stats)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    start = now_ns();
+
+    for (i = 0; i < num_sub_threads; i++)
+    {
+        sub_stats[i].index = i;
+        pthread_create(&sub_stats[i].thread, NULL, subscribe, &sub_stats[i]);
+    }
+    for (i = 0; i < num_pubs; i++)
+        pthread_create(&pub_threads[i], NULL, publish, (void *)i);
+
+    expected = num_pubs * num_msgs;
+    while (seen < expected)
+    {
+        res = recv(probe, buf, sizeof(buf), 0);
+        if (res <= 0)
+        {
+            fprintf(stderr, "probe lost its connection after %zu of %zu\n", seen, expected);
+            break;
+        }
+
+        while (res--)
+            seen += buf[res] == '>';
+    }
+    pub_elapsed = now_ns() - start;
+
+    for (i = 0; i < num_sub_threads; i++)
+    {
+        pthread_join(sub_stats[i].thread, NULL);
+        sub_total += sub_stats[i].total_ns;
+        if (sub_stats[i].max_ns > sub_max)
+            sub_max = sub_stats[i].max_ns;
+    }
+    for (i = 0; i < num_pubs; i++)
+    {
+        pthread_join(pub_threads[i], &pub_sock);
+        close((int)(intptr_t)pub_sock);
+    }
+
+    printf("contention: %zu publishers, %.0f publishes/s\n", num_pubs, seen / (pub_elapsed / 1e9));
+    printf("contention: %zu subscribers, SUB_ACK latency avg %.1f us, max %.1f us\n",
+           num_sub_threads * SUBS_PER_THREAD,
+           sub_total / 1e3 / (num_sub_threads * SUBS_PER_THREAD), sub_max / 1e3);
+
+    close(probe);
+    stop_broker(pid);
+
+    free(sub_stats);
+    free(pub_threads);
+
+    return seen == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
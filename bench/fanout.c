@@ -0,0 +1,141 @@
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+/* Publishes to one topic with many subscribers and times until every
+ * subscriber has received every message.
+ * Usage: fanout_bench mqttd [subscribers] [messages] [mqttd options...] */
+
+enum
+{
+    DEFAULT_SUBSCRIBERS = 10000,
+    DEFAULT_MESSAGES = 100,
+};
+
+int main(int argc, char **argv)
+{
+    char *broker_args[16] = {"mqttd", "-m", "epoll", NULL};
+    size_t num_subs = DEFAULT_SUBSCRIBERS, num_msgs = DEFAULT_MESSAGES;
+    size_t i, done = 0, *seen, deliveries;
+    struct epoll_event event, events[256];
+    int *socks, publisher, epoll_fd, n, j;
+    uint64_t start, elapsed;
+    char buf[65536], *cmds;
+    struct rlimit limit;
+    unsigned short port;
+    size_t cmds_len;
+    ssize_t res;
+    pid_t pid;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: fanout_bench mqttd [subscribers] [messages] [mqttd options...]\n");
+        return EXIT_FAILURE;
+    }
+    if (argc > 2)
+        num_subs = atol(argv[2]);
+    if (argc > 3)
+        num_msgs = atol(argv[3]);
+    for (j = 4; j < argc && j < 14; j++)
+        broker_args[j - 1] = argv[j];
+    broker_args[j - 1] = NULL;
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit))
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    pid = start_broker(argv[1], broker_args, &port);
+
+    socks = calloc(num_subs, sizeof(*socks));
+    seen = calloc(num_subs, sizeof(*seen));
+    if (!socks || !seen)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < num_subs; i++)
+    {
+        socks[i] = connect_client(port);
+        if (socks[i] == -1)
+        {
+            perror("connect");
+            stop_broker(pid);
+            return EXIT_FAILURE;
+        }
+
+        n = snprintf(buf, sizeof(buf), "<sub%zu, CONN><sub%zu, SUB, NEWS>", i, i);
+        send_all(socks[i], buf, n);
+    }
+
+    for (i = 0; i < num_subs; i++)
+        wait_frames(socks[i], 2);
+
+    publisher = connect_client(port);
+    n = snprintf(buf, sizeof(buf), "<publisher, CONN><publisher, SUB, NEWS>");
+    send_all(publisher, buf, n);
+    wait_frames(publisher, 2);
+
+    epoll_fd = epoll_create1(0);
+    for (i = 0; i < num_subs; i++)
+    {
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socks[i], &event);
+    }
+
+    cmds = malloc(num_msgs * 64);
+    for (i = 0, cmds_len = 0; i < num_msgs; i++)
+        cmds_len += sprintf(cmds + cmds_len, "<publisher, PUB, NEWS, message %zu>", i);
+
+    start = now_ns();
+
+    send_all(publisher, cmds, cmds_len);
+
+    while (done < num_subs)
+    {
+        n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events), 10000);
+        if (n <= 0)
+        {
+            fprintf(stderr, "timed out with %zu of %zu subscribers done\n", done, num_subs);
+            break;
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            i = events[j].data.u64;
+            res = recv(socks[i], buf, sizeof(buf), 0);
+            if (res <= 0)
+                continue;
+
+            while (res--)
+                seen[i] += buf[res] == '>';
+
+            if (seen[i] >= num_msgs)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socks[i], NULL);
+                done++;
+            }
+        }
+    }
+
+    elapsed = now_ns() - start;
+    deliveries = done * num_msgs;
+
+    printf("fanout: %zu subscribers, %zu messages, %.3f s, %.0f deliveries/s\n",
+           num_subs, num_msgs, elapsed / 1e9, deliveries / (elapsed / 1e9));
+
+    for (i = 0; i < num_subs; i++)
+        close(socks[i]);
+    close(publisher);
+    stop_broker(pid);
+
+    free(cmds);
+    free(seen);
+    free(socks);
+
+    return done == num_subs ? EXIT_SUCCESS : EXIT_FAILURE;
+}
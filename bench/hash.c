@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "hash.h"
+
+/* Compares the open addressing table with the list bucket table it replaced.
+ * Usage: hash_bench [keys...] */
+
+enum
+{
+    KEY_SIZE = 32,
+};
+
+/* The previous table, kept here as the baseline */
+struct chain_item
+{
+    struct list entry;
+    char *key;
+};
+
+struct chain_table
+{
+    size_t size;
+    struct list *buckets;
+};
+
+static struct chain_table *chain_init(size_t size)
+{
+    struct chain_table *table = malloc(sizeof(*table));
+    size_t i;
+
+    table->size = size;
+    table->buckets = malloc(size * sizeof(*table->buckets));
+    for (i = 0; i < size; i++)
+        list_init(&table->buckets[i]);
+
+    return table;
+}
+
+static void chain_insert(struct chain_table *table, struct chain_item *item)
+{
+    list_add_head(&table->buckets[hash_bytes(item->key, strlen(item->key) + 1) % table->size], &item->entry);
+}
+
+static struct chain_item *chain_lookup(struct chain_table *table, char *key)
+{
+    struct list *bucket = &table->buckets[hash_bytes(key, strlen(key) + 1) % table->size], *cur;
+    struct chain_item *item;
+
+    for (cur = bucket->next; cur != bucket; cur = cur->next)
+    {
+        item = LIST_ENTRY(cur, struct chain_item, entry);
+        if (!strcmp(item->key, key))
+            return item;
+    }
+
+    return NULL;
+}
+
+static void chain_free(struct chain_table *table)
+{
+    free(table->buckets);
+    free(table);
+}
+
+static double per_op(uint64_t start, size_t ops)
+{
+    return (double)(now_ns() - start) / ops;
+}
+
+static void run(size_t num_keys)
+{
+    double insert, hit, miss, remove;
+    struct chain_table *chain;
+    struct chain_item *items;
+    struct hash_table *table;
+    size_t i, found = 0;
+    char *keys, *misses;
+    uint64_t start, op, worst;
+
+    keys = malloc(num_keys * KEY_SIZE);
+    misses = malloc(num_keys * KEY_SIZE);
+    items = malloc(num_keys * sizeof(*items));
+    if (!keys || !misses || !items)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Shuffled order so neither table gets a friendly access pattern */
+    for (i = 0; i < num_keys; i++)
+    {
+        snprintf(keys + i * KEY_SIZE, KEY_SIZE, "client-%zu", (i * 2654435761u) % (num_keys * 4));
+        snprintf(misses + i * KEY_SIZE, KEY_SIZE, "absent-%zu", i);
+        items[i].key = keys + i * KEY_SIZE;
+    }
+
+    /* Sized to one item per bucket, far kinder than the 16 buckets mqttd used */
+    chain = chain_init(num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        chain_insert(chain, &items[i]);
+    insert = per_op(start, num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        found += chain_lookup(chain, keys + i * KEY_SIZE) != NULL;
+    hit = per_op(start, num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        found += chain_lookup(chain, misses + i * KEY_SIZE) != NULL;
+    miss = per_op(start, num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        list_remove(&chain_lookup(chain, keys + i * KEY_SIZE)->entry);
+    remove = per_op(start, num_keys);
+
+    printf("%8zu keys  chained:  insert %6.1f  hit %6.1f  miss %6.1f  remove %6.1f ns/op\n",
+           num_keys, insert, hit, miss, remove);
+    chain_free(chain);
+
+    table = hash_init(num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        hash_insert(table, keys + i * KEY_SIZE, strlen(keys + i * KEY_SIZE) + 1, &items[i]);
+    insert = per_op(start, num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        found += hash_lookup(table, keys + i * KEY_SIZE, strlen(keys + i * KEY_SIZE) + 1) != NULL;
+    hit = per_op(start, num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        found += hash_lookup(table, misses + i * KEY_SIZE, strlen(misses + i * KEY_SIZE) + 1) != NULL;
+    miss = per_op(start, num_keys);
+
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+        hash_remove(table, keys + i * KEY_SIZE, strlen(keys + i * KEY_SIZE) + 1);
+    remove = per_op(start, num_keys);
+
+    printf("%8zu keys  swiss:    insert %6.1f  hit %6.1f  miss %6.1f  remove %6.1f ns/op\n",
+           num_keys, insert, hit, miss, remove);
+    hash_free(table);
+
+    /* Grown from empty, the slowest insert shows what a resize costs */
+    table = hash_init(0);
+    worst = 0;
+    start = now_ns();
+    for (i = 0; i < num_keys; i++)
+    {
+        op = now_ns();
+        hash_insert(table, keys + i * KEY_SIZE, strlen(keys + i * KEY_SIZE) + 1, &items[i]);
+        op = now_ns() - op;
+        if (op > worst)
+            worst = op;
+    }
+    insert = per_op(start, num_keys);
+
+    printf("%8zu keys  growing:  insert %6.1f ns/op, slowest %8.1f us\n", num_keys, insert, worst / 1000.0);
+    hash_free(table);
+
+    /* Both tables found every key and no misses */
+    if (found != 2 * num_keys)
+        fprintf(stderr, "lookups went wrong: %zu of %zu\n", found, 2 * num_keys);
+
+    free(items);
+    free(misses);
+    free(keys);
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[] = {1000, 100000, 1000000}, i;
+    int j;
+
+    if (argc > 1)
+    {
+        for (j = 1; j < argc; j++)
+            run(atol(argv[j]));
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+        run(sizes[i]);
+
+    return 0;
+}
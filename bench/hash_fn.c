@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "hash.h"
+
+/* Compares the hash functions on the kind of keys mqttd hashes: client names
+ * and topics. Usage: hash_fn_bench [names_file topics_file], one key per line,
+ * otherwise corpora shaped like what clients send are generated */
+
+enum
+{
+    CORPUS_SIZE = 100000,
+    MAX_KEY = 1024,
+    ROUNDS = 20,
+};
+
+struct corpus
+{
+    const char *name;
+    size_t count;
+    size_t bytes;
+    char **keys;
+    size_t *lens;
+};
+
+/* Keeps the timed hashes from being optimised out */
+static volatile uint64_t sink;
+
+struct hash_fn
+{
+    const char *name;
+    uint64_t (*fn)(void *key, size_t len);
+};
+
+static const struct hash_fn hash_fns[] =
+{
+    {"fnv1a", hash_fnv1a},
+    {"wyhash", hash_wyhash},
+};
+
+static void corpus_add(struct corpus *corpus, const char *key)
+{
+    size_t len = strlen(key) + 1; /* mqttd hashes the terminator too */
+
+    corpus->keys[corpus->count] = strdup(key);
+    if (!corpus->keys[corpus->count])
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    corpus->lens[corpus->count++] = len;
+    corpus->bytes += len;
+}
+
+static void corpus_alloc(struct corpus *corpus, const char *name, size_t count)
+{
+    corpus->name = name;
+    corpus->count = 0;
+    corpus->bytes = 0;
+    corpus->keys = malloc(count * sizeof(*corpus->keys));
+    corpus->lens = malloc(count * sizeof(*corpus->lens));
+    if (!corpus->keys || !corpus->lens)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void load_corpus(struct corpus *corpus, const char *name, const char *path)
+{
+    char line[MAX_KEY], *end;
+    size_t size = 1024;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    corpus_alloc(corpus, name, size);
+    while (fgets(line, sizeof(line), file))
+    {
+        end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+        if (!*line)
+            continue;
+
+        if (corpus->count == size)
+        {
+            size *= 2;
+            corpus->keys = realloc(corpus->keys, size * sizeof(*corpus->keys));
+            corpus->lens = realloc(corpus->lens, size * sizeof(*corpus->lens));
+            if (!corpus->keys || !corpus->lens)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        corpus_add(corpus, line);
+    }
+
+    fclose(file);
+}
+
+/* Mostly counters glued to a prefix, the worst case for a weak hash */
+static void gen_names(struct corpus *corpus)
+{
+    static const char *people[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+    char key[MAX_KEY];
+    size_t i;
+
+    corpus_alloc(corpus, "client names", CORPUS_SIZE);
+    for (i = 0; i < CORPUS_SIZE; i++)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            snprintf(key, sizeof(key), "client%zu", i);
+            break;
+        case 1:
+            snprintf(key, sizeof(key), "sensor-%02zu-%05zu", i % 97, i);
+            break;
+        case 2:
+            snprintf(key, sizeof(key), "%s%zu", people[i % 8], i / 8);
+            break;
+        default:
+            snprintf(key, sizeof(key), "mqttc-%08zx-%04zx", i * 2654435761u % 0xffffffff, i % 0xffff);
+            break;
+        }
+        corpus_add(corpus, key);
+    }
+}
+
+/* Deep hierarchies sharing long prefixes, plus the short subjects of the README */
+static void gen_topics(struct corpus *corpus)
+{
+    static const char *kinds[] = {"temperature", "humidity", "occupancy", "power"};
+    char key[MAX_KEY];
+    size_t i;
+
+    corpus_alloc(corpus, "topics", CORPUS_SIZE);
+    for (i = 0; i < CORPUS_SIZE; i++)
+    {
+        if (i % 10)
+            snprintf(key, sizeof(key), "campus/building-%zu/floor-%zu/room-%zu/%s", i % 37, i % 11, i / 4,
+                     kinds[i % 4]);
+        else
+            snprintf(key, sizeof(key), "NEWS%zu", i / 10);
+        corpus_add(corpus, key);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Chi-squared of the spread over buckets, per degree of freedom. Around 1 is
+ * what a random function gets, much more means keys pile up in places */
+static double chi_squared(uint64_t *hashes, size_t count, int shift, size_t buckets)
+{
+    double expected = (double)count / buckets, chi = 0, diff;
+    size_t *counts, i;
+
+    counts = calloc(buckets, sizeof(*counts));
+    if (!counts)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < count; i++)
+        counts[(hashes[i] >> shift) & (buckets - 1)]++;
+    for (i = 0; i < buckets; i++)
+    {
+        diff = counts[i] - expected;
+        chi += diff * diff / expected;
+    }
+
+    free(counts);
+    return chi / (buckets - 1);
+}
+
+static void run(struct corpus *corpus, const struct hash_fn *hash_fn)
+{
+    size_t i, round, groups = HASH_GROUP_SIZE, collisions = 0;
+    uint64_t *hashes, start, sum = 0;
+    double elapsed;
+
+    hashes = malloc(corpus->count * sizeof(*hashes));
+    if (!hashes)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns();
+    for (round = 0; round < ROUNDS; round++)
+        for (i = 0; i < corpus->count; i++)
+            sum += hash_fn->fn(corpus->keys[i], corpus->lens[i]);
+    elapsed = now_ns() - start;
+    sink = sum;
+
+    for (i = 0; i < corpus->count; i++)
+        hashes[i] = hash_fn->fn(corpus->keys[i], corpus->lens[i]);
+
+    /* The table takes 7 bits for the control byte and the group from the rest */
+    while (groups * HASH_GROUP_SIZE < corpus->count)
+        groups *= 2;
+
+    printf("%-14s %-7s %7.1f ns/key %8.1f MB/s  control byte chi2 %5.2f  group chi2 %5.2f",
+           corpus->name, hash_fn->name, elapsed / (ROUNDS * corpus->count),
+           corpus->bytes * ROUNDS * 1000.0 / elapsed, chi_squared(hashes, corpus->count, 0, 128),
+           chi_squared(hashes, corpus->count, 7, groups));
+
+    qsort(hashes, corpus->count, sizeof(*hashes), cmp_u64);
+    for (i = 1; i < corpus->count; i++)
+        collisions += hashes[i] == hashes[i - 1];
+    printf("  64 bit collisions %zu\n", collisions);
+
+    free(hashes);
+}
+
+static void free_corpus(struct corpus *corpus)
+{
+    size_t i;
+
+    for (i = 0; i < corpus->count; i++)
+        free(corpus->keys[i]);
+    free(corpus->keys);
+    free(corpus->lens);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpora[2];
+    size_t i, j;
+
+    if (argc == 3)
+    {
+        load_corpus(&corpora[0], "client names", argv[1]);
+        load_corpus(&corpora[1], "topics", argv[2]);
+    }
+    else
+    {
+        gen_names(&corpora[0]);
+        gen_topics(&corpora[1]);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        printf("%s: %zu keys, %.1f bytes on average\n", corpora[i].name, corpora[i].count,
+               (double)corpora[i].bytes / corpora[i].count);
+        for (j = 0; j < sizeof(hash_fns) / sizeof(*hash_fns); j++)
+            run(&corpora[i], &hash_fns[j]);
+        free_corpus(&corpora[i]);
+    }
+
+    return 0;
+}
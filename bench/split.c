@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+#include "utils.h"
+
+/* Compares frame_split() with the split_string() it replaced on PUB frames
+ * shaped like what clients send. frame_split() writes into the frame, so each
+ * round copies it first, which the command path does not have to do */
+
+enum
+{
+    NUM_FRAMES = 10000,
+    ROUNDS = 100,
+};
+
+struct corpus
+{
+    const char *name;
+    char **frames;
+    size_t *lens;
+    size_t bytes;
+};
+
+/* Keeps the timed splits from being optimised out */
+static volatile size_t sink;
+
+static void gen_frames(struct corpus *corpus, const char *name, size_t payload)
+{
+    static const char *kinds[] = {"temperature", "humidity", "occupancy", "power"};
+    char frame[MAX_COMMAND_SIZE], body[MAX_COMMAND_SIZE];
+    size_t i, j;
+
+    corpus->name = name;
+    corpus->bytes = 0;
+    corpus->frames = malloc(NUM_FRAMES * sizeof(*corpus->frames));
+    corpus->lens = malloc(NUM_FRAMES * sizeof(*corpus->lens));
+    if (!corpus->frames || !corpus->lens)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < NUM_FRAMES; i++)
+    {
+        /* Readings and JSON-ish blobs, with the odd comma that is not a delimiter */
+        for (j = 0; j < payload; j++)
+            body[j] = j % 23 == 22 ? ',' : 'a' + (i + j) % 26;
+        body[payload] = '\0';
+
+        if (payload)
+            snprintf(frame, sizeof(frame), "<sensor-%02zu-%05zu, PUB, campus/building-%zu/floor-%zu/%s, %s>", i % 97,
+                     i, i % 37, i % 11, kinds[i % 4], body);
+        else
+            snprintf(frame, sizeof(frame), "<client%zu, PUB, NEWS, %zu>", i, i * 7);
+
+        corpus->frames[i] = strdup(frame);
+        if (!corpus->frames[i])
+        {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        corpus->lens[i] = strlen(frame);
+        corpus->bytes += corpus->lens[i];
+    }
+}
+
+static void free_corpus(struct corpus *corpus)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_FRAMES; i++)
+        free(corpus->frames[i]);
+    free(corpus->frames);
+    free(corpus->lens);
+}
+
+static double bench_split_string(struct corpus *corpus)
+{
+    size_t i, round, sum = 0;
+    uint64_t start;
+    char **toks;
+
+    start = now_ns();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < NUM_FRAMES; i++)
+        {
+            sum += split_string(corpus->frames[i] + 1, corpus->lens[i] - 2, ", ", &toks);
+            sum += toks[3][0];
+            free(toks);
+        }
+    }
+    sink = sum;
+
+    return now_ns() - start;
+}
+
+static double bench_frame_split(struct corpus *corpus)
+{
+    char copy[MAX_COMMAND_SIZE], *toks[MAX_FRAME_TOKENS];
+    size_t lens[MAX_FRAME_TOKENS], i, round, sum = 0;
+    uint64_t start;
+
+    start = now_ns();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < NUM_FRAMES; i++)
+        {
+            memcpy(copy, corpus->frames[i], corpus->lens[i]);
+            sum += frame_split(copy, corpus->lens[i], toks, lens, MAX_FRAME_TOKENS);
+            sum += toks[3][0];
+        }
+    }
+    sink = sum;
+
+    return now_ns() - start;
+}
+
+static void report(struct corpus *corpus, const char *fn, double elapsed)
+{
+    printf("%-16s %-13s %7.1f ns/frame %8.1f MB/s\n", corpus->name, fn, elapsed / (ROUNDS * NUM_FRAMES),
+           corpus->bytes * ROUNDS * 1000.0 / elapsed);
+}
+
+int main(void)
+{
+    static const struct
+    {
+        const char *name;
+        size_t payload;
+    } shapes[] = {
+        {"short PUB", 0},
+        {"64 byte payload", 64},
+        {"512 byte payload", 512},
+    };
+    struct corpus corpus;
+    size_t i;
+
+    for (i = 0; i < sizeof(shapes) / sizeof(*shapes); i++)
+    {
+        gen_frames(&corpus, shapes[i].name, shapes[i].payload);
+        printf("%s: %d frames, %.1f bytes on average\n", corpus.name, NUM_FRAMES, (double)corpus.bytes / NUM_FRAMES);
+        report(&corpus, "split_string", bench_split_string(&corpus));
+        report(&corpus, "frame_split", bench_frame_split(&corpus));
+        free_corpus(&corpus);
+    }
+
+    return 0;
+}
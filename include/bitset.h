@@ -0,0 +1,24 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __MQTTD_BITSET_H
+#define __MQTTD_BITSET_H
+
+/* Set of small integers such as topic and name IDs, one bit each. Starts out
+ * empty when zeroed and grows to fit the largest bit set */
+struct bitset
+{
+    size_t words;
+    uint64_t *bits;
+};
+
+void bitset_init(struct bitset *set);
+void bitset_free(struct bitset *set);
+/* Returns -1 if growing the set fails */
+int bitset_set(struct bitset *set, size_t bit);
+void bitset_clear(struct bitset *set, size_t bit);
+int bitset_test(struct bitset *set, size_t bit);
+/* Adds every member of src to dst. Returns -1 if growing dst fails */
+int bitset_union(struct bitset *dst, struct bitset *src);
+
+#endif /* __MQTTD_BITSET_H */
@@ -4,6 +4,7 @@
 #include "hash.h"
 
 #define BUF_SIZE 1024
+#define RECV_BUF_SIZE 65536
 
 struct client
 {
@@ -0,0 +1,36 @@
+#include <stddef.h>
+
+#include "frame.h"
+
+#ifndef __MQTTD_COMPACT_H
+#define __MQTTD_COMPACT_H
+
+/* The compact framing, a client switches to it with <NAME, CONN, COMPACT>.
+ * A frame is a varint length and then that many bytes of fields. A field is
+ * a varint length, the bytes and a NUL, so it can be used in place as a
+ * string. Varints are little endian base 128 as in MQTT. The fields are the
+ * tokens of the text frame, <a, PUB, NEWS, hi> is a, PUB, NEWS and hi, but
+ * may hold anything, commas and angle brackets included */
+
+enum
+{
+    COMPACT_MAX_VARINT = 5, /* Enough for 32 bits */
+    COMPACT_MAX_FRAME_SIZE = MAX_FRAME_SIZE, /* Of the fields, larger frames close the connection */
+};
+
+/* Calls handler for every complete frame, length included, like
+ * frame_feed(). Returns -1 once the stream cannot be followed, on a bad
+ * length or a frame over COMPACT_MAX_FRAME_SIZE */
+int compact_feed(struct frame_buf *buf, char *data, size_t len, frame_handler handler, void *ctx);
+
+/* Points toks at the fields of a frame, in place, with their lengths in
+ * lens. Fields past max_toks are dropped. Returns the number of fields, 0 if
+ * there are none or the frame is malformed */
+size_t compact_split(char *frame, size_t len, char **toks, size_t *lens, size_t max_toks);
+
+/* The bytes compact_encode() writes for these fields */
+size_t compact_frame_size(const size_t *lens, size_t num_toks);
+/* Writes a frame of the fields into buf, returns its length */
+size_t compact_encode(char *buf, const char *const *toks, const size_t *lens, size_t num_toks);
+
+#endif /* __MQTTD_COMPACT_H */
@@ -0,0 +1,23 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifndef __MQTTD_EPOCH_H
+#define __MQTTD_EPOCH_H
+
+/* Epoch based reclamation. Readers bracket lock-free accesses with
+ * epoch_enter()/epoch_exit(), writers unlink shared memory and hand it to
+ * epoch_retire(), which frees it once no reader can still be looking at it */
+
+typedef void (*epoch_free_fn)(void *ptr);
+
+/* Nestable. Pointers loaded inside stay valid until the matching exit */
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* ptr must already be unreachable for new readers */
+void epoch_retire(epoch_free_fn free_fn, void *ptr);
+
+/* Frees whatever has outlived every reader, returns how much is still waiting */
+size_t epoch_reclaim(void);
+
+#endif /* __MQTTD_EPOCH_H */
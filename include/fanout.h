@@ -0,0 +1,65 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef __MQTTD_FANOUT_H
+#define __MQTTD_FANOUT_H
+
+enum
+{
+    FANOUT_QUEUE_SIZE = 256, /* Chunks each worker can have waiting */
+    FANOUT_CHUNKS_PER_WORKER = 4, /* Extra chunks so idle workers have something to steal */
+};
+
+/* Handles items [begin, end) of whatever the caller is splitting up */
+typedef void (*fanout_fn)(void *ctx, size_t begin, size_t end);
+
+struct fanout_job;
+
+struct fanout_task
+{
+    struct fanout_job *job;
+    size_t begin;
+    size_t end;
+};
+
+/* Owned by one worker, which takes from the bottom. Others steal from the top */
+struct fanout_deque
+{
+    pthread_mutex_t lock;
+    struct fanout_task tasks[FANOUT_QUEUE_SIZE];
+    size_t top;
+    size_t bottom;
+};
+
+struct fanout_worker
+{
+    pthread_t thread;
+    struct fanout_pool *pool;
+    size_t index;
+    struct fanout_deque deque;
+};
+
+struct fanout_pool
+{
+    struct fanout_worker *workers;
+    size_t num_workers;
+    atomic_size_t next_worker; /* Round robin start for new jobs */
+
+    /* Idle workers sleep until chunks are queued */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_size_t pending;
+    int stop;
+};
+
+/* Returns NULL on failure */
+struct fanout_pool *fanout_create(size_t num_workers);
+void fanout_destroy(struct fanout_pool *pool);
+
+/* Splits [0, count) into chunks and runs fn on them across the pool, helping
+ * out on the calling thread. Returns once every chunk has run, so work that
+ * follows is ordered after all of it. Each item is in exactly one chunk */
+void fanout_run(struct fanout_pool *pool, fanout_fn fn, void *ctx, size_t count);
+
+#endif /* __MQTTD_FANOUT_H */
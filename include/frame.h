@@ -0,0 +1,58 @@
+#include <stddef.h>
+
+#ifndef __MQTTD_FRAME_H
+#define __MQTTD_FRAME_H
+
+enum
+{
+    MAX_PAYLOAD_SIZE = 8 * 1024 * 1024, /* Of a publish */
+    MAX_COMMAND_SIZE = 1024, /* Of everything but the payload */
+    MAX_FRAME_SIZE = MAX_PAYLOAD_SIZE + MAX_COMMAND_SIZE, /* Including the surrounding <> */
+    MAX_FRAME_TOKENS = 16, /* Commands use at most 4, the rest are dropped */
+    FRAME_KEEP_SIZE = 64 * 1024, /* Larger buffers are freed once their frame is done */
+};
+
+/* Returns nonzero to stop dispatching the rest of the data */
+typedef int (*frame_handler)(void *ctx, char *frame, size_t len);
+
+/* Holds a frame split across reads until its closing > arrives */
+struct frame_buf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    int discarding; /* Skipping the rest of an oversized frame */
+};
+
+void frame_init(struct frame_buf *buf);
+void frame_free(struct frame_buf *buf);
+
+/* Calls handler for every complete <...> frame, in order. Complete frames are
+ * passed in place, only a trailing partial frame is copied into buf.
+ * Bytes outside of frames are dropped, as are frames over MAX_FRAME_SIZE.
+ * Returns how much of data was used, all of it unless handler stopped */
+size_t frame_feed(struct frame_buf *buf, char *data, size_t len, frame_handler handler, void *ctx);
+
+/* For framings that start with their length. Returns 1 with the sizes of the
+ * header at data and the body after it, 0 if more bytes are needed, -1 if
+ * the stream cannot be followed */
+typedef int (*frame_header_fn)(const unsigned char *data, size_t len, size_t *header_len, size_t *body_len);
+
+/* Like frame_feed(), for frames whose length header tells where they end.
+ * handler is passed whole frames, header included. Returns -1 once header
+ * fails or memory runs out, after which the connection has to be closed */
+int frame_feed_prefixed(struct frame_buf *buf, char *data, size_t len, frame_header_fn header, frame_handler handler,
+                        void *ctx);
+
+/* Splits a <...> frame on ", " in place, without allocating. Tokens are NUL
+ * terminated and point into the frame, with their lengths in lens. Empty
+ * tokens are skipped, as split_string() does, and any past max_toks dropped.
+ * Returns the number of tokens, 0 if there are none or the frame is not
+ * exactly one <...> */
+size_t frame_split(char *frame, size_t len, char **toks, size_t *lens, size_t max_toks);
+
+/* Whether data can be the last token of a <...> frame and split back out as
+ * it is: not empty, with no '>' and no ", " */
+int frame_can_carry(const char *data, size_t len);
+
+#endif /* __MQTTD_FRAME_H */
@@ -23,17 +23,69 @@ void list_add_tail(struct list *list, struct list *elem);
 void list_move_append(struct list *dst, struct list *src);
 void list_remove(struct list *list);
 
+enum
+{
+    HASH_GROUP_SIZE = 16, /* Control bytes compared at once */
+    HASH_MIGRATE_GROUPS = 4, /* Groups moved to the new array per insert or remove */
+};
+
+struct hash_slot
+{
+    uint64_t hash;
+    void *key;
+    size_t key_len;
+    void *value;
+};
+
+struct hash_array
+{
+    size_t capacity; /* Slots, a power of two and at least one group. 0 if unused */
+    size_t growth_left; /* Inserts into empty slots before it has to be replaced */
+    int8_t *ctrl;
+    struct hash_slot *slots;
+};
+
+/* Open addressing table in the style of a Swiss table. Each slot has a control
+ * byte holding 7 bits of its hash, and lookups compare a whole group of them
+ * at once before touching any slot. Keys are not copied, they must stay valid
+ * for as long as they are in the table.
+ *
+ * The table grows past 7/8 load and shrinks below 1/8. Resizing allocates the
+ * new array and then moves a few groups from the old one on every insert and
+ * remove, so no single operation pays for the whole rehash. Lookups check both
+ * arrays until the move is done, and never modify the table */
 struct hash_table
 {
-    size_t size;
-    struct list *buckets;
+    struct hash_array cur;
+    struct hash_array old; /* Being moved into cur */
+    size_t migrated; /* Groups of old already moved */
+    size_t old_count; /* Items still waiting in old */
+    size_t count;
+    size_t min_capacity; /* Never shrinks below what hash_init() was asked for */
 };
 
+/* size is the number of items expected, the table grows past it as needed */
 struct hash_table *hash_init(size_t size);
-/* Freeing a non-empty table will result in memory leaks */
+/* Only frees the table, whatever the values point to is left alone */
 void hash_free(struct hash_table *table);
-void hash_insert(struct hash_table *table, void *key, size_t key_len, struct list *elem);
+/* The key must not be in the table already. Returns -1 if allocation fails */
+int hash_insert(struct hash_table *table, void *key, size_t key_len, void *value);
+/* Return the value stored under key, or NULL */
+void *hash_lookup(struct hash_table *table, void *key, size_t key_len);
+void *hash_remove(struct hash_table *table, void *key, size_t key_len);
+/* The same, for callers that kept hash_bytes() of the key around instead of
+ * hashing the same string again for every table it is looked up in */
+int hash_insert_hashed(struct hash_table *table, void *key, size_t key_len, uint64_t hash, void *value);
+void *hash_lookup_hashed(struct hash_table *table, void *key, size_t key_len, uint64_t hash);
+void *hash_remove_hashed(struct hash_table *table, void *key, size_t key_len, uint64_t hash);
+/* Returns the next value from *iter onwards, or NULL at the end. Start with
+ * *iter at 0. The table must not be modified until iteration is done */
+void *hash_next(struct hash_table *table, size_t *iter);
+/* wyhash unless built with -Dhash=fnv1a. Both stay available to compare */
 uint64_t hash_bytes(void *key, size_t len);
+uint64_t hash_wyhash(void *key, size_t len);
+uint64_t hash_fnv1a(void *key, size_t len);
 int hash_empty(struct hash_table *table);
+size_t hash_count(struct hash_table *table);
 
 #endif /* __MQTTD_HASH_H */
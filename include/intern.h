@@ -0,0 +1,31 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __MQTTD_INTERN_H
+#define __MQTTD_INTERN_H
+
+/* Client and topic names are interned so that every holder of a name shares
+ * one refcounted copy. Equal names are the same pointer and the same ID, so
+ * they are compared and hashed as integers once interned */
+struct interned
+{
+    atomic_uint refs;
+    uint32_t id; /* Small, reused once the name is freed, so fit to index arrays by */
+    uint64_t hash; /* hash_bytes() of str, terminator included */
+    size_t len; /* strlen(str) + 1 */
+    char str[];
+};
+
+/* Returns the canonical copy of str with a reference taken, creating it if
+ * needed. NULL if allocation fails */
+struct interned *intern(const char *str);
+/* The same, but NULL rather than creating it if str is not interned yet */
+struct interned *intern_find(const char *str);
+struct interned *intern_get(struct interned *name);
+/* Frees the name and releases its ID with the last reference */
+void intern_put(struct interned *name);
+/* Every ID in use is below this */
+uint32_t intern_id_limit(void);
+
+#endif /* __MQTTD_INTERN_H */
@@ -0,0 +1,111 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+#ifndef __MQTTD_MQTT_H
+#define __MQTTD_MQTT_H
+
+/* MQTT 3.1.1 control packet types, the high nibble of the first byte */
+enum mqtt_type
+{
+    MQTT_CONNECT = 1,
+    MQTT_CONNACK = 2,
+    MQTT_PUBLISH = 3,
+    MQTT_SUBSCRIBE = 8,
+    MQTT_SUBACK = 9,
+    MQTT_PINGREQ = 12,
+    MQTT_PINGRESP = 13,
+    MQTT_DISCONNECT = 14,
+};
+
+enum
+{
+    MQTT_MAX_HEADER_SIZE = 5, /* Type and up to 4 bytes of remaining length */
+    MQTT_MAX_PACKET_SIZE = MAX_FRAME_SIZE, /* Of a PUBLISH, larger ones close the connection */
+    MQTT_MAX_CONTROL_SIZE = MAX_COMMAND_SIZE, /* Of any other packet */
+    MQTT_CONNACK_SIZE = 4,
+    MQTT_PINGRESP_SIZE = 2,
+};
+
+/* CONNACK return codes */
+enum
+{
+    MQTT_CONNACK_ACCEPTED = 0,
+    MQTT_CONNACK_BAD_PROTOCOL = 1,
+    MQTT_CONNACK_ID_REJECTED = 2,
+};
+
+enum
+{
+    MQTT_SUBACK_FAILURE = 0x80,
+};
+
+/* A packet without its fixed header, body points into the fed data */
+struct mqtt_packet
+{
+    enum mqtt_type type;
+    unsigned int flags; /* Low nibble of the first byte */
+    const unsigned char *body;
+    size_t len;
+};
+
+struct mqtt_connect
+{
+    const char *client_id;
+    size_t client_id_len;
+    int clean_session;
+    uint16_t keep_alive; /* In seconds */
+};
+
+struct mqtt_subscribe
+{
+    uint16_t packet_id;
+    size_t num_filters;
+    const unsigned char *next; /* Of mqtt_next_filter() */
+    const unsigned char *end;
+};
+
+struct mqtt_publish
+{
+    const char *topic;
+    size_t topic_len;
+    unsigned int qos;
+    uint16_t packet_id; /* 0 at QoS 0 */
+    const char *payload;
+    size_t payload_len;
+};
+
+/* Returns nonzero to stop dispatching the rest of the data */
+typedef int (*mqtt_handler)(void *ctx, struct mqtt_packet *packet);
+
+/* Calls handler for every complete packet, in order. Like frame_feed(), only
+ * a trailing partial packet is copied into buf. Returns -1 once the stream
+ * cannot be followed, on a bad length or a packet over MQTT_MAX_PACKET_SIZE
+ * or MQTT_MAX_CONTROL_SIZE, after which the connection has to be closed */
+int mqtt_feed(struct frame_buf *buf, char *data, size_t len, mqtt_handler handler, void *ctx);
+
+/* Returns -1 if the packet is malformed, which closes the connection, or else
+ * the CONNACK return code to answer with */
+int mqtt_parse_connect(struct mqtt_packet *packet, struct mqtt_connect *connect);
+/* Checks every topic filter up front, so mqtt_next_filter() cannot fail.
+ * Returns -1 if the packet is malformed */
+int mqtt_parse_subscribe(struct mqtt_packet *packet, struct mqtt_subscribe *subscribe);
+/* Returns 0 once every filter has been returned */
+int mqtt_next_filter(struct mqtt_subscribe *subscribe, const char **filter, size_t *len, unsigned int *qos);
+int mqtt_parse_publish(struct mqtt_packet *packet, struct mqtt_publish *publish);
+
+/* Writes a fixed header into buf, which needs MQTT_MAX_HEADER_SIZE bytes.
+ * Returns its length */
+size_t mqtt_encode_header(unsigned char *buf, enum mqtt_type type, unsigned int flags, size_t remaining);
+/* buf needs MQTT_CONNACK_SIZE bytes */
+void mqtt_encode_connack(unsigned char *buf, int session_present, int code);
+/* buf needs MQTT_MAX_HEADER_SIZE + 2 + count bytes. Returns the length */
+size_t mqtt_encode_suback(unsigned char *buf, uint16_t packet_id, const unsigned char *codes, size_t count);
+/* buf needs MQTT_PINGRESP_SIZE bytes */
+void mqtt_encode_pingresp(unsigned char *buf);
+/* The PUBLISH header up to the payload, in buf of MQTT_MAX_HEADER_SIZE + 2 +
+ * topic_len bytes. Returns its length, the payload follows it */
+size_t mqtt_encode_publish(unsigned char *buf, const char *topic, size_t topic_len, size_t payload_len);
+
+#endif /* __MQTTD_MQTT_H */
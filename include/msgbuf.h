@@ -0,0 +1,36 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __MQTTD_MSGBUF_H
+#define __MQTTD_MSGBUF_H
+
+/* An encoded frame, built once per publish and shared by every queue that
+ * sends it. Must not be modified once it has been handed out */
+struct msgbuf
+{
+    atomic_int refs;
+    uint64_t stamp; /* When it was published, in ms, for expiry */
+    uint64_t seq; /* In its topic's log, UINT64_MAX if it was never logged */
+    int binary; /* Holds a payload a text frame cannot carry */
+    int encoding; /* 0 unless made by msgbuf_encoded() */
+    struct msgbuf *_Atomic alt; /* The same message in other encodings, holds a reference */
+    size_t len;
+    char data[];
+};
+
+/* Returns a new buffer with the frame re-encoded, or NULL */
+typedef struct msgbuf *(*msgbuf_encoder)(struct msgbuf *buf, int encoding);
+
+/* Returns a buffer with room for len bytes and one reference, or NULL */
+struct msgbuf *msgbuf_alloc(size_t len);
+struct msgbuf *msgbuf_get(struct msgbuf *buf);
+/* Frees the buffer when the last reference is dropped */
+void msgbuf_put(struct msgbuf *buf);
+
+/* Returns buf in another encoding, made by encode the first time any thread
+ * asks for it and then kept with buf. Valid for as long as buf is, NULL if
+ * encode fails */
+struct msgbuf *msgbuf_encoded(struct msgbuf *buf, int encoding, msgbuf_encoder encode);
+
+#endif /* __MQTTD_MSGBUF_H */
@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgbuf.h"
+
+#ifndef __MQTTD_MSGLOG_H
+#define __MQTTD_MSGLOG_H
+
+enum
+{
+    MSGLOG_INITIAL_SIZE = 64,
+};
+
+typedef void (*msglog_replay_fn)(void *ctx, struct msgbuf *frame);
+typedef void (*msglog_append_fn)(void *ctx, uint64_t seq, struct msgbuf *frame);
+
+/* Append-only ring of one topic's publishes, kept for offline subscribers.
+ * Every frame gets the next sequence number, and frame seq sits at
+ * frames[seq & (capacity - 1)] for first_seq <= seq < next_seq. Readers keep
+ * their own cursor, the oldest frames are dropped once every cursor is past */
+struct msglog
+{
+    pthread_mutex_t lock;
+    uint64_t first_seq;
+    uint64_t next_seq;
+    size_t capacity; /* Power of two, 0 until the first append */
+    struct msgbuf **frames;
+    uint64_t *offsets; /* Bytes appended before each frame, indexed like frames */
+    uint64_t appended; /* Bytes ever appended */
+
+    /* If set, the bytes held are also counted here, for a budget shared
+     * between logs */
+    atomic_size_t *usage;
+
+    /* If set, called with the log locked on every append, in sequence order */
+    msglog_append_fn on_append;
+    void *on_append_ctx;
+};
+
+void msglog_init(struct msglog *log);
+void msglog_free(struct msglog *log);
+/* Takes a reference to frame and sets its seq. Returns -1 if the ring cannot
+ * grow */
+int msglog_append(struct msglog *log, struct msgbuf *frame);
+/* The sequence number the next append gets, a cursor that replays nothing yet */
+uint64_t msglog_tail(struct msglog *log);
+/* Calls fn in order on every frame still held from cursor onwards, with the
+ * log locked. Returns the cursor just past the last one */
+uint64_t msglog_replay(struct msglog *log, uint64_t cursor, msglog_replay_fn fn, void *ctx);
+/* Like msglog_replay(), also storing the cursor it returns in mark before
+ * the log is unlocked. A reader already taking live frames skips those with
+ * a seq below mark, the replay gave them to it */
+uint64_t msglog_replay_mark(struct msglog *log, uint64_t cursor, msglog_replay_fn fn, void *ctx,
+                            _Atomic uint64_t *mark);
+/* Drops every frame before cursor */
+void msglog_trim(struct msglog *log, uint64_t cursor);
+size_t msglog_count(struct msglog *log);
+/* The bytes held, and those a reader at cursor has yet to replay */
+size_t msglog_bytes(struct msglog *log);
+size_t msglog_bytes_since(struct msglog *log, uint64_t cursor);
+/* Drops frames from the front, oldest first, until at least bytes are freed
+ * or the next is stamped after stamp. Returns how many were dropped */
+size_t msglog_evict(struct msglog *log, size_t bytes, uint64_t stamp);
+/* Drops the frames at the front stamped before stamp. Returns how many */
+size_t msglog_expire(struct msglog *log, uint64_t stamp);
+/* The stamp of the oldest frame held, UINT64_MAX if none is */
+uint64_t msglog_oldest_stamp(struct msglog *log);
+/* The sequence number of the oldest frame held, or the tail if none is */
+uint64_t msglog_head(struct msglog *log);
+/* For rebuilding a log. Puts frame at seq, dropping everything held if that
+ * leaves a gap. Frames before the tail are ignored */
+int msglog_restore(struct msglog *log, uint64_t seq, struct msgbuf *frame);
+/* For rebuilding a log. Moves the tail up to seq if it is below */
+void msglog_seek(struct msglog *log, uint64_t seq);
+
+#endif /* __MQTTD_MSGLOG_H */
@@ -0,0 +1,52 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "msgbuf.h"
+
+#ifndef __MQTTD_OUTQ_H
+#define __MQTTD_OUTQ_H
+
+struct outq_node
+{
+    struct outq_node *_Atomic next;
+    struct outq_node *unsent_next;
+    struct msgbuf *buf; /* Referenced shared frame, NULL if the data is inline */
+    char *data;
+    size_t len;
+    char inline_data[];
+};
+
+/* Lock-free multi-producer single-consumer queue of outbound frames.
+ * Any thread may push, only the thread flushing the socket may consume */
+struct outq
+{
+    struct outq_node *_Atomic head;
+    struct outq_node *tail;
+    struct outq_node stub;
+
+    /* Popped by the consumer but not fully written yet */
+    struct outq_node *unsent;
+    struct outq_node *unsent_last;
+    size_t sent; /* Bytes of the first unsent node already written */
+
+    atomic_size_t bytes; /* Queued and unsent bytes, for watermarks */
+};
+
+void outq_init(struct outq *q);
+/* Consumer only */
+void outq_free(struct outq *q);
+
+/* Copies data into a new node. Returns -1 if allocation fails */
+int outq_push(struct outq *q, char *data, size_t len);
+/* Queues a shared frame without copying it, taking a reference */
+int outq_push_buf(struct outq *q, struct msgbuf *buf);
+
+/* Consumer only: points iov at up to max unsent buffers, returns the count */
+size_t outq_fill_iov(struct outq *q, struct iovec *iov, size_t max);
+/* Consumer only: releases len bytes that have been written */
+void outq_consume(struct outq *q, size_t len);
+
+size_t outq_bytes(struct outq *q);
+
+#endif /* __MQTTD_OUTQ_H */
@@ -1,53 +1,235 @@
+#include <stdatomic.h>
 #include <stdint.h>
 #include <pthread.h>
 
+#include "bitset.h"
+#include "frame.h"
 #include "hash.h"
+#include "intern.h"
+#include "msgbuf.h"
+#include "msglog.h"
+#include "outq.h"
+#include "timer.h"
+#include "verb.h"
 
-struct connection
+#ifndef __MQTTD_SERVER_H
+#define __MQTTD_SERVER_H
+
+enum
+{
+    READ_BUF_SIZE = 65536, /* Large enough to take many pipelined frames, or a good part of a large one, per read */
+    MAX_WRITE_IOV = 256, /* Frames coalesced into one sendmsg */
+    DEFAULT_HIGH_WATERMARK = 4 * 1024 * 1024,
+    DEFAULT_LOW_WATERMARK = 1024 * 1024,
+    DEFAULT_FANOUT_THRESHOLD = 2048,
+    DEFAULT_SNAPSHOT_INTERVAL = 60,
+    TIMER_TICK_MS = 100, /* How often expiry is checked */
+};
+
+/* What goes when the messages kept for offline clients pass the budget */
+enum retain_policy
+{
+    RETAIN_DROP_OLDEST, /* The oldest messages, whichever topic they are on */
+    RETAIN_DROP_SESSION, /* The offline client with the largest backlog */
+    RETAIN_STOP_TOPIC, /* Everything kept for the topic holding the most, which
+                        * keeps nothing more until no offline client
+                        * subscribes to it */
+};
+
+/* What a connection speaks, decided by the listener that accepted it. Also
+ * the msgbuf encoding its publishes are sent in */
+enum protocol
+{
+    PROTOCOL_TEXT, /* <...> frames */
+    PROTOCOL_MQTT, /* MQTT 3.1.1 packets */
+    PROTOCOL_COMPACT, /* Length prefixed frames, switched to from text */
+};
+
+enum server_mode
+{
+    SERVER_MODE_THREAD, /* One thread per connection */
+    SERVER_MODE_EPOLL, /* Connections multiplexed onto a fixed set of reactors */
+    SERVER_MODE_SHARD, /* One shared-nothing reactor and listener per core */
+    SERVER_MODE_URING, /* Shard mode driven by io_uring instead of epoll */
+};
+
+struct server_config
+{
+    unsigned short port;
+    unsigned short mqtt_port; /* 0 for no MQTT listener */
+    int mode;
+    size_t num_threads; /* Number of reactors, ignored in thread mode */
+    int pin_cpus; /* Pin each shard's reactor to a CPU */
+
+    /* Past the high watermark of queued bytes a connection drops messages
+     * until it drains below the low watermark */
+    size_t high_watermark;
+    size_t low_watermark;
+
+    /* Topics with at least this many subscribers are delivered to by the
+     * fan-out pool, 0 always delivers on the publisher's thread */
+    size_t fanout_threshold;
+
+    /* Offline sessions and the publishes kept for them are stored here and
+     * survive restarts, NULL keeps them in memory only */
+    const char *store_dir;
+    unsigned int commit_ms; /* Longest a stored change waits to be synced */
+
+    /* Subscriptions are written here every snapshot_interval seconds and
+     * restored from it on startup, NULL for none */
+    const char *snapshot_path;
+    unsigned int snapshot_interval;
+
+    /* In ms, 0 for never. Offline clients are dropped after session_expiry,
+     * messages kept for them after message_ttl, and connections that send
+     * nothing for idle_timeout are closed */
+    uint64_t session_expiry;
+    uint64_t message_ttl;
+    uint64_t idle_timeout;
+
+    /* Bytes of messages kept for offline clients, 0 for no limit. Past it
+     * retain_policy frees an eighth of the budget */
+    size_t retain_budget;
+    int retain_policy;
+};
+
+/* A slice of the online clients. Every connection belongs to exactly one */
+struct shard
+{
+    struct hash_table *online_clients;
+    pthread_mutex_t online_lock;
+
+    /* Publishes from other shards waiting to be delivered locally */
+    struct list inbox;
+    pthread_mutex_t inbox_lock;
+    int inbox_fd;
+
+    atomic_size_t verb_counts[NUM_VERBS]; /* Commands handled, relaxed */
+};
+
+/* A publish handed off to another shard */
+struct shard_msg
 {
     struct list entry;
+    struct topic *topic;
+    struct msgbuf *frame;
+};
+
+struct connection;
+
+struct reactor
+{
+    pthread_t thread;
+    int epoll_fd;
+    int listen_sock; /* -1 unless the reactor accepts its own connections */
+    int mqtt_listen_sock; /* Likewise, and only with an MQTT port */
+    struct shard *shard;
+    char buf[READ_BUF_SIZE];
+
+    /* Connections with queued output, flushed by the reactor's thread */
+    struct list ready;
+    pthread_mutex_t ready_lock;
+    int wake_fd;
+
+    /* Set by backends that do not flush with sendmsg() */
+    void (*flush)(struct connection *conn);
+
+    /* Idle timeouts of the reactor's connections, only touched by its thread */
+    struct timer_wheel idle_timers;
+};
+
+struct connection
+{
     pthread_t thread;
+    struct reactor *reactor; /* NULL in thread mode */
+    struct shard *shard;
+    void *io_data; /* Backend specific state */
     int sock;
+    enum protocol protocol;
+    int clean_session; /* MQTT clients may ask for no session to be kept */
     int closing; /* 1 for closing */
-    char *name;
+    int closed; /* Socket has been closed, only the memory is left */
+    atomic_int refs;
+    struct frame_buf frame;
+
+    struct outq outq;
+    atomic_int flush_pending; /* On the reactor's ready list or thread woken */
+    struct list ready_entry;
+    int wake_fd; /* Thread mode only */
+    int write_failed;
+    atomic_int throttled; /* Over the high watermark */
+    atomic_size_t dropped;
+
+    struct interned *name;
     struct list subbed_topics;
+    struct bitset topic_ids; /* Of subbed_topics */
+
+    struct timer idle_timer; /* On the reactor's wheel, unused in thread mode */
 };
 
 struct offline_client
 {
-    struct list entry;
-    uint64_t disc_time;
-    char *name;
+    struct interned *name;
     struct list subs;
+    struct bitset topic_ids; /* Of subs */
+    uint64_t *cursors; /* By topic ID, the first message of each log still to replay */
+    int stored; /* Has an OFFLINE record in the store */
+    uint64_t segment; /* Holding that record, pinned */
+    struct timer expiry;
 };
 
-struct topic
+struct subscriber
 {
-    struct list entry;
-    char *name;
-    struct hash_table *subs;
-    pthread_mutex_t subs_lock;
+    struct interned *client_name;
+    struct connection *_Atomic conn; /* Referenced, NULL while disconnected */
+    _Atomic uint64_t replayed; /* Logged frames before this seq were replayed to it */
+    atomic_int kept; /* Its session outlives the connection, so snapshots include it */
 };
 
-struct subscriber
+/* Immutable set of a topic's subscribers. Every SUB or removal builds a new
+ * one, the old one is freed once no publisher can still be reading it */
+struct sub_snapshot
 {
-    struct list entry;
-    char *client_name;
+    size_t count;
+    struct bitset name_ids; /* Of the subscribers' client names */
+    struct subscriber *subs[];
 };
 
-struct subscription
+struct topic
 {
-    struct list entry;
-    char *topic_name;
+    struct interned *name;
+    size_t id; /* Dense, from 0 */
+    struct sub_snapshot *_Atomic subs; /* Read inside an epoch */
+    pthread_mutex_t subs_lock; /* Serialises writers, readers never take it */
+    struct msglog log; /* Publishes kept while anyone is offline */
+    struct timer expiry; /* Of the oldest message in the log */
+    atomic_int retaining; /* Cleared by RETAIN_STOP_TOPIC */
+    atomic_size_t num_offline; /* Offline clients subscribed, changed under offline_lock */
 };
 
-struct queued_msg
+struct subscription
 {
-    char *message;
-    char *topic;
-    char *sender;
-    uint64_t time;
     struct list entry;
+    struct topic *topic;
+    struct subscriber *subscriber;
 };
 
-void start_server(unsigned short port);
+void start_server(struct server_config *config);
+
+/* Used by the I/O backends */
+struct connection *new_connection(int sock, struct shard *shard, enum protocol protocol);
+void close_connection(struct connection *conn);
+/* Pushes back the idle timeout, on the reactor's thread */
+void conn_active(struct connection *conn);
+void conn_put(struct connection *conn);
+void init_reactor_queue(struct reactor *reactor);
+/* Flushes every connection queued on the reactor, on the reactor's thread */
+void flush_ready_conns(struct reactor *reactor);
+/* Splits received data into frames or packets and dispatches each of them */
+void handle_data(struct connection *conn, char *data, size_t len);
+void drain_shard_inbox(struct shard *shard);
+int open_listener(unsigned short port, int reuse_port);
+void pin_thread(pthread_t thread, size_t index);
+void raise_fd_limit(void);
+
+#endif /* __MQTTD_SERVER_H */
@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+#ifndef __MQTTD_SNAPSHOT_H
+#define __MQTTD_SNAPSHOT_H
+
+struct snapshot_buf
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Builds a snapshot of which clients subscribe to which topics. Every client
+ * name is written once, topics refer to names by index */
+struct snapshot_builder
+{
+    struct hash_table *names; /* Client name to its index + 1 */
+    uint32_t num_names;
+    uint32_t num_topics;
+    struct snapshot_buf name_buf;
+    struct snapshot_buf topic_buf;
+};
+
+typedef void (*snapshot_sub_fn)(void *ctx, const char *topic, const char *client);
+
+int snapshot_init(struct snapshot_builder *builder);
+void snapshot_free(struct snapshot_builder *builder);
+/* Starts a topic, followed by num_subs calls to snapshot_add_sub(). Names
+ * are NUL terminated, len includes the terminator. Client names are kept as
+ * keys and must stay valid until the builder is freed */
+int snapshot_add_topic(struct snapshot_builder *builder, const char *name, size_t len, size_t num_subs);
+int snapshot_add_sub(struct snapshot_builder *builder, const char *client, size_t len);
+/* Replaces the file at path in one step, a crash leaves either the old
+ * snapshot or the new one */
+int snapshot_write(struct snapshot_builder *builder, const char *path);
+
+/* Maps the snapshot at path and calls fn on every subscription in it.
+ * Returns the number of subscriptions, or -1 if there is no valid snapshot */
+long snapshot_load(const char *path, snapshot_sub_fn fn, void *ctx);
+
+#endif /* __MQTTD_SNAPSHOT_H */
@@ -0,0 +1,85 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+#ifndef __MQTTD_STORE_H
+#define __MQTTD_STORE_H
+
+enum
+{
+    STORE_DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024,
+    STORE_DEFAULT_COMMIT_MS = 10,
+    STORE_NO_STREAM = 0xffff,
+};
+
+/* On-disk layout of a record, followed by len bytes of data and padding up
+ * to 8 bytes. A zero type marks the unwritten end of a segment */
+struct store_record
+{
+    uint32_t len;
+    uint16_t type;
+    uint16_t stream; /* STORE_NO_STREAM if not part of a sequenced stream */
+    uint64_t seq;
+    uint64_t check; /* Catches records torn by a crash */
+};
+
+struct store_segment
+{
+    struct list entry;
+    uint64_t number;
+    int fd;
+    char *map; /* NULL once full and synced */
+    int full;
+    size_t written; /* Bytes used, header included */
+    size_t synced; /* 0 until the flusher has synced the new file itself */
+    size_t pins;
+    uint64_t *stream_end; /* Per stream, one past the highest seq written here, 0 for none */
+};
+
+/* Durable log of records in fixed size mmap'd segment files. Appends only
+ * copy into the mapping; a flusher thread syncs everything written since
+ * its last pass every commit interval, so any number of appends share one
+ * sync. A crash loses at most the last interval.
+ *
+ * Segments are dropped oldest first once nothing pins them and every stream
+ * has been trimmed past what they hold */
+struct store
+{
+    char *dir;
+    int dir_fd;
+    size_t segment_size;
+    size_t num_streams;
+    unsigned int commit_ms;
+    struct list segments; /* Oldest first, appends go to the last */
+
+    pthread_mutex_t lock;
+    pthread_mutex_t flush_lock; /* Keeps segments mapped while they are synced */
+    pthread_cond_t stop_cond;
+    int stop;
+    pthread_t flusher;
+};
+
+typedef void (*store_record_fn)(void *ctx, uint64_t segment, struct store_record *record, void *data);
+
+/* Opens or creates the store in dir and calls fn on every record already in
+ * it, oldest first. Returns NULL on failure */
+struct store *store_open(const char *dir, size_t segment_size, unsigned int commit_ms, size_t num_streams,
+                         store_record_fn fn, void *ctx);
+/* Syncs whatever is still pending */
+void store_close(struct store *store);
+/* Returns -1 on failure, otherwise sets *segment to the number of the segment
+ * the record went to if segment is not NULL */
+int store_append(struct store *store, uint16_t type, uint16_t stream, uint64_t seq, void *data, size_t len,
+                 uint64_t *segment);
+/* A pinned segment and every one after it are kept */
+void store_pin(struct store *store, uint64_t segment);
+void store_unpin(struct store *store, uint64_t segment);
+/* first_seqs holds the first seq still needed of each stream. Drops the
+ * segments that are no longer needed */
+void store_trim(struct store *store, const uint64_t *first_seqs);
+/* Syncs everything appended so far */
+void store_sync(struct store *store);
+
+#endif /* __MQTTD_STORE_H */
@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+#ifndef __MQTTD_TIMER_H
+#define __MQTTD_TIMER_H
+
+enum
+{
+    TIMER_LEVEL_BITS = 6,
+    TIMER_SLOTS = 1 << TIMER_LEVEL_BITS,
+    TIMER_LEVELS = 6, /* 64^6 ms, a little over two years */
+};
+
+struct timer;
+
+typedef void (*timer_fn)(struct timer *timer, void *ctx);
+
+struct timer
+{
+    struct list entry; /* Empty while not pending */
+    uint64_t expires; /* In ms */
+    timer_fn fn;
+    void *ctx;
+};
+
+/* Hierarchical timing wheel with a 1 ms tick. Level 0 has a slot per ms of
+ * the next 64, each level above covers 64 times the span of the one below.
+ * Adding and cancelling are O(1), and a timer is moved down a level only when
+ * the tick reaches its slot, so expiring is O(1) per timer as well.
+ *
+ * Not thread safe, callers serialise access */
+struct timer_wheel
+{
+    uint64_t now; /* Last tick processed */
+    size_t count; /* Pending timers */
+    struct list slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_init(struct timer *timer, timer_fn fn, void *ctx);
+/* Arms the timer for expires, or moves it if it is already pending. A time
+ * that has passed fires on the next tick */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+int timer_pending(struct timer *timer);
+/* Runs every timer due up to now. Callbacks may add and cancel timers,
+ * including their own. Returns how many ran */
+size_t timer_advance(struct timer_wheel *wheel, uint64_t now);
+
+#endif /* __MQTTD_TIMER_H */
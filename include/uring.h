@@ -0,0 +1,11 @@
+#include <stddef.h>
+
+#include "server.h"
+
+#ifndef __MQTTD_URING_H
+#define __MQTTD_URING_H
+
+/* Runs one io_uring reactor per shard. Does not return */
+void start_uring(struct server_config *config, struct shard *shards, size_t num_shards);
+
+#endif /* __MQTTD_URING_H */
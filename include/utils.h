@@ -13,5 +13,7 @@
 size_t split_string(char *str, size_t str_len, char *delim, char ***out);
 
 uint64_t get_current_time(void);
+/* Monotonic, only meaningful as a difference */
+uint64_t get_time_ms(void);
 
 #endif /* __MQTTD_UTILS_H */
@@ -0,0 +1,32 @@
+#include <stddef.h>
+
+#ifndef __MQTTD_VERB_H
+#define __MQTTD_VERB_H
+
+/* Every command the server knows, indexes into per-verb tables */
+enum verb
+{
+    VERB_CONN,
+    VERB_SUB,
+    VERB_PUB,
+    VERB_DISC,
+    VERB_RECONNECT,
+    VERB_STATS,
+    NUM_VERBS,
+    VERB_NONE = NUM_VERBS,
+};
+
+struct verb_info
+{
+    const char *name;
+    size_t len;
+    int leading; /* Comes first, the others follow the client name */
+};
+
+extern const struct verb_info verb_info[NUM_VERBS];
+
+/* Constant time however many verbs there are. Returns VERB_NONE for anything
+ * that is not exactly a verb */
+enum verb verb_lookup(const char *str, size_t len);
+
+#endif /* __MQTTD_VERB_H */
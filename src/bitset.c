@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitset.h"
+
+void bitset_init(struct bitset *set)
+{
+    set->words = 0;
+    set->bits = NULL;
+}
+
+void bitset_free(struct bitset *set)
+{
+    free(set->bits);
+    bitset_init(set);
+}
+
+static int grow(struct bitset *set, size_t words)
+{
+    size_t size = set->words ? set->words : 1;
+    uint64_t *bits;
+
+    if (words <= set->words)
+        return 0;
+
+    while (size < words)
+        size *= 2;
+
+    bits = realloc(set->bits, size * sizeof(*bits));
+    if (!bits)
+    {
+        perror("realloc");
+        return -1;
+    }
+
+    memset(bits + set->words, 0, (size - set->words) * sizeof(*bits));
+    set->bits = bits;
+    set->words = size;
+
+    return 0;
+}
+
+int bitset_set(struct bitset *set, size_t bit)
+{
+    if (grow(set, bit / 64 + 1))
+        return -1;
+
+    set->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    return 0;
+}
+
+void bitset_clear(struct bitset *set, size_t bit)
+{
+    if (bit / 64 < set->words)
+        set->bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+int bitset_test(struct bitset *set, size_t bit)
+{
+    return bit / 64 < set->words && (set->bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+int bitset_union(struct bitset *dst, struct bitset *src)
+{
+    size_t i;
+
+    if (grow(dst, src->words))
+        return -1;
+
+    for (i = 0; i < src->words; i++)
+        dst->bits[i] |= src->bits[i];
+
+    return 0;
+}
@@ -12,6 +12,7 @@
 #include <unistd.h>
 
 #include "client.h"
+#include "frame.h"
 #include "hash.h"
 #include "utils.h"
 
@@ -141,25 +142,58 @@ static uint64_t calc_net_timeout(void)
     return listener->expire - get_current_time() + 1;
 }
 
+static int handle_frame(void *ctx, char *frame, size_t len)
+{
+    size_t num_toks;
+    char **toks;
+
+    if (len <= 2)
+        return 0;
+
+    num_toks = split_string(frame + 1, len - 2, ", ", &toks);
+    if (!num_toks)
+        return 0;
+
+    /*
+     * Never forward PUB commands,
+     * these should be printed out immediately
+     */
+    if (num_toks == 4 && !strcmp(toks[1], "PUB"))
+    {
+        printf("[%s] [%s]: %s\n", toks[0], toks[2], toks[3]);
+        free(toks);
+        return 0;
+    }
+
+    if (!send_to_listener(toks, num_toks))
+    {
+        /* Errors will be returned as one token */
+        fprintf(stderr, "Server: %s\n", toks[0]);
+        free(toks);
+    }
+
+    return 0;
+}
+
 static void *net_loop(void *arg)
 {
     struct timeval timeout = {.tv_sec = 5, .tv_usec = 0}; /* Default 5 second timeout */
     struct client *client = (struct client *)arg;
-    char buf[BUF_SIZE], **toks;
-    size_t i, num_toks;
-    int res, drop;
+    struct frame_buf frame;
+    char buf[RECV_BUF_SIZE];
+    ssize_t res;
+
+    /* Large messages arrive over many reads, frame_feed() puts them together */
+    frame_init(&frame);
 
     while (!client->closing)
     {
-        drop = 0;
-
         remove_stale_listeners();
 
         timeout.tv_sec = calc_net_timeout();
         setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-        /* Peek for the end of the packet */
-        res = recv(client->sock, buf, sizeof(buf), MSG_PEEK);
+        res = recv(client->sock, buf, sizeof(buf), 0);
         if (res <= 0)
         {
             if (!res || (errno != EAGAIN && errno != EWOULDBLOCK))
@@ -171,65 +205,10 @@ static void *net_loop(void *arg)
             continue;
         }
 
-        /* Find end of packet marked by '>' */
-        i = 0;
-        while (i < res && buf[i] != '>')
-            i++;
-
-        /* If not found, drop but still read the data */
-        if (i == BUF_SIZE)
-            drop = 1;
-        else
-            i++;
-
-        if (i <= 2)
-            drop = 1;
-
-        /* Commands must start with '<' */
-        if (buf[0] != '<')
-            drop = 1;
-
-        /* Actually read out the data */
-        res = recv(client->sock, buf, i, 0);
-        if (res <= 0)
-        {
-            if (!res || (errno != EAGAIN && errno != EWOULDBLOCK))
-            {
-                pthread_mutex_lock(&client->lock);
-                client->closing = 1;
-                pthread_mutex_unlock(&client->lock);
-            }
-            continue;
-        }
-
-        if (drop)
-            continue;
-
-        num_toks = split_string(buf + 1, i - 2, ", ", &toks);
-        if (!num_toks)
-            continue;
-
-        /*
-         * Never forward PUB commands,
-         * these should be printed out immediately
-         */
-        if (num_toks == 4 && !strcmp(toks[1], "PUB"))
-        {
-            printf("[%s] [%s]: %s\n", toks[0], toks[2], toks[3]);
-            free(toks);
-            continue;
-        }
-
-        res = send_to_listener(toks, num_toks);
-        if (!res)
-        {
-            /* Errors will be returned as one token */
-            if (num_toks > 0)
-                fprintf(stderr, "Server: %s\n", toks[0]);
-            free(toks);
-        }
+        frame_feed(&frame, buf, res, handle_frame, client);
     }
 
+    frame_free(&frame);
     return NULL;
 }
 
@@ -269,13 +248,13 @@ static void gen_sub_cmd(char *name, char *subject, char *req_buf, size_t req_len
     snprintf(req_buf, req_len, "<%s, SUB, %s>", name, subject);
 }
 
-static void gen_pub_cmd(char *name, char *subject, char *msg, char *req_buf, size_t req_len)
+/* Returns the length of the command, which the caller makes room for */
+static size_t gen_pub_cmd(char *name, char *subject, char *msg, char *req_buf, size_t req_len)
 {
     assert(strlen(name) < 128);
     assert(strlen(subject) < 128);
-    assert(strlen(msg) < 760);
 
-    snprintf(req_buf, req_len, "<%s, PUB, %s, %s>", name, subject, msg);
+    return snprintf(req_buf, req_len, "<%s, PUB, %s, %s>", name, subject, msg);
 }
 
 static void gen_disc_cmd(char *req_buf, size_t req_len)
@@ -285,9 +264,15 @@ static void gen_disc_cmd(char *req_buf, size_t req_len)
 
 static int send_data(int sock, char *msg, size_t msg_len)
 {
-    int res;
+    ssize_t res;
+
+    /* Large messages may take more than one send */
+    while ((res = send(sock, msg, msg_len, 0)) > 0 && (size_t)res < msg_len)
+    {
+        msg += res;
+        msg_len -= res;
+    }
 
-    res = send(sock, msg, msg_len, 0);
     if (res > 0)
     {
         return SEND_OK;
@@ -395,8 +380,8 @@ static void handle_sub(struct client *client, char **toks, size_t num_toks)
 
 static void handle_pub(struct client *client, char **toks, size_t num_toks)
 {
-    char msg_buf[BUF_SIZE], req_buf[BUF_SIZE];
-    size_t i;
+    char *msg_buf, *req_buf;
+    size_t i, len, msg_len = 0, req_len;
     int res;
 
     if (num_toks < 3)
@@ -406,18 +391,43 @@ static void handle_pub(struct client *client, char **toks, size_t num_toks)
     }
 
     for (i = 2; i < num_toks; i++)
+        msg_len += strlen(toks[i]) + 1;
+
+    if (msg_len - 1 > MAX_PAYLOAD_SIZE)
     {
-        strcat(msg_buf, toks[i]);
-        if (i != num_toks - 1)
-            strcat(msg_buf, " ");
+        printf("Message too long, the limit is %d bytes\n", MAX_PAYLOAD_SIZE);
+        return;
     }
 
-    gen_pub_cmd(client->client_name, toks[1], msg_buf, req_buf, sizeof(req_buf) / sizeof(*req_buf));
-    res = send_data(client->sock, req_buf, strlen(req_buf));
+    msg_buf = malloc(msg_len);
+    req_buf = malloc(msg_len + BUF_SIZE);
+    if (!msg_buf || !req_buf)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Words are joined back together with single spaces */
+    msg_len = 0;
+    for (i = 2; i < num_toks; i++)
+    {
+        if (i != 2)
+            msg_buf[msg_len++] = ' ';
+        len = strlen(toks[i]);
+        memcpy(msg_buf + msg_len, toks[i], len);
+        msg_len += len;
+    }
+    msg_buf[msg_len] = '\0';
+
+    req_len = gen_pub_cmd(client->client_name, toks[1], msg_buf, req_buf, msg_len + BUF_SIZE);
+    res = send_data(client->sock, req_buf, req_len);
     if (res == SEND_FAIL)
         client->closing = 1;
     else if (res == SEND_TIMEOUT)
         printf("Publish failed\n");
+
+    free(msg_buf);
+    free(req_buf);
 }
 
 static void handle_disc(struct client *client, char **toks, size_t num_toks)
@@ -432,7 +442,8 @@ static void handle_disc(struct client *client, char **toks, size_t num_toks)
 void start_client(struct addrinfo *addr)
 {
     static char *SUB = "SUB", *PUB = "PUB", *DISC = "DISC";
-    char *s, **toks, cmd[BUF_SIZE];
+    char *s, **toks, *cmd = NULL;
+    size_t cmd_cap = 0;
     struct addrinfo *aptr;
     pthread_t net_thread;
     size_t num_toks;
@@ -481,12 +492,13 @@ void start_client(struct addrinfo *addr)
 
     while (!client.closing)
     {
-        s = fgets(cmd, sizeof(cmd) / sizeof(*cmd), stdin);
-        if (!s)
+        /* Lines are read whole, however long the message on them */
+        if (getline(&cmd, &cmd_cap, stdin) == -1)
         {
             clearerr(stdin);
             continue;
         }
+        s = cmd;
 
         if (strchr(cmd, ','))
         {
@@ -518,6 +530,7 @@ void start_client(struct addrinfo *addr)
     }
 
     printf("Quitting\n");
+    free(cmd);
     close(client.sock);
     free(client.client_name);
     pthread_join(net_thread, NULL);
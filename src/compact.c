@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "compact.h"
+
+static size_t varint_size(size_t value)
+{
+    size_t size = 1;
+
+    while (value >>= 7)
+        size++;
+
+    return size;
+}
+
+static size_t put_varint(char *buf, size_t value)
+{
+    size_t len = 0;
+
+    do
+    {
+        buf[len] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            buf[len] |= 0x80;
+        len++;
+    } while (value);
+
+    return len;
+}
+
+/* Returns 1 with the value and its size, 0 if more bytes are needed, -1 if
+ * it runs on past COMPACT_MAX_VARINT bytes */
+static int get_varint(const unsigned char *data, size_t len, size_t *value, size_t *size)
+{
+    size_t i;
+
+    *value = 0;
+    for (i = 0; i < COMPACT_MAX_VARINT; i++)
+    {
+        if (i >= len)
+            return 0;
+
+        *value |= (size_t)(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80))
+        {
+            *size = i + 1;
+            return 1;
+        }
+    }
+
+    return -1;
+}
+
+/* A frame_header_fn, the header is just the length */
+static int parse_header(const unsigned char *data, size_t len, size_t *header_len, size_t *body_len)
+{
+    int ret;
+
+    ret = get_varint(data, len, body_len, header_len);
+    if (ret > 0 && *body_len > COMPACT_MAX_FRAME_SIZE)
+    {
+        fprintf(stderr, "Compact frame too large, closing\n");
+        return -1;
+    }
+
+    return ret;
+}
+
+int compact_feed(struct frame_buf *buf, char *data, size_t len, frame_handler handler, void *ctx)
+{
+    return frame_feed_prefixed(buf, data, len, parse_header, handler, ctx);
+}
+
+size_t compact_split(char *frame, size_t len, char **toks, size_t *lens, size_t max_toks)
+{
+    size_t header_len, body_len, field_len, size, count = 0;
+    char *pos, *end = frame + len;
+
+    if (parse_header((unsigned char *)frame, len, &header_len, &body_len) != 1 || header_len + body_len != len)
+        return 0;
+
+    /* Only lengths are read, nothing is scanned for delimiters */
+    for (pos = frame + header_len; pos < end; pos += field_len + 1)
+    {
+        if (get_varint((unsigned char *)pos, end - pos, &field_len, &size) != 1)
+            return 0;
+        pos += size;
+
+        if (field_len >= (size_t)(end - pos) || pos[field_len] != '\0')
+            return 0;
+
+        if (count < max_toks)
+        {
+            toks[count] = pos;
+            lens[count++] = field_len;
+        }
+    }
+
+    return count;
+}
+
+size_t compact_frame_size(const size_t *lens, size_t num_toks)
+{
+    size_t i, body_len = 0;
+
+    for (i = 0; i < num_toks; i++)
+        body_len += varint_size(lens[i]) + lens[i] + 1;
+
+    return varint_size(body_len) + body_len;
+}
+
+size_t compact_encode(char *buf, const char *const *toks, const size_t *lens, size_t num_toks)
+{
+    size_t i, len, body_len = 0;
+
+    for (i = 0; i < num_toks; i++)
+        body_len += varint_size(lens[i]) + lens[i] + 1;
+
+    len = put_varint(buf, body_len);
+    for (i = 0; i < num_toks; i++)
+    {
+        len += put_varint(buf + len, lens[i]);
+        memcpy(buf + len, toks[i], lens[i]);
+        len += lens[i];
+        buf[len++] = '\0';
+    }
+
+    return len;
+}
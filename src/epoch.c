@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+/* One per thread that has ever entered. Records are never freed, a thread
+ * that exits leaves its record for the next new thread to take over */
+struct epoch_record
+{
+    struct epoch_record *next;
+    atomic_uint_fast64_t epoch; /* Entered epoch << 1 | 1, 0 while outside */
+    atomic_int in_use;
+    unsigned int depth;
+};
+
+struct retired
+{
+    struct retired *next;
+    epoch_free_fn free_fn;
+    void *ptr;
+    uint64_t epoch;
+};
+
+static struct epoch_record *_Atomic records;
+static atomic_uint_fast64_t global_epoch = 1;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_record *local_record;
+
+/* Retired in epoch order, so everything safe to free is at the front */
+static struct retired *limbo;
+static struct retired **limbo_tail = &limbo;
+static atomic_size_t limbo_count;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_record(void *data)
+{
+    struct epoch_record *record = data;
+
+    atomic_store(&record->epoch, 0);
+    record->depth = 0;
+    atomic_store(&record->in_use, 0);
+}
+
+static void create_record_key(void)
+{
+    if (pthread_key_create(&record_key, release_record))
+    {
+        perror("pthread_key_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static struct epoch_record *get_record(void)
+{
+    struct epoch_record *record;
+    int unused;
+
+    if (local_record)
+        return local_record;
+
+    pthread_once(&record_key_once, create_record_key);
+
+    for (record = atomic_load(&records); record; record = record->next)
+    {
+        unused = 0;
+        if (atomic_compare_exchange_strong(&record->in_use, &unused, 1))
+            goto found;
+    }
+
+    record = calloc(sizeof(*record), 1);
+    if (!record)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&record->in_use, 1);
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record))
+        ;
+
+found:
+    pthread_setspecific(record_key, record);
+    local_record = record;
+    return record;
+}
+
+void epoch_enter(void)
+{
+    struct epoch_record *record = get_record();
+
+    if (record->depth++)
+        return;
+
+    atomic_store(&record->epoch, atomic_load(&global_epoch) << 1 | 1);
+    /* The announcement must be visible before any shared pointer is read */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void)
+{
+    struct epoch_record *record = local_record;
+
+    if (--record->depth)
+        return;
+
+    atomic_store_explicit(&record->epoch, 0, memory_order_release);
+
+    if (atomic_load_explicit(&limbo_count, memory_order_relaxed))
+        epoch_reclaim();
+}
+
+/* The epoch moves on once every thread inside has seen the current one */
+static uint64_t try_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch), seen;
+    struct epoch_record *record;
+
+    for (record = atomic_load(&records); record; record = record->next)
+    {
+        seen = atomic_load(&record->epoch);
+        if ((seen & 1) && seen >> 1 != epoch)
+            return epoch;
+    }
+
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+        epoch++;
+
+    return epoch;
+}
+
+void epoch_retire(epoch_free_fn free_fn, void *ptr)
+{
+    struct retired *node;
+
+    node = malloc(sizeof(*node));
+    if (!node)
+    {
+        /* Leaking beats freeing under a reader */
+        perror("malloc");
+        return;
+    }
+
+    node->next = NULL;
+    node->free_fn = free_fn;
+    node->ptr = ptr;
+
+    pthread_mutex_lock(&limbo_lock);
+
+    node->epoch = atomic_load(&global_epoch);
+    *limbo_tail = node;
+    limbo_tail = &node->next;
+    atomic_fetch_add(&limbo_count, 1);
+
+    pthread_mutex_unlock(&limbo_lock);
+
+    epoch_reclaim();
+}
+
+size_t epoch_reclaim(void)
+{
+    struct retired *expired = NULL, **expired_tail = &expired, *node;
+    uint64_t epoch;
+    size_t left;
+
+    /* Someone else is already at it */
+    if (pthread_mutex_trylock(&limbo_lock))
+        return atomic_load(&limbo_count);
+
+    epoch = try_advance();
+
+    /* Readers can only be in this epoch or the one before it */
+    while (limbo && limbo->epoch + 2 <= epoch)
+    {
+        node = limbo;
+        limbo = node->next;
+        if (!limbo)
+            limbo_tail = &limbo;
+
+        *expired_tail = node;
+        expired_tail = &node->next;
+        atomic_fetch_sub(&limbo_count, 1);
+    }
+    *expired_tail = NULL;
+
+    left = atomic_load(&limbo_count);
+
+    pthread_mutex_unlock(&limbo_lock);
+
+    while (expired)
+    {
+        node = expired;
+        expired = node->next;
+        node->free_fn(node->ptr);
+        free(node);
+    }
+
+    return left;
+}
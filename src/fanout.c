@@ -0,0 +1,228 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fanout.h"
+
+struct fanout_job
+{
+    fanout_fn fn;
+    void *ctx;
+    atomic_size_t remaining;
+};
+
+static int deque_push(struct fanout_deque *deque, struct fanout_task *task)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top < FANOUT_QUEUE_SIZE)
+    {
+        deque->tasks[deque->bottom++ % FANOUT_QUEUE_SIZE] = *task;
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return ret;
+}
+
+/* The owner takes its newest chunk, thieves take the oldest */
+static int deque_take(struct fanout_deque *deque, struct fanout_task *task, int steal)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom != deque->top)
+    {
+        if (steal)
+            *task = deque->tasks[deque->top++ % FANOUT_QUEUE_SIZE];
+        else
+            *task = deque->tasks[--deque->bottom % FANOUT_QUEUE_SIZE];
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return ret;
+}
+
+/* Checks the worker's own deque first, then every other one starting from its neighbour */
+static int find_task(struct fanout_pool *pool, size_t start, struct fanout_task *task)
+{
+    size_t i;
+
+    if (start < pool->num_workers && !deque_take(&pool->workers[start].deque, task, 0))
+        goto found;
+
+    for (i = 1; i <= pool->num_workers; i++)
+    {
+        if (!deque_take(&pool->workers[(start + i) % pool->num_workers].deque, task, 1))
+            goto found;
+    }
+
+    return -1;
+
+found:
+    atomic_fetch_sub(&pool->pending, 1);
+    return 0;
+}
+
+static void run_task(struct fanout_task *task)
+{
+    struct fanout_job *job = task->job;
+
+    job->fn(job->ctx, task->begin, task->end);
+
+    /* The job lives on its submitter's stack, this is the last access */
+    atomic_fetch_sub_explicit(&job->remaining, 1, memory_order_release);
+}
+
+static void *worker_loop(void *data)
+{
+    struct fanout_worker *worker = data;
+    struct fanout_pool *pool = worker->pool;
+    struct fanout_task task;
+
+    for (;;)
+    {
+        if (!find_task(pool, worker->index, &task))
+        {
+            run_task(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (!atomic_load(&pool->pending) && !pool->stop)
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->idle_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+static void stop_workers(struct fanout_pool *pool, size_t count)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (i = 0; i < count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+}
+
+struct fanout_pool *fanout_create(size_t num_workers)
+{
+    struct fanout_pool *pool;
+    size_t i;
+
+    if (!num_workers)
+        return NULL;
+
+    pool = calloc(sizeof(*pool), 1);
+    if (!pool)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    pool->workers = calloc(sizeof(*pool->workers), num_workers);
+    if (!pool->workers)
+    {
+        perror("calloc");
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next_worker, 0);
+
+    pool->num_workers = num_workers;
+    for (i = 0; i < num_workers; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+    }
+
+    for (i = 0; i < num_workers; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_loop, &pool->workers[i]))
+        {
+            perror("pthread_create");
+            stop_workers(pool, i);
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void fanout_destroy(struct fanout_pool *pool)
+{
+    stop_workers(pool, pool->num_workers);
+    free(pool->workers);
+    free(pool);
+}
+
+void fanout_run(struct fanout_pool *pool, fanout_fn fn, void *ctx, size_t count)
+{
+    size_t num_chunks, chunk, begin, start, i;
+    struct fanout_task task;
+    struct fanout_job job;
+
+    if (!count)
+        return;
+
+    num_chunks = pool->num_workers * FANOUT_CHUNKS_PER_WORKER;
+    chunk = (count + num_chunks - 1) / num_chunks;
+
+    job.fn = fn;
+    job.ctx = ctx;
+    num_chunks = (count + chunk - 1) / chunk;
+    atomic_init(&job.remaining, num_chunks);
+
+    /* Counted up front so a worker taking a chunk early never sees it go negative */
+    atomic_fetch_add(&pool->pending, num_chunks);
+
+    /* Spread the chunks over every worker, starting somewhere new each time */
+    start = atomic_fetch_add(&pool->next_worker, 1);
+    for (begin = 0, i = 0; begin < count; begin += chunk, i++)
+    {
+        task.job = &job;
+        task.begin = begin;
+        task.end = begin + chunk < count ? begin + chunk : count;
+
+        if (deque_push(&pool->workers[(start + i) % pool->num_workers].deque, &task))
+        {
+            /* Full, do it here instead */
+            atomic_fetch_sub(&pool->pending, 1);
+            run_task(&task);
+        }
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    /* Help out until the last chunk is done, possibly with other callers' chunks */
+    while (atomic_load_explicit(&job.remaining, memory_order_acquire))
+    {
+        if (!find_task(pool, pool->num_workers, &task))
+            run_task(&task);
+        else
+            sched_yield();
+    }
+}
@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "frame.h"
+
+void frame_init(struct frame_buf *buf)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    buf->discarding = 0;
+}
+
+void frame_free(struct frame_buf *buf)
+{
+    free(buf->data);
+    frame_init(buf);
+}
+
+static int buf_reserve(struct frame_buf *buf, size_t size)
+{
+    size_t new_cap;
+    char *new_data;
+
+    if (size <= buf->cap)
+        return 0;
+
+    new_cap = buf->cap ? buf->cap : 64;
+    while (new_cap < size)
+        new_cap *= 2;
+
+    new_data = realloc(buf->data, new_cap);
+    if (!new_data)
+    {
+        perror("realloc");
+        return -1;
+    }
+
+    buf->data = new_data;
+    buf->cap = new_cap;
+    return 0;
+}
+
+static int buf_append(struct frame_buf *buf, const char *data, size_t len)
+{
+    if (buf_reserve(buf, buf->len + len))
+        return -1;
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+/* Empties buf, without holding on to the room a large frame needed */
+static void buf_reset(struct frame_buf *buf)
+{
+    buf->len = 0;
+    if (buf->cap > FRAME_KEEP_SIZE)
+        frame_free(buf);
+}
+
+/* Returns 0 if the partial frame was dropped */
+static int frame_append(struct frame_buf *buf, char *data, size_t len)
+{
+    if (buf->len + len > MAX_FRAME_SIZE)
+        fprintf(stderr, "Frame too large, dropping\n");
+    else if (!buf_append(buf, data, len))
+        return 1;
+
+    buf_reset(buf);
+    buf->discarding = 1;
+    return 0;
+}
+
+size_t frame_feed(struct frame_buf *buf, char *data, size_t len, frame_handler handler, void *ctx)
+{
+    char *begin = data, *end = data + len, *start, *close;
+    int stop = 0;
+
+    /* Finish whatever was left over from the previous read first */
+    if (buf->len || buf->discarding)
+    {
+        close = memchr(data, '>', len);
+        if (!close)
+        {
+            if (!buf->discarding)
+                frame_append(buf, data, len);
+            return len;
+        }
+
+        if (buf->discarding)
+            buf->discarding = 0;
+        else if (frame_append(buf, data, close - data + 1))
+            stop = handler(ctx, buf->data, buf->len);
+
+        buf_reset(buf);
+        buf->discarding = 0;
+        data = close + 1;
+    }
+
+    while (!stop && data < end)
+    {
+        start = memchr(data, '<', end - data);
+        if (!start)
+            return len;
+
+        close = memchr(start, '>', end - start);
+        if (!close)
+        {
+            frame_append(buf, start, end - start);
+            return len;
+        }
+
+        if (close - start + 1 <= MAX_FRAME_SIZE)
+            stop = handler(ctx, start, close - start + 1);
+        else
+            fprintf(stderr, "Frame too large, dropping\n");
+
+        data = close + 1;
+    }
+
+    return data - begin;
+}
+
+int frame_feed_prefixed(struct frame_buf *buf, char *data, size_t len, frame_header_fn header, frame_handler handler,
+                        void *ctx)
+{
+    char *pos = data, *end = data + len;
+    size_t header_len, body_len, take;
+    int ret, stop;
+
+    /* Finish the frame left over from the previous read first. Until its
+     * header is complete it is not known how much of this read belongs to it */
+    while (buf->len)
+    {
+        ret = header((unsigned char *)buf->data, buf->len, &header_len, &body_len);
+        if (ret < 0)
+            return -1;
+
+        if (ret && buf->len == header_len + body_len)
+        {
+            stop = handler(ctx, buf->data, buf->len);
+            buf_reset(buf);
+            if (stop)
+                return 0;
+            break;
+        }
+
+        if (pos == end)
+            return 0;
+
+        /* Large frames are gathered into room made for them up front */
+        if (ret && buf_reserve(buf, header_len + body_len))
+            return -1;
+
+        take = ret ? header_len + body_len - buf->len : 1;
+        if (take > (size_t)(end - pos))
+            take = end - pos;
+        if (buf_append(buf, pos, take))
+            return -1;
+        pos += take;
+    }
+
+    /* Complete frames are handled in place */
+    while (pos < end)
+    {
+        ret = header((unsigned char *)pos, end - pos, &header_len, &body_len);
+        if (ret < 0)
+            return -1;
+
+        if (!ret || (size_t)(end - pos) < header_len + body_len)
+        {
+            if (ret && buf_reserve(buf, header_len + body_len))
+                return -1;
+            return buf_append(buf, pos, end - pos);
+        }
+
+        stop = handler(ctx, pos, header_len + body_len);
+        pos += header_len + body_len;
+        if (stop)
+            return 0;
+    }
+
+    return 0;
+}
+
+/* The first ',' or '>' in [data, end), or end if there is none */
+static char *find_special(char *data, char *end)
+{
+#ifdef __SSE2__
+    __m128i comma = _mm_set1_epi8(','), close = _mm_set1_epi8('>'), chunk;
+    uint32_t mask;
+
+    for (; end - data >= 16; data += 16)
+    {
+        chunk = _mm_loadu_si128((__m128i *)data);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, close)));
+        if (mask)
+            return data + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; data < end && *data != ',' && *data != '>'; data++)
+        ;
+
+    return data;
+}
+
+size_t frame_split(char *frame, size_t len, char **toks, size_t *lens, size_t max_toks)
+{
+    char *end, *tok, *next;
+    size_t count = 0;
+
+    if (len < 2 || frame[0] != '<' || frame[len - 1] != '>')
+        return 0;
+
+    /* One pass finds both the delimiters and any stray '>' */
+    end = frame + len - 1;
+    tok = next = frame + 1;
+    for (;;)
+    {
+        next = find_special(next, end);
+        if (next < end && *next == '>')
+            return 0;
+
+        /* A comma without a space is part of the token */
+        if (next < end && next[1] != ' ')
+        {
+            next++;
+            continue;
+        }
+
+        if (next > tok && count < max_toks)
+        {
+            toks[count] = tok;
+            lens[count++] = next - tok;
+            *next = '\0';
+        }
+
+        if (next == end)
+            return count;
+        tok = next = next + 2;
+    }
+}
+
+int frame_can_carry(const char *data, size_t len)
+{
+    const char *comma = data, *end = data + len;
+
+    if (!len || memchr(data, '>', len))
+        return 0;
+
+    while ((comma = memchr(comma, ',', end - comma)) && ++comma < end)
+    {
+        if (*comma == ' ')
+            return 0;
+    }
+
+    return 1;
+}
@@ -2,6 +2,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "hash.h"
 
@@ -53,77 +57,541 @@ void list_remove(struct list *elem)
     elem->next->prev = elem->prev;
 }
 
+enum
+{
+    CTRL_EMPTY = -128,
+    CTRL_DELETED = -2,
+    /* Full slots hold the low 7 bits of their hash, so are never negative */
+};
+
+uint64_t hash_fnv1a(void *key, size_t len)
+{
+    static const uint64_t fnv_prime = 0x100000001b3;
+    uint64_t hash = 0xcbf29ce484222325;
+    uint8_t *bytes = key;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * fnv_prime;
+
+    return hash;
+}
+
+#ifdef __SIZEOF_INT128__
+
+static const uint64_t wy_secret[4] =
+{
+    0x2d358dccaa6c78a5, 0x8bb84b93962eacc9, 0x4b33a62ed433d4a3, 0x4d5a2da51de1aa47,
+};
+
+/* 64x64 bit multiply, both halves of the product folded together */
+static uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t wy_read64(uint8_t *bytes)
+{
+    uint64_t ret;
+
+    memcpy(&ret, bytes, sizeof(ret));
+    return ret;
+}
+
+static uint64_t wy_read32(uint8_t *bytes)
+{
+    uint32_t ret;
+
+    memcpy(&ret, bytes, sizeof(ret));
+    return ret;
+}
+
+/* wyhash, consuming 16 to 48 bytes per step instead of FNV's one. Unaligned
+ * and overlapping reads cover the ragged ends without a byte loop */
+uint64_t hash_wyhash(void *key, size_t len)
+{
+    uint64_t seed = wy_mix(wy_secret[0], wy_secret[1]), a, b, see1, see2;
+    uint8_t *bytes = key;
+    __uint128_t product;
+    size_t left = len;
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (wy_read32(bytes) << 32) | wy_read32(bytes + ((len >> 3) << 2));
+            b = (wy_read32(bytes + len - 4) << 32) | wy_read32(bytes + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len)
+        {
+            a = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[len >> 1] << 8) | bytes[len - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        if (left > 48)
+        {
+            see1 = see2 = seed;
+            do
+            {
+                seed = wy_mix(wy_read64(bytes) ^ wy_secret[1], wy_read64(bytes + 8) ^ seed);
+                see1 = wy_mix(wy_read64(bytes + 16) ^ wy_secret[2], wy_read64(bytes + 24) ^ see1);
+                see2 = wy_mix(wy_read64(bytes + 32) ^ wy_secret[3], wy_read64(bytes + 40) ^ see2);
+                bytes += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= see1 ^ see2;
+        }
+
+        while (left > 16)
+        {
+            seed = wy_mix(wy_read64(bytes) ^ wy_secret[1], wy_read64(bytes + 8) ^ seed);
+            bytes += 16;
+            left -= 16;
+        }
+
+        a = wy_read64(bytes + left - 16);
+        b = wy_read64(bytes + left - 8);
+    }
+
+    product = (__uint128_t)(a ^ wy_secret[1]) * (b ^ seed);
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+
+    return wy_mix(a ^ wy_secret[0] ^ len, b ^ wy_secret[1]);
+}
+
+#else
+
+/* No 128 bit multiply to build wyhash on */
+uint64_t hash_wyhash(void *key, size_t len)
+{
+    return hash_fnv1a(key, len);
+}
+
+#endif
+
+uint64_t hash_bytes(void *key, size_t len)
+{
+#ifdef HASH_FNV1A
+    return hash_fnv1a(key, len);
+#else
+    return hash_wyhash(key, len);
+#endif
+}
+
+/* Bit i is set if control byte i of the group equals byte */
+static uint32_t group_match(int8_t *ctrl, int8_t byte)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((__m128i *)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    uint32_t mask = 0;
+    size_t i;
+
+    for (i = 0; i < HASH_GROUP_SIZE; i++)
+        mask |= (uint32_t)(ctrl[i] == byte) << i;
+
+    return mask;
+#endif
+}
+
+/* Empty and deleted are the only negative control bytes */
+static uint32_t group_match_free(int8_t *ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i *)ctrl));
+#else
+    uint32_t mask = 0;
+    size_t i;
+
+    for (i = 0; i < HASH_GROUP_SIZE; i++)
+        mask |= (uint32_t)(ctrl[i] < 0) << i;
+
+    return mask;
+#endif
+}
+
+static int8_t hash_h2(uint64_t hash)
+{
+    return hash & 0x7f;
+}
+
+/* Groups are probed triangularly, which visits every group once as the group
+ * count is a power of two */
+static size_t first_group(struct hash_array *array, uint64_t hash)
+{
+    return (hash >> 7) & (array->capacity / HASH_GROUP_SIZE - 1);
+}
+
+static size_t next_group(struct hash_array *array, size_t group, size_t probe)
+{
+    return (group + probe) & (array->capacity / HASH_GROUP_SIZE - 1);
+}
+
+/* Returns the slot holding key, or -1 */
+static ssize_t find_slot(struct hash_array *array, uint64_t hash, void *key, size_t key_len)
+{
+    size_t group, probe = 0, slot;
+    struct hash_slot *entry;
+    int8_t *ctrl;
+    uint32_t match;
+
+    if (!array->capacity)
+        return -1;
+
+    for (group = first_group(array, hash);; group = next_group(array, group, ++probe))
+    {
+        ctrl = array->ctrl + group * HASH_GROUP_SIZE;
+
+        for (match = group_match(ctrl, hash_h2(hash)); match; match &= match - 1)
+        {
+            slot = group * HASH_GROUP_SIZE + __builtin_ctz(match);
+            entry = &array->slots[slot];
+            if (entry->hash == hash && entry->key_len == key_len && !memcmp(entry->key, key, key_len))
+                return slot;
+        }
+
+        /* The key would have gone into the first empty slot on its way */
+        if (group_match(ctrl, CTRL_EMPTY))
+            return -1;
+    }
+}
+
+/* Returns the first empty or deleted slot along the hash's probe sequence */
+static size_t find_free_slot(struct hash_array *array, uint64_t hash)
+{
+    size_t group, probe = 0;
+    uint32_t match;
+
+    for (group = first_group(array, hash);; group = next_group(array, group, ++probe))
+    {
+        match = group_match_free(array->ctrl + group * HASH_GROUP_SIZE);
+        if (match)
+            return group * HASH_GROUP_SIZE + __builtin_ctz(match);
+    }
+}
+
+static void place_slot(struct hash_array *array, struct hash_slot *entry)
+{
+    size_t slot = find_free_slot(array, entry->hash);
+
+    if (array->ctrl[slot] == CTRL_EMPTY)
+        array->growth_left--;
+
+    array->ctrl[slot] = hash_h2(entry->hash);
+    array->slots[slot] = *entry;
+}
+
+static void clear_slot(struct hash_array *array, size_t slot)
+{
+    int8_t *group = array->ctrl + (slot & ~(size_t)(HASH_GROUP_SIZE - 1));
+
+    /* Probes stop at a group with an empty slot, so if this group already has
+     * one nothing can be probing past it and the slot can simply be emptied */
+    if (group_match(group, CTRL_EMPTY))
+    {
+        array->ctrl[slot] = CTRL_EMPTY;
+        array->growth_left++;
+    }
+    else
+        array->ctrl[slot] = CTRL_DELETED;
+}
+
+/* Arrays are kept at most 7/8 full so probes always end at an empty slot */
+static size_t max_load(size_t capacity)
+{
+    return capacity - capacity / 8;
+}
+
+static int alloc_array(struct hash_array *array, size_t capacity)
+{
+    array->ctrl = malloc(capacity);
+    if (!array->ctrl)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    array->slots = malloc(capacity * sizeof(*array->slots));
+    if (!array->slots)
+    {
+        perror("malloc");
+        free(array->ctrl);
+        return -1;
+    }
+
+    memset(array->ctrl, CTRL_EMPTY, capacity);
+    array->capacity = capacity;
+    array->growth_left = max_load(capacity);
+
+    return 0;
+}
+
+static void free_array(struct hash_array *array)
+{
+    free(array->ctrl);
+    free(array->slots);
+    memset(array, 0, sizeof(*array));
+}
+
+/* Moves up to count groups of the old array into the new one */
+static void migrate(struct hash_table *table, size_t count)
+{
+    size_t num_groups = table->old.capacity / HASH_GROUP_SIZE, slot, end;
+
+    if (!table->old.capacity)
+        return;
+
+    for (; count && table->migrated < num_groups; count--, table->migrated++)
+    {
+        slot = table->migrated * HASH_GROUP_SIZE;
+        for (end = slot + HASH_GROUP_SIZE; slot < end; slot++)
+        {
+            if (table->old.ctrl[slot] < 0)
+                continue;
+
+            place_slot(&table->cur, &table->old.slots[slot]);
+            /* Left deleted, lookups in old may still need to probe past it */
+            table->old.ctrl[slot] = CTRL_DELETED;
+            table->old_count--;
+        }
+    }
+
+    if (table->migrated == num_groups)
+        free_array(&table->old);
+}
+
+/* Holds everything now in the table plus headroom, at under half load */
+static size_t fitting_capacity(struct hash_table *table, size_t count)
+{
+    size_t capacity = HASH_GROUP_SIZE;
+
+    while (max_load(capacity) < count * 2)
+        capacity *= 2;
+
+    return capacity > table->min_capacity ? capacity : table->min_capacity;
+}
+
+/* Swaps in a new array and leaves the old one to be moved over gradually */
+static int start_resize(struct hash_table *table, size_t capacity)
+{
+    struct hash_array array;
+
+    assert(!table->old.capacity);
+
+    if (alloc_array(&array, capacity))
+        return -1;
+
+    table->old = table->cur;
+    table->old_count = table->count;
+    table->cur = array;
+    table->migrated = 0;
+
+    return 0;
+}
+
+/* Moves everything into a new array at once. Only needed when inserts outrun
+ * a move into a smaller array */
+static int rebuild(struct hash_table *table, size_t capacity)
+{
+    struct hash_array array, *arrays[] = {&table->cur, &table->old};
+    size_t i, slot;
+
+    if (alloc_array(&array, capacity))
+        return -1;
+
+    for (i = 0; i < 2; i++)
+    {
+        for (slot = 0; slot < arrays[i]->capacity; slot++)
+        {
+            if (arrays[i]->ctrl[slot] >= 0)
+                place_slot(&array, &arrays[i]->slots[slot]);
+        }
+        free_array(arrays[i]);
+    }
+
+    table->cur = array;
+    table->old_count = 0;
+
+    return 0;
+}
+
 struct hash_table *hash_init(size_t size)
 {
+    size_t capacity = HASH_GROUP_SIZE;
     struct hash_table *ret;
-    size_t i;
 
-    assert(size);
+    while (max_load(capacity) < size)
+        capacity *= 2;
 
-    ret = malloc(sizeof(*ret));
+    ret = calloc(sizeof(*ret), 1);
     if (!ret)
     {
-        perror("malloc");
+        perror("calloc");
         return NULL;
     }
 
-    ret->size = size;
-    ret->buckets = malloc(size * sizeof(*ret->buckets));
-    if (!ret->buckets)
+    if (alloc_array(&ret->cur, capacity))
     {
-        perror("malloc");
         free(ret);
         return NULL;
     }
-    for (i = 0; i < size; i++)
-        list_init(&ret->buckets[i]);
+    ret->min_capacity = capacity;
 
     return ret;
 }
 
 void hash_free(struct hash_table *table)
 {
-    free(table->buckets);
+    free_array(&table->cur);
+    free_array(&table->old);
     free(table);
 }
 
-uint64_t hash_bytes(void *key, size_t len)
+int hash_insert(struct hash_table *table, void *key, size_t key_len, void *value)
 {
-    static const uint64_t fnv_prime = 0x100000001b3;
-    uint64_t hash = 0xcbf29ce484222325;
-    uint8_t *bytes = key;
-    size_t i;
-
-    for (i = 0; i < len; i++)
-        hash = (hash ^ bytes[i]) * fnv_prime;
-
-    return hash;
+    return hash_insert_hashed(table, key, key_len, hash_bytes(key, key_len), value);
 }
 
-void hash_insert(struct hash_table *table, void *key, size_t key_len, struct list *elem)
+int hash_insert_hashed(struct hash_table *table, void *key, size_t key_len, uint64_t hash, void *value)
 {
-    size_t hash;
- 
+    struct hash_slot entry;
+
     assert(table);
     assert(key);
     assert(key_len);
-    assert(elem);
 
-    hash = hash_bytes(key, key_len) % table->size; 
+    migrate(table, HASH_MIGRATE_GROUPS);
+
+    /* Full of items or of deleted markers, either way a new array is due.
+     * cur must also keep room for whatever old still has to hand over */
+    if (table->cur.growth_left <= table->old_count)
+    {
+        if (table->old.capacity)
+        {
+            if (rebuild(table, fitting_capacity(table, table->count + 1)))
+                return -1;
+        }
+        else if (start_resize(table, fitting_capacity(table, table->count + 1)))
+            return -1;
+    }
+
+    entry.hash = hash;
+    entry.key = key;
+    entry.key_len = key_len;
+    entry.value = value;
 
-    list_add_head(&table->buckets[hash], elem);
-    return;
+    place_slot(&table->cur, &entry);
+    table->count++;
+
+    return 0;
 }
 
-int hash_empty(struct hash_table *table)
+void *hash_lookup(struct hash_table *table, void *key, size_t key_len)
 {
-    size_t i;
+    return hash_lookup_hashed(table, key, key_len, hash_bytes(key, key_len));
+}
 
-    for (i = 0; i < table->size; i++)
+void *hash_lookup_hashed(struct hash_table *table, void *key, size_t key_len, uint64_t hash)
+{
+    ssize_t slot;
+
+    slot = find_slot(&table->cur, hash, key, key_len);
+    if (slot != -1)
+        return table->cur.slots[slot].value;
+
+    slot = find_slot(&table->old, hash, key, key_len);
+    if (slot != -1)
+        return table->old.slots[slot].value;
+
+    return NULL;
+}
+
+void *hash_remove(struct hash_table *table, void *key, size_t key_len)
+{
+    return hash_remove_hashed(table, key, key_len, hash_bytes(key, key_len));
+}
+
+void *hash_remove_hashed(struct hash_table *table, void *key, size_t key_len, uint64_t hash)
+{
+    struct hash_array *array = &table->cur;
+    ssize_t slot;
+    void *value;
+
+    slot = find_slot(array, hash, key, key_len);
+    if (slot == -1)
+    {
+        array = &table->old;
+        slot = find_slot(array, hash, key, key_len);
+        if (slot == -1)
+            return NULL;
+    }
+
+    value = array->slots[slot].value;
+    if (array == &table->old)
     {
-        if (!list_empty(&table->buckets[i]))
-            return 0;
+        array->ctrl[slot] = CTRL_DELETED; /* Freed with the array soon anyway */
+        table->old_count--;
     }
+    else
+        clear_slot(array, slot);
+    table->count--;
+
+    migrate(table, HASH_MIGRATE_GROUPS);
+
+    /* Mostly empty, start moving into something smaller. A failure just
+     * leaves the table as big as it was */
+    if (!table->old.capacity && table->cur.capacity > table->min_capacity
+        && table->count < table->cur.capacity / 8)
+        start_resize(table, fitting_capacity(table, table->count));
+
+    return value;
+}
+
+void *hash_next(struct hash_table *table, size_t *iter)
+{
+    struct hash_array *array = &table->cur;
+    size_t i = *iter, base = 0;
 
-    return 1;
+    /* Positions past the end of cur continue into old */
+    for (;;)
+    {
+        if (i - base >= array->capacity)
+        {
+            if (array == &table->old)
+                break;
+
+            base = array->capacity;
+            array = &table->old;
+            continue;
+        }
+
+        if (array->ctrl[i - base] >= 0)
+        {
+            *iter = i + 1;
+            return array->slots[i - base].value;
+        }
+        i++;
+    }
+
+    *iter = i;
+    return NULL;
+}
+
+int hash_empty(struct hash_table *table)
+{
+    return !table->count;
+}
+
+size_t hash_count(struct hash_table *table)
+{
+    return table->count;
 }
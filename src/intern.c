@@ -0,0 +1,151 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "intern.h"
+
+static struct hash_table *names;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* IDs of freed names, handed out again before new ones */
+static uint32_t *free_ids;
+static size_t num_free_ids;
+static size_t free_ids_size;
+static atomic_uint next_id;
+
+/* Must lock intern_lock */
+static struct interned *lookup(const char *str, size_t len, uint64_t hash)
+{
+    struct interned *name;
+
+    if (!names)
+        return NULL;
+
+    name = hash_lookup_hashed(names, (void *)str, len, hash);
+    if (name)
+        atomic_fetch_add(&name->refs, 1);
+
+    return name;
+}
+
+/* Must lock intern_lock */
+static int release_id(uint32_t id)
+{
+    uint32_t *ids;
+
+    if (num_free_ids == free_ids_size)
+    {
+        ids = realloc(free_ids, (free_ids_size ? free_ids_size * 2 : 64) * sizeof(*ids));
+        if (!ids)
+        {
+            perror("realloc");
+            return -1;
+        }
+        free_ids = ids;
+        free_ids_size = free_ids_size ? free_ids_size * 2 : 64;
+    }
+
+    free_ids[num_free_ids++] = id;
+    return 0;
+}
+
+struct interned *intern(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint64_t hash = hash_bytes((void *)str, len);
+    struct interned *name;
+
+    pthread_mutex_lock(&intern_lock);
+
+    name = lookup(str, len, hash);
+    if (name)
+    {
+        pthread_mutex_unlock(&intern_lock);
+        return name;
+    }
+
+    if (!names)
+    {
+        names = hash_init(64);
+        if (!names)
+        {
+            pthread_mutex_unlock(&intern_lock);
+            return NULL;
+        }
+    }
+
+    name = malloc(sizeof(*name) + len);
+    if (!name)
+    {
+        perror("malloc");
+        pthread_mutex_unlock(&intern_lock);
+        return NULL;
+    }
+
+    atomic_init(&name->refs, 1);
+    name->hash = hash;
+    name->len = len;
+    memcpy(name->str, str, len);
+
+    if (hash_insert_hashed(names, name->str, len, hash, name))
+    {
+        free(name);
+        pthread_mutex_unlock(&intern_lock);
+        return NULL;
+    }
+    name->id = num_free_ids ? free_ids[--num_free_ids] : atomic_fetch_add(&next_id, 1);
+
+    pthread_mutex_unlock(&intern_lock);
+
+    return name;
+}
+
+struct interned *intern_find(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint64_t hash = hash_bytes((void *)str, len);
+    struct interned *name;
+
+    pthread_mutex_lock(&intern_lock);
+    name = lookup(str, len, hash);
+    pthread_mutex_unlock(&intern_lock);
+
+    return name;
+}
+
+struct interned *intern_get(struct interned *name)
+{
+    atomic_fetch_add(&name->refs, 1);
+    return name;
+}
+
+void intern_put(struct interned *name)
+{
+    unsigned int refs = atomic_load(&name->refs);
+
+    /* Only the last reference has to race against intern() finding the name */
+    while (refs > 1)
+    {
+        if (atomic_compare_exchange_weak(&name->refs, &refs, refs - 1))
+            return;
+    }
+
+    pthread_mutex_lock(&intern_lock);
+
+    if (atomic_fetch_sub(&name->refs, 1) == 1)
+    {
+        hash_remove_hashed(names, name->str, name->len, name->hash);
+        /* An ID that cannot be recorded is simply never reused */
+        release_id(name->id);
+        free(name);
+    }
+
+    pthread_mutex_unlock(&intern_lock);
+}
+
+uint32_t intern_id_limit(void)
+{
+    return atomic_load(&next_id);
+}
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "mqtt.h"
+
+enum
+{
+    CONNECT_CLEAN_SESSION = 0x02,
+    CONNECT_WILL = 0x04,
+    CONNECT_WILL_QOS = 0x18,
+    CONNECT_WILL_RETAIN = 0x20,
+    CONNECT_PASSWORD = 0x40,
+    CONNECT_USERNAME = 0x80,
+    CONNECT_RESERVED = 0x01,
+
+    PROTOCOL_LEVEL = 4, /* 3.1.1 */
+    SUBSCRIBE_FLAGS = 0x02,
+};
+
+/* A frame_header_fn. The fixed header is the type and the remaining length.
+ * Only a PUBLISH may be large, anything else is refused before it is read */
+static int parse_header(const unsigned char *data, size_t len, size_t *header_len, size_t *remaining)
+{
+    size_t i, value = 0, max;
+
+    max = data[0] >> 4 == MQTT_PUBLISH ? MQTT_MAX_PACKET_SIZE : MQTT_MAX_CONTROL_SIZE;
+
+    for (i = 1; i < MQTT_MAX_HEADER_SIZE; i++)
+    {
+        if (i >= len)
+            return 0;
+
+        value |= (size_t)(data[i] & 0x7f) << (7 * (i - 1));
+        if (!(data[i] & 0x80))
+        {
+            if (value > max)
+            {
+                fprintf(stderr, "MQTT packet too large, closing\n");
+                return -1;
+            }
+
+            *header_len = i + 1;
+            *remaining = value;
+            return 1;
+        }
+    }
+
+    return -1;
+}
+
+struct dispatch
+{
+    mqtt_handler handler;
+    void *ctx;
+};
+
+static int dispatch_packet(void *ctx, char *frame, size_t len)
+{
+    struct dispatch *dispatch = ctx;
+    struct mqtt_packet packet;
+    size_t header_len, remaining;
+
+    parse_header((unsigned char *)frame, len, &header_len, &remaining);
+
+    packet.type = (unsigned char)frame[0] >> 4;
+    packet.flags = frame[0] & 0x0f;
+    packet.body = (unsigned char *)frame + header_len;
+    packet.len = remaining;
+
+    return dispatch->handler(dispatch->ctx, &packet);
+}
+
+int mqtt_feed(struct frame_buf *buf, char *data, size_t len, mqtt_handler handler, void *ctx)
+{
+    struct dispatch dispatch = {handler, ctx};
+
+    return frame_feed_prefixed(buf, data, len, parse_header, dispatch_packet, &dispatch);
+}
+
+static int read_u16(const unsigned char **pos, const unsigned char *end, uint16_t *value)
+{
+    if (end - *pos < 2)
+        return -1;
+
+    *value = (*pos)[0] << 8 | (*pos)[1];
+    *pos += 2;
+    return 0;
+}
+
+/* Strings and binary data are both a 16 bit length and the bytes */
+static int read_string(const unsigned char **pos, const unsigned char *end, const char **str, size_t *len)
+{
+    uint16_t value;
+
+    if (read_u16(pos, end, &value) || end - *pos < value)
+        return -1;
+
+    *str = (const char *)*pos;
+    *len = value;
+    *pos += value;
+    return 0;
+}
+
+int mqtt_parse_connect(struct mqtt_packet *packet, struct mqtt_connect *connect)
+{
+    const unsigned char *pos = packet->body, *end = packet->body + packet->len;
+    const char *str;
+    unsigned char flags;
+    size_t len;
+
+    if (packet->flags || read_string(&pos, end, &str, &len) || len != 4 || memcmp(str, "MQTT", 4) || pos == end)
+        return -1;
+
+    /* Later versions lay out the rest differently */
+    if (*pos++ != PROTOCOL_LEVEL)
+        return MQTT_CONNACK_BAD_PROTOCOL;
+
+    if (pos == end)
+        return -1;
+    flags = *pos++;
+    if ((flags & CONNECT_RESERVED) || (flags & CONNECT_WILL_QOS) == CONNECT_WILL_QOS
+        || (!(flags & CONNECT_WILL) && (flags & (CONNECT_WILL_QOS | CONNECT_WILL_RETAIN)))
+        || ((flags & CONNECT_PASSWORD) && !(flags & CONNECT_USERNAME)))
+        return -1;
+
+    if (read_u16(&pos, end, &connect->keep_alive)
+        || read_string(&pos, end, &connect->client_id, &connect->client_id_len))
+        return -1;
+    connect->clean_session = !!(flags & CONNECT_CLEAN_SESSION);
+
+    /* Wills and credentials are read past but not used */
+    if ((flags & CONNECT_WILL) && (read_string(&pos, end, &str, &len) || read_string(&pos, end, &str, &len)))
+        return -1;
+    if ((flags & CONNECT_USERNAME) && read_string(&pos, end, &str, &len))
+        return -1;
+    if ((flags & CONNECT_PASSWORD) && read_string(&pos, end, &str, &len))
+        return -1;
+    if (pos != end)
+        return -1;
+
+    /* Client IDs are never assigned, there is no name to give the session */
+    if (!connect->client_id_len)
+        return MQTT_CONNACK_ID_REJECTED;
+
+    return MQTT_CONNACK_ACCEPTED;
+}
+
+int mqtt_parse_subscribe(struct mqtt_packet *packet, struct mqtt_subscribe *subscribe)
+{
+    const unsigned char *pos = packet->body, *end = packet->body + packet->len;
+    const char *filter;
+    size_t len;
+
+    if (packet->flags != SUBSCRIBE_FLAGS || read_u16(&pos, end, &subscribe->packet_id) || !subscribe->packet_id)
+        return -1;
+
+    subscribe->next = pos;
+    subscribe->end = end;
+    subscribe->num_filters = 0;
+
+    while (pos < end)
+    {
+        if (read_string(&pos, end, &filter, &len) || !len || pos == end || *pos++ > 2)
+            return -1;
+        subscribe->num_filters++;
+    }
+
+    return subscribe->num_filters ? 0 : -1;
+}
+
+int mqtt_next_filter(struct mqtt_subscribe *subscribe, const char **filter, size_t *len, unsigned int *qos)
+{
+    if (subscribe->next >= subscribe->end)
+        return 0;
+
+    read_string(&subscribe->next, subscribe->end, filter, len);
+    *qos = *subscribe->next++;
+    return 1;
+}
+
+int mqtt_parse_publish(struct mqtt_packet *packet, struct mqtt_publish *publish)
+{
+    const unsigned char *pos = packet->body, *end = packet->body + packet->len;
+
+    publish->qos = (packet->flags >> 1) & 3;
+    if (publish->qos == 3 || read_string(&pos, end, &publish->topic, &publish->topic_len) || !publish->topic_len)
+        return -1;
+
+    publish->packet_id = 0;
+    if (publish->qos && (read_u16(&pos, end, &publish->packet_id) || !publish->packet_id))
+        return -1;
+
+    publish->payload = (const char *)pos;
+    publish->payload_len = end - pos;
+    return 0;
+}
+
+size_t mqtt_encode_header(unsigned char *buf, enum mqtt_type type, unsigned int flags, size_t remaining)
+{
+    size_t len = 1;
+
+    buf[0] = type << 4 | flags;
+    do
+    {
+        buf[len] = remaining & 0x7f;
+        remaining >>= 7;
+        if (remaining)
+            buf[len] |= 0x80;
+        len++;
+    } while (remaining);
+
+    return len;
+}
+
+void mqtt_encode_connack(unsigned char *buf, int session_present, int code)
+{
+    mqtt_encode_header(buf, MQTT_CONNACK, 0, 2);
+    buf[2] = !!session_present;
+    buf[3] = code;
+}
+
+size_t mqtt_encode_suback(unsigned char *buf, uint16_t packet_id, const unsigned char *codes, size_t count)
+{
+    size_t len;
+
+    len = mqtt_encode_header(buf, MQTT_SUBACK, 0, 2 + count);
+    buf[len++] = packet_id >> 8;
+    buf[len++] = packet_id & 0xff;
+    memcpy(buf + len, codes, count);
+
+    return len + count;
+}
+
+void mqtt_encode_pingresp(unsigned char *buf)
+{
+    mqtt_encode_header(buf, MQTT_PINGRESP, 0, 0);
+}
+
+size_t mqtt_encode_publish(unsigned char *buf, const char *topic, size_t topic_len, size_t payload_len)
+{
+    size_t len;
+
+    len = mqtt_encode_header(buf, MQTT_PUBLISH, 0, 2 + topic_len + payload_len);
+    buf[len++] = topic_len >> 8;
+    buf[len++] = topic_len & 0xff;
+    memcpy(buf + len, topic, topic_len);
+
+    return len + topic_len;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "msgbuf.h"
+
+struct msgbuf *msgbuf_alloc(size_t len)
+{
+    struct msgbuf *buf;
+
+    buf = malloc(sizeof(*buf) + len);
+    if (!buf)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    atomic_init(&buf->refs, 1);
+    buf->stamp = 0;
+    buf->seq = UINT64_MAX;
+    buf->binary = 0;
+    buf->encoding = 0;
+    atomic_init(&buf->alt, NULL);
+    buf->len = len;
+
+    return buf;
+}
+
+struct msgbuf *msgbuf_get(struct msgbuf *buf)
+{
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    return buf;
+}
+
+void msgbuf_put(struct msgbuf *buf)
+{
+    struct msgbuf *alt;
+
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    alt = atomic_load_explicit(&buf->alt, memory_order_relaxed);
+    free(buf);
+    if (alt)
+        msgbuf_put(alt);
+}
+
+struct msgbuf *msgbuf_encoded(struct msgbuf *buf, int encoding, msgbuf_encoder encode)
+{
+    struct msgbuf *cur = buf, *next, *made = NULL;
+
+    /* Encodings are only ever appended to the chain, so a lost race just
+     * means looking further along it */
+    while (cur->encoding != encoding)
+    {
+        next = atomic_load_explicit(&cur->alt, memory_order_acquire);
+        if (next)
+        {
+            cur = next;
+            continue;
+        }
+
+        if (!made)
+        {
+            made = encode(buf, encoding);
+            if (!made)
+                return NULL;
+            made->encoding = encoding;
+        }
+
+        if (atomic_compare_exchange_strong_explicit(&cur->alt, &next, made, memory_order_acq_rel,
+                                                    memory_order_acquire))
+            return made;
+    }
+
+    if (made)
+        msgbuf_put(made);
+    return cur;
+}
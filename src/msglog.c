@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "msglog.h"
+
+void msglog_init(struct msglog *log)
+{
+    pthread_mutex_init(&log->lock, NULL);
+    log->first_seq = 0;
+    log->next_seq = 0;
+    log->capacity = 0;
+    log->frames = NULL;
+    log->offsets = NULL;
+    log->appended = 0;
+    log->usage = NULL;
+    log->on_append = NULL;
+    log->on_append_ctx = NULL;
+}
+
+void msglog_free(struct msglog *log)
+{
+    msglog_trim(log, log->next_seq);
+    free(log->frames);
+    free(log->offsets);
+    pthread_mutex_destroy(&log->lock);
+}
+
+/* Must lock log->lock. Unwraps the ring into a new one twice the size */
+static int grow(struct msglog *log)
+{
+    size_t capacity = log->capacity ? log->capacity * 2 : MSGLOG_INITIAL_SIZE;
+    struct msgbuf **frames;
+    uint64_t *offsets, seq;
+
+    frames = malloc(capacity * sizeof(*frames));
+    offsets = malloc(capacity * sizeof(*offsets));
+    if (!frames || !offsets)
+    {
+        perror("malloc");
+        free(frames);
+        free(offsets);
+        return -1;
+    }
+
+    for (seq = log->first_seq; seq < log->next_seq; seq++)
+    {
+        frames[seq & (capacity - 1)] = log->frames[seq & (log->capacity - 1)];
+        offsets[seq & (capacity - 1)] = log->offsets[seq & (log->capacity - 1)];
+    }
+
+    free(log->frames);
+    free(log->offsets);
+    log->frames = frames;
+    log->offsets = offsets;
+    log->capacity = capacity;
+
+    return 0;
+}
+
+/* Must lock log->lock, with room for one more frame */
+static void push(struct msglog *log, struct msgbuf *frame)
+{
+    log->frames[log->next_seq & (log->capacity - 1)] = msgbuf_get(frame);
+    log->offsets[log->next_seq & (log->capacity - 1)] = log->appended;
+    log->appended += frame->len;
+    if (log->usage)
+        atomic_fetch_add(log->usage, frame->len);
+}
+
+/* Must lock log->lock. Where a reader at seq is, in bytes appended */
+static uint64_t offset(struct msglog *log, uint64_t seq)
+{
+    if (seq < log->first_seq)
+        seq = log->first_seq;
+    if (seq >= log->next_seq)
+        return log->appended;
+
+    return log->offsets[seq & (log->capacity - 1)];
+}
+
+/* Must lock log->lock. Drops every frame before cursor, which must not be
+ * past the tail */
+static void drop(struct msglog *log, uint64_t cursor)
+{
+    uint64_t bytes = offset(log, cursor) - offset(log, log->first_seq);
+
+    for (; log->first_seq < cursor; log->first_seq++)
+        msgbuf_put(log->frames[log->first_seq & (log->capacity - 1)]);
+
+    if (log->usage)
+        atomic_fetch_sub(log->usage, bytes);
+}
+
+int msglog_append(struct msglog *log, struct msgbuf *frame)
+{
+    pthread_mutex_lock(&log->lock);
+
+    if (log->next_seq - log->first_seq == log->capacity && grow(log))
+    {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    frame->seq = log->next_seq;
+    push(log, frame);
+    if (log->on_append)
+        log->on_append(log->on_append_ctx, log->next_seq, frame);
+    log->next_seq++;
+
+    pthread_mutex_unlock(&log->lock);
+
+    return 0;
+}
+
+uint64_t msglog_tail(struct msglog *log)
+{
+    uint64_t ret;
+
+    pthread_mutex_lock(&log->lock);
+    ret = log->next_seq;
+    pthread_mutex_unlock(&log->lock);
+
+    return ret;
+}
+
+uint64_t msglog_replay(struct msglog *log, uint64_t cursor, msglog_replay_fn fn, void *ctx)
+{
+    return msglog_replay_mark(log, cursor, fn, ctx, NULL);
+}
+
+uint64_t msglog_replay_mark(struct msglog *log, uint64_t cursor, msglog_replay_fn fn, void *ctx,
+                            _Atomic uint64_t *mark)
+{
+    pthread_mutex_lock(&log->lock);
+
+    /* Anything before first_seq was already dropped */
+    if (cursor < log->first_seq)
+        cursor = log->first_seq;
+
+    for (; cursor < log->next_seq; cursor++)
+        fn(ctx, log->frames[cursor & (log->capacity - 1)]);
+
+    /* Before the next append can get in */
+    if (mark)
+        atomic_store(mark, cursor);
+
+    pthread_mutex_unlock(&log->lock);
+
+    return cursor;
+}
+
+void msglog_trim(struct msglog *log, uint64_t cursor)
+{
+    pthread_mutex_lock(&log->lock);
+
+    if (cursor > log->next_seq)
+        cursor = log->next_seq;
+    drop(log, cursor);
+
+    pthread_mutex_unlock(&log->lock);
+}
+
+size_t msglog_count(struct msglog *log)
+{
+    size_t ret;
+
+    pthread_mutex_lock(&log->lock);
+    ret = log->next_seq - log->first_seq;
+    pthread_mutex_unlock(&log->lock);
+
+    return ret;
+}
+
+size_t msglog_bytes(struct msglog *log)
+{
+    return msglog_bytes_since(log, 0);
+}
+
+size_t msglog_bytes_since(struct msglog *log, uint64_t cursor)
+{
+    size_t ret;
+
+    pthread_mutex_lock(&log->lock);
+    ret = log->appended - offset(log, cursor);
+    pthread_mutex_unlock(&log->lock);
+
+    return ret;
+}
+
+size_t msglog_expire(struct msglog *log, uint64_t stamp)
+{
+    uint64_t end;
+    size_t count;
+
+    pthread_mutex_lock(&log->lock);
+
+    /* Frames are appended in publish order, so the expired ones are a prefix */
+    for (end = log->first_seq; end < log->next_seq; end++)
+    {
+        if (log->frames[end & (log->capacity - 1)]->stamp >= stamp)
+            break;
+    }
+    count = end - log->first_seq;
+    drop(log, end);
+
+    pthread_mutex_unlock(&log->lock);
+
+    return count;
+}
+
+size_t msglog_evict(struct msglog *log, size_t bytes, uint64_t stamp)
+{
+    uint64_t end, freed;
+    size_t count;
+
+    pthread_mutex_lock(&log->lock);
+
+    for (end = log->first_seq; end < log->next_seq; end++)
+    {
+        freed = offset(log, end) - offset(log, log->first_seq);
+        if (freed >= bytes || log->frames[end & (log->capacity - 1)]->stamp > stamp)
+            break;
+    }
+    count = end - log->first_seq;
+    drop(log, end);
+
+    pthread_mutex_unlock(&log->lock);
+
+    return count;
+}
+
+uint64_t msglog_oldest_stamp(struct msglog *log)
+{
+    uint64_t ret = UINT64_MAX;
+
+    pthread_mutex_lock(&log->lock);
+    if (log->first_seq < log->next_seq)
+        ret = log->frames[log->first_seq & (log->capacity - 1)]->stamp;
+    pthread_mutex_unlock(&log->lock);
+
+    return ret;
+}
+
+uint64_t msglog_head(struct msglog *log)
+{
+    uint64_t ret;
+
+    pthread_mutex_lock(&log->lock);
+    ret = log->first_seq;
+    pthread_mutex_unlock(&log->lock);
+
+    return ret;
+}
+
+/* Must lock log->lock */
+static void seek(struct msglog *log, uint64_t seq)
+{
+    drop(log, log->next_seq);
+
+    log->first_seq = seq;
+    log->next_seq = seq;
+}
+
+int msglog_restore(struct msglog *log, uint64_t seq, struct msgbuf *frame)
+{
+    pthread_mutex_lock(&log->lock);
+
+    if (seq < log->next_seq)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return 0;
+    }
+
+    if (seq > log->next_seq)
+        seek(log, seq);
+
+    if (log->next_seq - log->first_seq == log->capacity && grow(log))
+    {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    frame->seq = seq;
+    push(log, frame);
+    log->next_seq++;
+
+    pthread_mutex_unlock(&log->lock);
+
+    return 0;
+}
+
+void msglog_seek(struct msglog *log, uint64_t seq)
+{
+    pthread_mutex_lock(&log->lock);
+    if (seq > log->next_seq)
+        seek(log, seq);
+    pthread_mutex_unlock(&log->lock);
+}
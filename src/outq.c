@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "outq.h"
+
+void outq_init(struct outq *q)
+{
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    q->tail = &q->stub;
+    q->unsent = NULL;
+    q->unsent_last = NULL;
+    q->sent = 0;
+    atomic_store(&q->bytes, 0);
+}
+
+static void outq_link(struct outq *q, struct outq_node *node)
+{
+    struct outq_node *prev;
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+int outq_push(struct outq *q, char *data, size_t len)
+{
+    struct outq_node *node;
+
+    if (!len)
+        return 0;
+
+    node = malloc(sizeof(*node) + len);
+    if (!node)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    node->buf = NULL;
+    node->data = node->inline_data;
+    node->len = len;
+    memcpy(node->data, data, len);
+
+    atomic_fetch_add_explicit(&q->bytes, len, memory_order_relaxed);
+    outq_link(q, node);
+
+    return 0;
+}
+
+int outq_push_buf(struct outq *q, struct msgbuf *buf)
+{
+    struct outq_node *node;
+
+    if (!buf->len)
+        return 0;
+
+    node = malloc(sizeof(*node));
+    if (!node)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    node->buf = msgbuf_get(buf);
+    node->data = buf->data;
+    node->len = buf->len;
+
+    atomic_fetch_add_explicit(&q->bytes, node->len, memory_order_relaxed);
+    outq_link(q, node);
+
+    return 0;
+}
+
+/* Returns NULL when empty, or when a producer is halfway through a push */
+static struct outq_node *outq_pop(struct outq *q)
+{
+    struct outq_node *tail = q->tail, *next, *head;
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub)
+    {
+        if (!next)
+            return NULL;
+
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail != head)
+        return NULL;
+
+    /* tail is the last node, put the stub behind it so it can be taken */
+    outq_link(q, &q->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+size_t outq_fill_iov(struct outq *q, struct iovec *iov, size_t max)
+{
+    struct outq_node *node;
+    size_t count = 0;
+
+    while ((node = outq_pop(q)))
+    {
+        node->unsent_next = NULL;
+        if (q->unsent_last)
+            q->unsent_last->unsent_next = node;
+        else
+            q->unsent = node;
+        q->unsent_last = node;
+    }
+
+    for (node = q->unsent; node && count < max; node = node->unsent_next)
+    {
+        iov[count].iov_base = node->data;
+        iov[count].iov_len = node->len;
+        if (!count)
+        {
+            iov[count].iov_base = node->data + q->sent;
+            iov[count].iov_len = node->len - q->sent;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+void outq_consume(struct outq *q, size_t len)
+{
+    struct outq_node *node;
+
+    atomic_fetch_sub_explicit(&q->bytes, len, memory_order_relaxed);
+
+    while (len && q->unsent)
+    {
+        node = q->unsent;
+        if (len < node->len - q->sent)
+        {
+            q->sent += len;
+            return;
+        }
+
+        len -= node->len - q->sent;
+        q->sent = 0;
+        q->unsent = node->unsent_next;
+        if (!q->unsent)
+            q->unsent_last = NULL;
+        if (node->buf)
+            msgbuf_put(node->buf);
+        free(node);
+    }
+}
+
+void outq_free(struct outq *q)
+{
+    struct iovec iov;
+
+    /* Pulls everything into the unsent list, then drops it */
+    while (outq_fill_iov(q, &iov, 1))
+        outq_consume(q, iov.iov_len);
+}
+
+size_t outq_bytes(struct outq *q)
+{
+    return atomic_load_explicit(&q->bytes, memory_order_relaxed);
+}
@@ -1,723 +1,2680 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include "bitset.h"
+#include "compact.h"
+#include "epoch.h"
+#include "fanout.h"
+#include "frame.h"
 #include "hash.h"
+#include "intern.h"
+#include "mqtt.h"
 #include "server.h"
+#include "snapshot.h"
+#include "store.h"
+#include "timer.h"
 #include "utils.h"
 
+#ifdef HAVE_LIBURING
+#include "uring.h"
+#endif
+
+enum
+{
+    MAX_EVENTS = 64,
+};
+
+/* Types of the records kept in the store */
+enum
+{
+    RECORD_PUBLISH = 1, /* A frame kept for offline clients, on its topic's stream */
+    RECORD_OFFLINE, /* A client went offline, a stored_session */
+    RECORD_ONLINE, /* A client came back or expired, its name. Voids its OFFLINE record */
+};
+
+struct stored_sub
+{
+    uint64_t cursor;
+    uint32_t topic; /* ID, topics have to stay the same across restarts */
+    uint32_t reserved;
+};
+
+/* Followed by the name and its terminator */
+struct stored_session
+{
+    uint32_t name_len;
+    uint32_t num_subs;
+    struct stored_sub subs[];
+};
+
 static char *DEFAULT_TOPIC_NAMES[] = {
     "WEATHER",
     "NEWS",
 };
 
-/* Connected clients */
-static struct hash_table *online_clients;
-pthread_mutex_t online_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Connected clients, split into one slice per shard */
+static struct shard *shards;
+static size_t num_shards;
 
 /* These clients are always added in order of disconnect time */
 static struct hash_table *offline_clients;
 pthread_mutex_t offline_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static struct list msg_queue = LIST_INIT(msg_queue);
-pthread_mutex_t msg_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Session expiry and message TTL, guarded by offline_lock */
+static struct timer_wheel timers;
+static uint64_t session_expiry;
+static uint64_t message_ttl;
+static int logs_expired; /* The logs changed, trim what goes with them */
 
-static struct hash_table *topics;
+static uint64_t idle_timeout;
 
-static void reply_conn(struct connection *conn, char *msg, size_t msg_len)
-{
-    int res;
+/* Bytes held by every topic's log */
+static atomic_size_t retained_bytes;
+static size_t retain_budget;
+static int retain_policy;
 
-    res = send(conn->sock, msg, msg_len, 0);
-    if (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
-    {
-        perror("send");
-        conn->closing = 1;
-    }
+/* What the budget has cost so far, guarded by offline_lock */
+static struct
+{
+    size_t messages;
+    size_t bytes;
+    size_t sessions;
+    size_t topics;
+} evicted;
 
-    return;
-}
+/* NULL unless offline sessions are kept across restarts */
+static struct store *store;
 
-/* Must lock offline_lock when calling */
-static uint64_t get_oldest_offline_client_time(void)
-{
-    struct offline_client *client;
-    uint64_t oldest_time = ~0u;
-    size_t i;
+/* NULL unless subscriptions are snapshotted for warm restarts */
+static const char *snapshot_path;
+static unsigned int snapshot_interval;
 
-    if (hash_empty(offline_clients))
-        return ~0u; /* Removes everything */
+static struct hash_table *topics;
+static struct topic **topic_list; /* By ID */
+static size_t num_topics;
 
-    for (i = 0; i < offline_clients->size; i++)
-    {
-        if (list_empty(&offline_clients->buckets[i]))
-            continue;
-        
-        /* prev/tail is the oldest element, elements are added head first */
-        client = LIST_ENTRY(offline_clients->buckets[i].prev,
-                            struct offline_client,
-                            entry);
+static struct reactor *reactors;
+static size_t num_reactors;
 
-        if (client->disc_time < oldest_time)
-            oldest_time = client->disc_time;
-    }
+static size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+static size_t low_watermark = DEFAULT_LOW_WATERMARK;
 
-    return oldest_time;
-}
+static struct fanout_pool *fanout_pool;
+static size_t fanout_threshold;
 
-static void remove_stale_messages(void)
+/* Writes as much queued output as the socket takes without blocking.
+ * Must only be called by the connection's own thread */
+static void write_conn(struct connection *conn)
 {
-    uint64_t oldest_time = get_oldest_offline_client_time();
-    struct queued_msg *msg;
-    struct list *cur;
+    struct iovec iov[MAX_WRITE_IOV];
+    struct msghdr msg;
+    size_t count;
+    ssize_t res;
 
-    pthread_mutex_lock(&msg_queue_lock);
-
-    for (cur = msg_queue.next; cur != &msg_queue; cur = cur->next)
+    while (!conn->write_failed && (count = outq_fill_iov(&conn->outq, iov, MAX_WRITE_IOV)))
     {
-        msg = LIST_ENTRY(cur, struct queued_msg, entry);
-        if (msg->time < oldest_time)
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        res = sendmsg(conn->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (res == -1)
         {
-            list_remove(cur);
-            free(msg->message);
-            free(msg->topic);
-            free(msg->sender);
-            free(msg);
-        }
-    }
+            if (errno == EINTR)
+                continue;
 
-    pthread_mutex_unlock(&msg_queue_lock);
-}
+            /* Picked up again once the socket is writable */
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
 
-static int is_offline_client_subscribed(struct offline_client *client, char *topic)
-{
-    struct subscription *sub;
-    struct list *cur;
+            perror("sendmsg");
+            conn->write_failed = 1;
+            conn->closing = 1;
+            return;
+        }
 
-    for (cur = client->subs.next; cur != &client->subs; cur = cur->next)
-    {
-        sub = LIST_ENTRY(cur, struct subscription, entry);
-        if (!strcmp(sub->topic_name, topic))
-            return 1;
+        outq_consume(&conn->outq, res);
     }
+}
 
-    return 0;
+static void flush_conn(struct connection *conn)
+{
+    if (conn->reactor && conn->reactor->flush)
+        conn->reactor->flush(conn);
+    else
+        write_conn(conn);
 }
 
-static void add_offline_client(struct connection *conn)
+/* Hands the connection to whichever thread owns its socket */
+static void schedule_flush(struct connection *conn)
 {
-    struct offline_client *off_client; 
+    struct reactor *reactor = conn->reactor;
+    uint64_t one = 1;
 
-    off_client = calloc(sizeof(*off_client), 1);
-    if (!off_client)
-    {
-        perror("calloc");
+    if (atomic_exchange(&conn->flush_pending, 1))
         return;
-    }
 
-    off_client->name = strdup(conn->name);
-    if (!off_client->name)
+    if (!reactor)
     {
-        perror("stdup");
-        free(off_client);
+        if (write(conn->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("write");
         return;
     }
 
-    list_init(&off_client->entry);
-    list_init(&off_client->subs);
-    off_client->disc_time = get_current_time();
-
-    list_move_append(&off_client->subs, &conn->subbed_topics);
-
-    pthread_mutex_lock(&offline_lock);
+    /* The ready list keeps the connection alive until it is flushed */
+    atomic_fetch_add(&conn->refs, 1);
 
-    hash_insert(offline_clients,
-                off_client->name,
-                strlen(off_client->name) + 1,
-                &off_client->entry);
+    pthread_mutex_lock(&reactor->ready_lock);
+    list_add_tail(&reactor->ready, &conn->ready_entry);
+    pthread_mutex_unlock(&reactor->ready_lock);
 
-    pthread_mutex_unlock(&offline_lock);
-    
-    return;
+    /* The reactor flushes its ready list after every batch of events anyway */
+    if (!pthread_equal(pthread_self(), reactor->thread)
+        && write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("write");
 }
 
-/* Removes offline client and moves data to connection. Frees offline_client */
-static void reconnect_offline_client(struct offline_client *offline, struct connection *conn)
+/* Applies the watermarks, returns 0 if the frame should be dropped */
+static int conn_accepts(struct connection *conn, size_t msg_len)
 {
-    struct queued_msg *msg;
-    struct list *cur;
-    char msg_buf[1024];
+    size_t queued;
 
-    pthread_mutex_lock(&msg_queue_lock);
+    if (conn->write_failed)
+        return 0;
 
-    for (cur = msg_queue.next; cur != &msg_queue; cur = cur->next)
-    {
-        msg = LIST_ENTRY(cur, struct queued_msg, entry);
-
-        if (offline->disc_time > msg->time)
-            break;
-
-        if (!is_offline_client_subscribed(offline, msg->topic))
-            continue;
-
-        snprintf(msg_buf, 1024, "<%s, PUB, %s, %s>", msg->sender, msg->topic, msg->message);
+    /* Slow readers lose messages instead of stalling whoever sends to them.
+     * A frame over the high watermark on its own still goes to an empty queue */
+    queued = outq_bytes(&conn->outq);
+    if (atomic_load(&conn->throttled) && queued <= low_watermark)
+        atomic_store(&conn->throttled, 0);
+    if (queued && queued + msg_len > high_watermark && !atomic_exchange(&conn->throttled, 1))
+        fprintf(stderr, "Client on socket %d is over its high watermark, dropping messages\n", conn->sock);
 
-        reply_conn(conn, msg_buf, strlen(msg_buf));
+    if (atomic_load(&conn->throttled))
+    {
+        atomic_fetch_add(&conn->dropped, 1);
+        return 0;
     }
 
-    pthread_mutex_unlock(&msg_queue_lock);
-
-    list_move_append(&conn->subbed_topics, &offline->subs);
-
-    list_remove(&offline->entry);
-    free(offline->name);
-    free(offline);
+    return 1;
+}
 
-    remove_stale_messages();
+/* Never blocks, the frame is queued and written by the connection's owner */
+static void reply_conn(struct connection *conn, char *msg, size_t msg_len)
+{
+    if (!conn_accepts(conn, msg_len) || outq_push(&conn->outq, msg, msg_len))
+        return;
 
-    return;
+    schedule_flush(conn);
 }
 
-static void close_connection(struct connection *conn)
+/* Replies are made as text frames, compact clients get the same tokens */
+static void reply_text(struct connection *conn, char *msg, size_t msg_len)
 {
-    if (conn->name)
-        add_offline_client(conn);
+    char copy[MAX_COMMAND_SIZE], frame[MAX_COMMAND_SIZE + (MAX_FRAME_TOKENS + 1) * COMPACT_MAX_VARINT];
+    char *toks[MAX_FRAME_TOKENS];
+    size_t lens[MAX_FRAME_TOKENS], num_toks;
+
+    if (conn->protocol != PROTOCOL_COMPACT)
+    {
+        reply_conn(conn, msg, msg_len);
+        return;
+    }
 
-    pthread_mutex_lock(&online_lock);
-    list_remove(&conn->entry);
-    pthread_mutex_unlock(&online_lock);
+    assert(msg_len <= sizeof(copy));
+    memcpy(copy, msg, msg_len);
+    num_toks = frame_split(copy, msg_len, toks, lens, MAX_FRAME_TOKENS);
 
-    close(conn->sock);
-    free(conn->name);
-    free(conn);
+    reply_conn(conn, frame, compact_encode(frame, (const char *const *)toks, lens, num_toks));
 }
 
-static struct topic *get_topic(char *name)
+/* Publishes are built as <name, PUB, topic, payload>. Neither the name nor
+ * the topic holds ", ", so the payload is whatever follows the third one.
+ * Returns -1 if the frame is not one */
+static int split_publish(struct msgbuf *frame, const char **toks, size_t *lens)
 {
-    struct list *bucket, *cur;
-    struct topic *topic;
-    size_t hash;
+    char *pos = frame->data + 1, *end, *seps[3];
+    size_t i;
 
-    hash = hash_bytes(name, strlen(name) + 1) % topics->size;
-    bucket = &topics->buckets[hash];
+    if (frame->len < 2 || frame->data[0] != '<' || frame->data[frame->len - 1] != '>')
+        return -1;
+    end = frame->data + frame->len - 1;
 
-    for (cur = bucket->next; cur != bucket; cur = cur->next)
+    for (i = 0; i < 3; i++)
     {
-        topic = LIST_ENTRY(cur, struct topic, entry);
-        if (!strcmp(topic->name, name))
-            return topic;
+        seps[i] = memmem(pos, end - pos, ", ", 2);
+        if (!seps[i])
+            return -1;
+        pos = seps[i] + 2;
     }
 
-    return NULL;
+    toks[0] = frame->data + 1;
+    lens[0] = seps[0] - toks[0];
+    toks[1] = seps[0] + 2;
+    lens[1] = seps[1] - toks[1];
+    toks[2] = seps[1] + 2;
+    lens[2] = seps[2] - toks[2];
+    toks[3] = pos;
+    lens[3] = end - pos;
+
+    return 0;
 }
 
-/* Must lock online_lock when calling */
-static struct connection *get_client_by_name(char *name)
+static struct msgbuf *encode_publish(struct msgbuf *frame, int encoding)
 {
-    struct list *bucket, *cur;
-    struct connection *conn;
-    size_t hash;
+    struct msgbuf *packet;
+    const char *toks[4];
+    size_t lens[4], len;
+
+    if (split_publish(frame, toks, lens))
+        return NULL;
 
-    hash = hash_bytes(name, strlen(name) + 1) % online_clients->size;
-    bucket = &online_clients->buckets[hash];
+    if (encoding == PROTOCOL_COMPACT)
+    {
+        packet = msgbuf_alloc(compact_frame_size(lens, 4));
+        if (!packet)
+            return NULL;
 
-    for (cur = bucket->next; cur != bucket; cur = cur->next)
+        packet->len = compact_encode(packet->data, toks, lens, 4);
+    }
+    else
     {
-        conn = LIST_ENTRY(cur, struct connection, entry);
-        if (!strcmp(conn->name, name))
-            return conn;
+        packet = msgbuf_alloc(MQTT_MAX_HEADER_SIZE + 2 + lens[2] + lens[3]);
+        if (!packet)
+            return NULL;
+
+        len = mqtt_encode_publish((unsigned char *)packet->data, toks[2], lens[2], lens[3]);
+        memcpy(packet->data + len, toks[3], lens[3]);
+        packet->len = len + lens[3];
     }
+    packet->stamp = frame->stamp;
 
-    return NULL;
+    return packet;
 }
 
-/* Must lock offline_lock when calling */
-static struct offline_client *get_offline_client_by_name(char *name)
+/* Like reply_conn, but queues a reference to a shared frame instead of a copy */
+static void send_frame(struct connection *conn, struct msgbuf *frame)
 {
-    struct list *bucket, *cur;
-    struct offline_client *client;
-    size_t hash;
-
-    hash = hash_bytes(name, strlen(name) + 1) % offline_clients->size;
-    bucket = &offline_clients->buckets[hash];
+    /* Built once per publish for all clients of the protocol. Text clients
+     * are left out of payloads they could not split back out */
+    if (conn->protocol != PROTOCOL_TEXT)
+        frame = msgbuf_encoded(frame, conn->protocol, encode_publish);
+    else if (frame->binary)
+        return;
 
-    for (cur = bucket->next; cur != bucket; cur = cur->next)
-    {
-        client = LIST_ENTRY(cur, struct offline_client, entry);
-        if (!strcmp(client->name, name))
-            return client;
-    }
+    if (!frame || !conn_accepts(conn, frame->len) || outq_push_buf(&conn->outq, frame))
+        return;
 
-    return NULL;
+    schedule_flush(conn);
 }
 
-/* Must lock topic->subs_lock */
-static int exists_sub_by_name(struct topic *topic, char *name)
+void conn_put(struct connection *conn)
 {
-    struct list *bucket, *cur;
-    struct subscriber *sub;
-    size_t hash;
+    if (atomic_fetch_sub(&conn->refs, 1) != 1)
+        return;
+
+    if (atomic_load(&conn->dropped))
+        fprintf(stderr, "Dropped %zu messages to a slow client\n", atomic_load(&conn->dropped));
 
-    hash = hash_bytes(name, strlen(name) + 1) % topic->subs->size;
-    bucket = &topic->subs->buckets[hash];
+    outq_free(&conn->outq);
+    if (conn->wake_fd != -1)
+        close(conn->wake_fd);
+    if (conn->name)
+        intern_put(conn->name);
+    bitset_free(&conn->topic_ids);
+    free(conn);
+}
+
+void init_reactor_queue(struct reactor *reactor)
+{
+    list_init(&reactor->ready);
+    pthread_mutex_init(&reactor->ready_lock, NULL);
+    timer_wheel_init(&reactor->idle_timers, get_time_ms());
 
-    for (cur = bucket->next; cur != bucket; cur = cur->next)
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (reactor->wake_fd == -1)
     {
-        sub = LIST_ENTRY(cur, struct subscriber, entry);
-        if (!strcmp(sub->client_name, name))
-            return 1;
+        perror("eventfd");
+        exit(EXIT_FAILURE);
     }
-
-    return 0;
 }
 
-static void send_to_client_by_name(char *client_name, char *msg, size_t msg_len)
+void flush_ready_conns(struct reactor *reactor)
 {
+    struct list ready = LIST_INIT(ready);
     struct connection *conn;
 
-    pthread_mutex_lock(&online_lock);
+    pthread_mutex_lock(&reactor->ready_lock);
+    list_move_append(&ready, &reactor->ready);
+    pthread_mutex_unlock(&reactor->ready_lock);
 
-    conn = get_client_by_name(client_name);
-    if (!conn)
+    while (!list_empty(&ready))
     {
-        pthread_mutex_unlock(&online_lock);
-        return;
-    }
+        conn = LIST_ENTRY(ready.next, struct connection, ready_entry);
 
-    reply_conn(conn, msg, msg_len);
+        /* Unlinked before clearing the flag, a producer may queue it again */
+        list_remove(&conn->ready_entry);
+        atomic_store(&conn->flush_pending, 0);
 
-    pthread_mutex_unlock(&online_lock);
+        if (!conn->closed)
+            flush_conn(conn);
 
-    return;
+        conn_put(conn);
+    }
 }
 
-static void enqueue_msg(char *msg, char *topic, char *sender)
+static int is_offline_client_subscribed(struct offline_client *client, struct topic *topic)
 {
-    uint64_t cur_time = get_current_time();
-    struct queued_msg *queued_msg;
-
-    queued_msg = calloc(sizeof(*queued_msg), 1);
-    if (!queued_msg)
-    {
-        perror("calloc");
-        return;
-    }
+    return bitset_test(&client->topic_ids, topic->id);
+}
 
-    list_init(&queued_msg->entry);
-    queued_msg->time = cur_time;
-    queued_msg->message = strdup(msg);
-    if (!queued_msg->message)
-    {
-        perror("calloc");
-        free(queued_msg);
-        return;
-    }
-    queued_msg->topic = strdup(topic);
-    if (!queued_msg->topic)
-    {
-        perror("calloc");
-        free(queued_msg->message);
-        free(queued_msg);
-        return;
-    }
-    queued_msg->sender = strdup(sender);
-    if (!queued_msg->sender)
-    {
-        perror("calloc");
-        free(queued_msg->topic);
-        free(queued_msg->message);
-        free(queued_msg);
-        return;
-    }
+static void put_conn(void *conn)
+{
+    conn_put(conn);
+}
 
-    pthread_mutex_lock(&msg_queue_lock);
+/* Points the subscriber entry at conn, or marks it disconnected if conn is NULL.
+ * The entry holds a reference, dropped only once publishers that may have
+ * loaded the old pointer are done with it */
+static void set_subscriber_conn(struct subscription *sub, struct connection *conn)
+{
+    struct connection *old;
 
-    list_add_tail(&msg_queue, &queued_msg->entry);
+    if (conn)
+        atomic_fetch_add(&conn->refs, 1);
 
-    pthread_mutex_unlock(&msg_queue_lock);
+    old = atomic_exchange(&sub->subscriber->conn, conn);
 
-    return;
+    if (old)
+        epoch_retire(put_conn, old);
 }
 
-/* Must lock topic->subs_lock */
-static void publish_msg(struct topic *topic, char **cmd, size_t num_toks)
+static void detach_subscriptions(struct list *subs)
 {
-    struct list *bucket, *cur;
-    size_t len, i, msg_size;
-    struct subscriber *sub;
-    char msg[1024];
-
-    assert(num_toks >= 4);
+    struct list *cur;
 
-    msg_size = sizeof(msg) / sizeof(*msg);
-    len = snprintf(msg, msg_size, "<%s, %s, %s, %s>", cmd[0], cmd[1], cmd[2], cmd[3]);
-    if (len >= msg_size)
-        len = msg_size - 1;
+    for (cur = subs->next; cur != subs; cur = cur->next)
+        set_subscriber_conn(LIST_ENTRY(cur, struct subscription, entry), NULL);
+}
 
-    assert(len > 1);
+/* Tables of clients are keyed by the ID of their interned name, which holders
+ * of the name keep alive for as long as the entry exists */
+static int insert_by_name(struct hash_table *table, struct interned *name, void *value)
+{
+    return hash_insert_hashed(table, &name->id, sizeof(name->id), name->hash, value);
+}
 
-    for (i = 0; i < topic->subs->size; i++)
-    {
-        bucket = &topic->subs->buckets[i];
-        for (cur = bucket->next; cur != bucket; cur = cur->next)
-        {
-            sub = LIST_ENTRY(cur, struct subscriber, entry);
-            send_to_client_by_name(sub->client_name, msg, len);
-        }
-    }
+static void *lookup_by_name(struct hash_table *table, struct interned *name)
+{
+    return hash_lookup_hashed(table, &name->id, sizeof(name->id), name->hash);
+}
 
-    if (!hash_empty(offline_clients))
-        enqueue_msg(cmd[3], cmd[2], cmd[0]);
+static void *remove_by_name(struct hash_table *table, struct interned *name)
+{
+    return hash_remove_hashed(table, &name->id, sizeof(name->id), name->hash);
+}
 
-    return;
+static int is_subscribed(struct sub_snapshot *snapshot, struct interned *name)
+{
+    return bitset_test(&snapshot->name_ids, name->id);
 }
 
-static void connect_command(struct connection *conn, char **cmd_toks, size_t num_toks)
+static void free_snapshot(void *data)
 {
-    static char *CONN_ACK = "<CONN_ACK>";
-    struct offline_client *offline_client;
-    struct connection *found;
-    char *name, **name_src;
+    struct sub_snapshot *snapshot = data;
 
-    if (num_toks < 2)
-        return; /* Specification does not demand we respond */
+    bitset_free(&snapshot->name_ids);
+    free(snapshot);
+}
 
-    /* RECONNECT's argument order is reversed for some reason */
-    if (!strcmp(cmd_toks[0], "RECONNECT"))
-        name_src = &cmd_toks[1];
-    else
-        name_src = &cmd_toks[0];
+/* Copies old without removed and with the num_added subscribers in added,
+ * removed may be NULL. old may be NULL for an empty set. Returns NULL if
+ * allocation fails */
+static struct sub_snapshot *build_snapshot(struct sub_snapshot *old, struct subscriber **added, size_t num_added,
+                                           struct subscriber *removed)
+{
+    size_t old_count = old ? old->count : 0, count = 0, i;
+    struct sub_snapshot *snapshot;
 
-    name = strdup(*name_src);
-    if (name == NULL)
+    snapshot = malloc(sizeof(*snapshot) + (old_count + num_added) * sizeof(*snapshot->subs));
+    if (!snapshot)
     {
-        perror("strdup");
-        return;
+        perror("malloc");
+        return NULL;
     }
 
-    pthread_mutex_lock(&online_lock);
-
-    found = get_client_by_name(name);
-    if (found)
+    for (i = 0; i < old_count; i++)
     {
-        /* Only ACK if this is already connected */
-        if (found == conn)
-            reply_conn(conn, CONN_ACK, strlen(CONN_ACK));
-
-        pthread_mutex_unlock(&online_lock);
-        return;
+        if (old->subs[i] != removed)
+            snapshot->subs[count++] = old->subs[i];
     }
+    for (i = 0; i < num_added; i++)
+        snapshot->subs[count++] = added[i];
+    snapshot->count = count;
 
-    /* Already connected, remove from list and add offline entry */
-    if (conn->name)
+    bitset_init(&snapshot->name_ids);
+    for (i = 0; i < count; i++)
     {
-        add_offline_client(conn);
-        list_remove(&conn->entry);
+        if (bitset_set(&snapshot->name_ids, snapshot->subs[i]->client_name->id))
+        {
+            free_snapshot(snapshot);
+            return NULL;
+        }
     }
 
-    conn->name = name;
-    hash_insert(online_clients, conn->name, strlen(conn->name) + 1, &conn->entry);
-
-    pthread_mutex_unlock(&online_lock);
-
-    pthread_mutex_lock(&offline_lock);
-
-    reply_conn(conn, CONN_ACK, strlen(CONN_ACK));
+    return snapshot;
+}
 
-    offline_client = get_offline_client_by_name(conn->name);
-    if (offline_client)
-        reconnect_offline_client(offline_client, conn);
+/* Must lock topic->subs_lock */
+static void replace_snapshot(struct topic *topic, struct sub_snapshot *snapshot)
+{
+    epoch_retire(free_snapshot, atomic_exchange(&topic->subs, snapshot));
+}
 
-    pthread_mutex_unlock(&offline_lock);
+static void free_subscriber(void *data)
+{
+    struct subscriber *sub = data;
 
-    return;
+    intern_put(sub->client_name);
+    free(sub);
 }
 
-static void publish_command(struct connection *conn, char **cmd_toks, size_t num_toks)
+/* Takes the subscriber out of its topic and frees it once publishers are done */
+static void remove_subscription(struct subscription *sub)
 {
-    static char *NOT_FOUND = "<ERROR: Subject Not Found>";
-    static char *NOT_SUBBED = "<ERROR: Not Subscribed>";
-    char *name, *topic_name;
-    struct topic *topic;
-
-    if (num_toks < 4)
-        return; /* Specification does not demand we respond */
+    struct topic *topic = sub->topic;
+    struct sub_snapshot *snapshot;
 
-    name = cmd_toks[0];
-    topic_name = cmd_toks[2];
-    topic = get_topic(topic_name);
-    if (!topic)
-    {
-        reply_conn(conn, NOT_FOUND, strlen(NOT_FOUND));
-        return;
-    }
+    set_subscriber_conn(sub, NULL);
 
     pthread_mutex_lock(&topic->subs_lock);
 
-    if (!exists_sub_by_name(topic, name))
-    {
-        reply_conn(conn, NOT_SUBBED, strlen(NOT_SUBBED));
-        pthread_mutex_unlock(&topic->subs_lock);
-        return;
-    }
-
-    publish_msg(topic, cmd_toks, num_toks);
+    snapshot = build_snapshot(atomic_load(&topic->subs), NULL, 0, sub->subscriber);
+    if (snapshot)
+        replace_snapshot(topic, snapshot);
 
     pthread_mutex_unlock(&topic->subs_lock);
 
-    return;
+    /* Leaked if the topic could not be rebuilt, it is still reachable */
+    if (snapshot)
+        epoch_retire(free_subscriber, sub->subscriber);
 }
 
-static void subscribe_command(struct connection *conn, char **cmd_toks, size_t num_toks)
+static void remove_subscriptions(struct list *subs)
 {
-    static char *NOT_FOUND = "<ERROR: Subscription Failed - Subject Not Found>";
-    static char *SUB_ACK = "<SUB_ACK>";
-    struct subscription *topic_sub;
-    struct subscriber *subscriber;
-    char *name, *topic_name;
-    struct topic *topic;
-
-    if (num_toks < 3)
-        return; /* Specification does not demand we respond */
+    struct subscription *sub;
 
-    name = cmd_toks[0];
-    topic_name = cmd_toks[2];
-    topic = get_topic(topic_name);
-    if (!topic)
+    while (!list_empty(subs))
     {
-        reply_conn(conn, NOT_FOUND, strlen(NOT_FOUND));
-        return;
+        sub = LIST_ENTRY(subs->next, struct subscription, entry);
+        list_remove(&sub->entry);
+        remove_subscription(sub);
+        free(sub);
     }
+}
+
+/* Returns a subscription of name to topic that is not in the topic's set yet,
+ * or NULL. Takes over the reference to name */
+static struct subscription *alloc_subscription(struct topic *topic, struct interned *name)
+{
+    struct subscription *topic_sub;
+    struct subscriber *subscriber;
 
     subscriber = malloc(sizeof(*subscriber));
     if (!subscriber)
     {
         perror("malloc");
-        return;
+        intern_put(name);
+        return NULL;
     }
 
     topic_sub = malloc(sizeof(*topic_sub));
     if (!topic_sub)
     {
         perror("malloc");
+        intern_put(name);
         free(subscriber);
-        return;
+        return NULL;
     }
 
-    list_init(&subscriber->entry);
-    subscriber->client_name = strdup(name);
-    if (!subscriber->client_name)
+    subscriber->client_name = name;
+    atomic_init(&subscriber->conn, NULL);
+    atomic_init(&subscriber->replayed, 0);
+    atomic_init(&subscriber->kept, 1);
+    list_init(&topic_sub->entry);
+    topic_sub->topic = topic;
+    topic_sub->subscriber = subscriber;
+
+    return topic_sub;
+}
+
+/* Adds a subscriber named name to topic, delivering to conn, or to nobody yet
+ * if conn is NULL. Takes over the reference to name. Returns -1 on failure,
+ * otherwise sets *ret to the new subscription, or NULL if name was already
+ * subscribed */
+static int add_subscription(struct topic *topic, struct interned *name, struct connection *conn,
+                            struct subscription **ret)
+{
+    struct subscription *topic_sub;
+    struct sub_snapshot *snapshot;
+    struct subscriber *subscriber;
+
+    *ret = NULL;
+
+    topic_sub = alloc_subscription(topic, name);
+    if (!topic_sub)
+        return -1;
+    subscriber = topic_sub->subscriber;
+
+    pthread_mutex_lock(&topic->subs_lock);
+
+    if (is_subscribed(atomic_load(&topic->subs), name))
     {
-        perror("malloc");
+        pthread_mutex_unlock(&topic->subs_lock);
+        intern_put(name);
         free(subscriber);
         free(topic_sub);
-        return;
+        return 0;
     }
 
-    list_init(&topic_sub->entry);
-    topic_sub->topic_name = strdup(topic_name);
-    if (!topic_sub->topic_name)
+    snapshot = build_snapshot(atomic_load(&topic->subs), &subscriber, 1, NULL);
+    if (!snapshot)
     {
-        perror("malloc");
-        free(subscriber->client_name);
+        pthread_mutex_unlock(&topic->subs_lock);
+        intern_put(name);
         free(subscriber);
         free(topic_sub);
-        return;
+        return -1;
     }
 
-    pthread_mutex_lock(&topic->subs_lock);
-
-    if (exists_sub_by_name(topic, name))
+    /* A subscription made by a connection belongs to it, so fan-out goes straight to it */
+    if (conn)
     {
-        /* Already subscribed, just ACK */
-        reply_conn(conn, SUB_ACK, strlen(SUB_ACK));
-        free(subscriber->client_name);
-        free(subscriber);
-        free(topic_sub->topic_name);
+        atomic_fetch_add(&conn->refs, 1);
+        atomic_init(&subscriber->kept, conn->name && !conn->clean_session);
+    }
+    atomic_init(&subscriber->conn, conn);
+    replace_snapshot(topic, snapshot);
+
+    pthread_mutex_unlock(&topic->subs_lock);
+
+    *ret = topic_sub;
+    return 0;
+}
+
+/* Called with the topic's log locked, so its records go in sequence order */
+static void store_publish(void *ctx, uint64_t seq, struct msgbuf *frame)
+{
+    struct topic *topic = ctx;
+
+    store_append(store, RECORD_PUBLISH, topic->id, seq, frame->data, frame->len, NULL);
+}
+
+/* Must lock offline_lock. Records the session so a restart brings it back,
+ * its segment is kept until the client reconnects */
+static void store_offline_client(struct offline_client *client)
+{
+    struct stored_session *session;
+    size_t num_subs = 0, i;
+
+    session = malloc(sizeof(*session) + num_topics * sizeof(*session->subs) + client->name->len);
+    if (!session)
+    {
+        perror("malloc");
+        return;
+    }
+
+    for (i = 0; i < num_topics; i++)
+    {
+        if (!is_offline_client_subscribed(client, topic_list[i]))
+            continue;
+
+        session->subs[num_subs].cursor = client->cursors[i];
+        session->subs[num_subs].topic = i;
+        session->subs[num_subs].reserved = 0;
+        num_subs++;
+    }
+    session->name_len = client->name->len;
+    session->num_subs = num_subs;
+    memcpy(&session->subs[num_subs], client->name->str, client->name->len);
+
+    if (!store_append(store, RECORD_OFFLINE, STORE_NO_STREAM, 0, session,
+                      sizeof(*session) + num_subs * sizeof(*session->subs) + client->name->len, &client->segment))
+    {
+        client->stored = 1;
+        store_pin(store, client->segment);
+    }
+
+    free(session);
+}
+
+/* Must lock offline_lock */
+static void store_online_client(struct offline_client *client)
+{
+    if (!client->stored)
+        return;
+
+    store_append(store, RECORD_ONLINE, STORE_NO_STREAM, 0, client->name->str, client->name->len, NULL);
+    store_unpin(store, client->segment);
+}
+
+/* Must lock offline_lock. Publishes are only kept for topics with offline
+ * subscribers, so this follows every client put in or taken out of
+ * offline_clients */
+static void count_offline_subs(struct offline_client *client, int offline)
+{
+    size_t i;
+
+    for (i = 0; i < num_topics; i++)
+    {
+        if (!is_offline_client_subscribed(client, topic_list[i]))
+            continue;
+
+        if (offline)
+            atomic_fetch_add(&topic_list[i]->num_offline, 1);
+        else
+            atomic_fetch_sub(&topic_list[i]->num_offline, 1);
+    }
+}
+
+/* Must lock offline_lock. Removes the client and its subscriptions */
+static void drop_offline_client(struct offline_client *client)
+{
+    remove_by_name(offline_clients, client->name);
+    count_offline_subs(client, 0);
+    timer_cancel(&timers, &client->expiry);
+    if (store)
+        store_online_client(client);
+
+    remove_subscriptions(&client->subs);
+    bitset_free(&client->topic_ids);
+    intern_put(client->name);
+    free(client->cursors);
+    free(client);
+}
+
+/* Must lock offline_lock, which the timer thread holds */
+static void expire_offline_client(struct timer *timer, void *ctx)
+{
+    drop_offline_client(ctx);
+    logs_expired = 1;
+}
+
+/* Must lock offline_lock */
+static void arm_offline_client(struct offline_client *client)
+{
+    timer_init(&client->expiry, expire_offline_client, client);
+    if (session_expiry)
+        timer_add(&timers, &client->expiry, get_time_ms() + session_expiry);
+}
+
+static void add_offline_client(struct connection *conn)
+{
+    struct offline_client *off_client; 
+    int ret;
+    size_t i;
+
+    off_client = calloc(sizeof(*off_client), 1);
+    if (!off_client)
+    {
+        perror("calloc");
+        detach_subscriptions(&conn->subbed_topics);
+        return;
+    }
+
+    off_client->cursors = malloc(num_topics * sizeof(*off_client->cursors));
+    if (!off_client->cursors)
+    {
+        perror("malloc");
+        free(off_client);
+        detach_subscriptions(&conn->subbed_topics);
+        return;
+    }
+
+    off_client->name = intern_get(conn->name);
+    list_init(&off_client->subs);
+
+    pthread_mutex_lock(&offline_lock);
+
+    ret = insert_by_name(offline_clients, off_client->name, off_client);
+    if (!ret)
+    {
+        list_move_append(&off_client->subs, &conn->subbed_topics);
+        off_client->topic_ids = conn->topic_ids;
+        bitset_init(&conn->topic_ids);
+
+        /* Publishes are kept from here on and the cursors are taken before
+         * live delivery stops, so one in between arrives twice but never
+         * goes missing */
+        for (i = 0; i < num_topics; i++)
+        {
+            if (is_offline_client_subscribed(off_client, topic_list[i]))
+            {
+                atomic_fetch_add(&topic_list[i]->num_offline, 1);
+                off_client->cursors[i] = msglog_tail(&topic_list[i]->log);
+            }
+        }
+
+        if (store)
+            store_offline_client(off_client);
+        arm_offline_client(off_client);
+    }
+
+    pthread_mutex_unlock(&offline_lock);
+
+    if (!ret)
+    {
+        detach_subscriptions(&off_client->subs);
+        return;
+    }
+
+    /* Nothing to come back to, the subscriptions go with it */
+    remove_subscriptions(&conn->subbed_topics);
+    intern_put(off_client->name);
+    free(off_client->cursors);
+    free(off_client);
+}
+
+/* Must lock offline_lock. Drops the messages every offline subscriber of a
+ * topic has already been given */
+static void trim_topic_logs(void)
+{
+    struct offline_client *client;
+    size_t iter = 0, i;
+    uint64_t *cursors;
+
+    cursors = malloc(num_topics * sizeof(*cursors));
+    if (!cursors)
+    {
+        perror("malloc");
+        return;
+    }
+
+    /* Topics nobody offline subscribes to keep nothing */
+    for (i = 0; i < num_topics; i++)
+        cursors[i] = UINT64_MAX;
+
+    while ((client = hash_next(offline_clients, &iter)))
+    {
+        for (i = 0; i < num_topics; i++)
+        {
+            if (is_offline_client_subscribed(client, topic_list[i]) && client->cursors[i] < cursors[i])
+                cursors[i] = client->cursors[i];
+        }
+    }
+
+    for (i = 0; i < num_topics; i++)
+    {
+        msglog_trim(&topic_list[i]->log, cursors[i]);
+
+        /* Nobody is left who missed messages a stopped topic did not keep */
+        if (cursors[i] == UINT64_MAX)
+            atomic_store(&topic_list[i]->retaining, 1);
+    }
+
+    /* Segments go once no log still holds what they recorded */
+    if (store)
+    {
+        for (i = 0; i < num_topics; i++)
+            cursors[i] = msglog_head(&topic_list[i]->log);
+        store_trim(store, cursors);
+    }
+
+    free(cursors);
+}
+
+static void replay_frame(void *conn, struct msgbuf *frame)
+{
+    send_frame(conn, frame);
+}
+
+/* Removes offline client and moves data to connection. Frees offline_client.
+ * Its topic IDs must already be in conn's */
+static void reconnect_offline_client(struct offline_client *offline, struct connection *conn)
+{
+    struct subscription *sub;
+    struct list *cur;
+
+    /* Live delivery starts before the replay, so a publish landing in between
+     * is not missed. Logged frames are held back from it until the replay
+     * marks where it stopped */
+    for (cur = offline->subs.next; cur != &offline->subs; cur = cur->next)
+    {
+        sub = LIST_ENTRY(cur, struct subscription, entry);
+        atomic_store(&sub->subscriber->replayed, UINT64_MAX);
+        set_subscriber_conn(sub, conn);
+    }
+
+    /* Each topic's log is read from the cursor onwards, in publish order */
+    for (cur = offline->subs.next; cur != &offline->subs; cur = cur->next)
+    {
+        sub = LIST_ENTRY(cur, struct subscription, entry);
+        msglog_replay_mark(&sub->topic->log, offline->cursors[sub->topic->id], replay_frame, conn,
+                           &sub->subscriber->replayed);
+    }
+
+    list_move_append(&conn->subbed_topics, &offline->subs);
+    bitset_free(&offline->topic_ids);
+
+    remove_by_name(offline_clients, offline->name);
+    count_offline_subs(offline, 0);
+    timer_cancel(&timers, &offline->expiry);
+    if (store)
+        store_online_client(offline);
+    intern_put(offline->name);
+    free(offline->cursors);
+    free(offline);
+
+    trim_topic_logs();
+
+    return;
+}
+
+/* Must lock conn->shard->online_lock. The name may already belong to a newer
+ * connection if this one sent DISC, so only our own entry is removed */
+static void remove_online_client(struct connection *conn)
+{
+    if (conn->name && lookup_by_name(conn->shard->online_clients, conn->name) == conn)
+        remove_by_name(conn->shard->online_clients, conn->name);
+}
+
+void close_connection(struct connection *conn)
+{
+    if (conn->name && !conn->clean_session)
+    {
+        add_offline_client(conn);
+    }
+    else
+    {
+        /* Subscribed without ever connecting or asked for no session, nothing to keep */
+        remove_subscriptions(&conn->subbed_topics);
+    }
+
+    pthread_mutex_lock(&conn->shard->online_lock);
+    remove_online_client(conn);
+    pthread_mutex_unlock(&conn->shard->online_lock);
+
+    /* Last chance for replies such as DISC_ACK to go out */
+    if (!conn->reactor || !conn->reactor->flush)
+        write_conn(conn);
+
+    if (conn->reactor)
+        timer_cancel(&conn->reactor->idle_timers, &conn->idle_timer);
+
+    close(conn->sock);
+    conn->closed = 1;
+    frame_free(&conn->frame);
+
+    conn_put(conn);
+}
+
+static struct topic *get_topic(char *name)
+{
+    return hash_lookup(topics, name, strlen(name) + 1);
+}
+
+/* For names that are not NUL terminated */
+static struct topic *find_topic(const char *name, size_t len)
+{
+    char buf[MAX_COMMAND_SIZE];
+
+    if (len >= sizeof(buf))
+        return NULL;
+
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    return hash_lookup(topics, buf, len + 1);
+}
+
+/* Must lock shard->online_lock when calling */
+static struct connection *get_client_by_name(struct shard *shard, struct interned *name)
+{
+    return lookup_by_name(shard->online_clients, name);
+}
+
+/* Must lock offline_lock when calling */
+static struct offline_client *get_offline_client_by_name(struct interned *name)
+{
+    return lookup_by_name(offline_clients, name);
+}
+
+/* Commands nearly always carry the sender's own name, which is already
+ * interned. conn->name only changes on the connection's own thread */
+static struct interned *find_name(struct connection *conn, char *str)
+{
+    if (conn->name && !strcmp(conn->name->str, str))
+        return intern_get(conn->name);
+
+    return intern_find(str);
+}
+
+struct delivery
+{
+    struct shard *shard;
+    struct sub_snapshot *snapshot;
+    struct msgbuf *frame;
+};
+
+/* Delivers to subscribers [begin, end) of the snapshot */
+static void deliver_range(void *ctx, size_t begin, size_t end)
+{
+    struct delivery *delivery = ctx;
+    struct subscriber *subscriber;
+    struct connection *conn;
+    size_t i;
+
+    for (i = begin; i < end; i++)
+    {
+        subscriber = delivery->snapshot->subs[i];
+        conn = atomic_load_explicit(&subscriber->conn, memory_order_acquire);
+
+        /* Clients on other shards are delivered to by their own shard */
+        if (!conn || conn->shard != delivery->shard)
+            continue;
+
+        /* A reconnecting client was given it from the log */
+        if (delivery->frame->seq < atomic_load(&subscriber->replayed))
+            continue;
+
+        send_frame(conn, delivery->frame);
+    }
+}
+
+/* Never blocks on SUBs or other publishes. Large topics are split across the
+ * fan-out pool, either way every subscriber has the frame queued before this
+ * returns, so a publisher's messages reach each subscriber in order */
+static void deliver_msg(struct shard *shard, struct topic *topic, struct msgbuf *frame)
+{
+    struct delivery delivery = {shard, NULL, frame};
+
+    epoch_enter();
+
+    delivery.snapshot = atomic_load_explicit(&topic->subs, memory_order_acquire);
+
+    if (fanout_pool && fanout_threshold && delivery.snapshot->count >= fanout_threshold)
+        fanout_run(fanout_pool, deliver_range, &delivery, delivery.snapshot->count);
+    else
+        deliver_range(&delivery, 0, delivery.snapshot->count);
+
+    epoch_exit();
+}
+
+/* Hands a publish to every other shard so each delivers to its own clients */
+static void post_to_shards(struct shard *sender, struct topic *topic, struct msgbuf *frame)
+{
+    struct shard_msg *shard_msg;
+    uint64_t one = 1;
+    size_t i;
+
+    for (i = 0; i < num_shards; i++)
+    {
+        if (&shards[i] == sender)
+            continue;
+
+        shard_msg = malloc(sizeof(*shard_msg));
+        if (!shard_msg)
+        {
+            perror("malloc");
+            continue;
+        }
+
+        shard_msg->topic = topic;
+        shard_msg->frame = msgbuf_get(frame);
+
+        pthread_mutex_lock(&shards[i].inbox_lock);
+        list_add_tail(&shards[i].inbox, &shard_msg->entry);
+        pthread_mutex_unlock(&shards[i].inbox_lock);
+
+        if (write(shards[i].inbox_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("write");
+    }
+}
+
+void drain_shard_inbox(struct shard *shard)
+{
+    struct list pending = LIST_INIT(pending);
+    struct shard_msg *shard_msg;
+    struct list *cur, *next;
+    uint64_t count;
+
+    if (read(shard->inbox_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        perror("read");
+
+    pthread_mutex_lock(&shard->inbox_lock);
+    list_move_append(&pending, &shard->inbox);
+    pthread_mutex_unlock(&shard->inbox_lock);
+
+    for (cur = pending.next; cur != &pending; cur = next)
+    {
+        next = cur->next;
+        shard_msg = LIST_ENTRY(cur, struct shard_msg, entry);
+
+        deliver_msg(shard, shard_msg->topic, shard_msg->frame);
+
+        msgbuf_put(shard_msg->frame);
+        free(shard_msg);
+    }
+}
+
+/* Must lock offline_lock. What a client would be replayed if it came back */
+static size_t get_backlog(struct offline_client *client)
+{
+    size_t i, bytes = 0;
+
+    for (i = 0; i < num_topics; i++)
+    {
+        if (is_offline_client_subscribed(client, topic_list[i]))
+            bytes += msglog_bytes_since(&topic_list[i]->log, client->cursors[i]);
+    }
+
+    return bytes;
+}
+
+/* Must lock offline_lock. The topic with the oldest message gives up messages
+ * until it no longer has the oldest */
+static void evict_oldest(size_t target)
+{
+    struct topic *oldest;
+    uint64_t stamp, first, second;
+    size_t i;
+
+    while (atomic_load(&retained_bytes) > target)
+    {
+        oldest = NULL;
+        first = second = UINT64_MAX;
+        for (i = 0; i < num_topics; i++)
+        {
+            stamp = msglog_oldest_stamp(&topic_list[i]->log);
+            if (stamp < first)
+            {
+                second = first;
+                first = stamp;
+                oldest = topic_list[i];
+            }
+            else if (stamp < second)
+            {
+                second = stamp;
+            }
+        }
+
+        if (!oldest)
+            break;
+        msglog_evict(&oldest->log, atomic_load(&retained_bytes) - target, second);
+    }
+}
+
+/* Must lock offline_lock */
+static void evict_sessions(size_t target)
+{
+    struct offline_client *client, *largest;
+    size_t iter, backlog, max;
+
+    while (atomic_load(&retained_bytes) > target)
+    {
+        largest = NULL;
+        max = 0;
+        iter = 0;
+        while ((client = hash_next(offline_clients, &iter)))
+        {
+            backlog = get_backlog(client);
+            if (backlog > max)
+            {
+                max = backlog;
+                largest = client;
+            }
+        }
+
+        if (!largest)
+            break;
+        drop_offline_client(largest);
+        trim_topic_logs();
+        evicted.sessions++;
+    }
+}
+
+/* Must lock offline_lock */
+static void stop_topics(size_t target)
+{
+    struct topic *largest;
+    size_t i, bytes, max;
+
+    while (atomic_load(&retained_bytes) > target)
+    {
+        largest = NULL;
+        max = 0;
+        for (i = 0; i < num_topics; i++)
+        {
+            bytes = msglog_bytes(&topic_list[i]->log);
+            if (bytes > max)
+            {
+                max = bytes;
+                largest = topic_list[i];
+            }
+        }
+
+        if (!largest)
+            break;
+        atomic_store(&largest->retaining, 0);
+        msglog_trim(&largest->log, UINT64_MAX);
+        evicted.topics++;
+    }
+}
+
+static size_t count_retained(void)
+{
+    size_t i, count = 0;
+
+    for (i = 0; i < num_topics; i++)
+        count += msglog_count(&topic_list[i]->log);
+
+    return count;
+}
+
+/* Brings the messages kept for offline clients back under the budget, with
+ * room to spare so this does not run on every publish */
+static void enforce_budget(void)
+{
+    size_t target = retain_budget - retain_budget / 8;
+    size_t bytes, count;
+
+    pthread_mutex_lock(&offline_lock);
+
+    /* Another publisher may have got here first */
+    bytes = atomic_load(&retained_bytes);
+    if (bytes <= retain_budget)
+    {
+        pthread_mutex_unlock(&offline_lock);
+        return;
+    }
+    count = count_retained();
+
+    if (retain_policy == RETAIN_DROP_SESSION)
+        evict_sessions(target);
+    else if (retain_policy == RETAIN_STOP_TOPIC)
+        stop_topics(target);
+    else
+        evict_oldest(target);
+
+    /* Store segments follow the logs. Publishes that raced with this count
+     * against what was evicted, so the totals may fall slightly short */
+    trim_topic_logs();
+    if (count > count_retained())
+        evicted.messages += count - count_retained();
+    if (bytes > atomic_load(&retained_bytes))
+        evicted.bytes += bytes - atomic_load(&retained_bytes);
+
+    fprintf(stderr, "Retention budget exceeded, evicted %zu messages (%zu bytes) and %zu sessions, stopped %zu topics\n",
+            evicted.messages, evicted.bytes, evicted.sessions, evicted.topics);
+
+    pthread_mutex_unlock(&offline_lock);
+}
+
+/* The payload may hold anything, MQTT clients send binary data. It goes into
+ * the text frame as it is, and one that breaks the frame is only sent on in
+ * other encodings */
+static void publish_msg(struct shard *shard, struct topic *topic, const char *name, size_t name_len,
+                        const char *payload, size_t payload_len)
+{
+    static const char VERB[] = ", PUB, ";
+    struct msgbuf *frame;
+    size_t len;
+
+    /* Text subscribers could not read it back, so it is dropped, not cut short */
+    len = 1 + name_len + sizeof(VERB) - 1 + topic->name->len - 1 + 2 + payload_len + 1;
+    if (payload_len > MAX_PAYLOAD_SIZE || len > MAX_FRAME_SIZE)
+    {
+        fprintf(stderr, "Publish of %zu bytes is too large, dropping\n", payload_len);
+        return;
+    }
+
+    /* Encoded once, every subscriber and the offline queue share this copy */
+    frame = msgbuf_alloc(len);
+    if (!frame)
+        return;
+
+    len = 0;
+    frame->data[len++] = '<';
+    memcpy(frame->data + len, name, name_len);
+    len += name_len;
+    memcpy(frame->data + len, VERB, sizeof(VERB) - 1);
+    len += sizeof(VERB) - 1;
+    memcpy(frame->data + len, topic->name->str, topic->name->len - 1);
+    len += topic->name->len - 1;
+    frame->data[len++] = ',';
+    frame->data[len++] = ' ';
+    memcpy(frame->data + len, payload, payload_len);
+    len += payload_len;
+    frame->data[len++] = '>';
+
+    frame->len = len;
+    frame->stamp = get_time_ms();
+    frame->binary = !frame_can_carry(payload, payload_len);
+
+    /* Logged before it goes out live, so a client reconnecting in between
+     * gets it from one or the other */
+    if (atomic_load(&topic->num_offline) && atomic_load_explicit(&topic->retaining, memory_order_relaxed))
+    {
+        msglog_append(&topic->log, frame);
+        if (retain_budget && atomic_load(&retained_bytes) > retain_budget)
+            enforce_budget();
+    }
+
+    deliver_msg(shard, topic, frame);
+
+    if (num_shards > 1)
+        post_to_shards(shard, topic, frame);
+
+    msgbuf_put(frame);
+
+    return;
+}
+
+static void unlock_shards(void)
+{
+    size_t i = num_shards;
+
+    while (i--)
+        pthread_mutex_unlock(&shards[i].online_lock);
+}
+
+/* Goes out before anything replayed to the client. A text client switching
+ * to the compact framing is sent everything after the ack in it */
+static void ack_connect(struct connection *conn, int session_present, int compact)
+{
+    static char *CONN_ACK = "<CONN_ACK>";
+    static char *COMPACT_ACK = "<CONN_ACK, COMPACT>";
+    unsigned char connack[MQTT_CONNACK_SIZE];
+
+    if (conn->protocol == PROTOCOL_MQTT)
+    {
+        mqtt_encode_connack(connack, session_present, MQTT_CONNACK_ACCEPTED);
+        reply_conn(conn, (char *)connack, sizeof(connack));
+        return;
+    }
+
+    if (compact)
+    {
+        reply_conn(conn, COMPACT_ACK, strlen(COMPACT_ACK));
+        conn->protocol = PROTOCOL_COMPACT;
+        return;
+    }
+
+    reply_text(conn, CONN_ACK, strlen(CONN_ACK));
+}
+
+/* Gives conn the name and resumes the session kept under it. Takes over the
+ * reference to name. Returns -1 if another connection holds the name */
+static int connect_client(struct connection *conn, struct interned *name, int compact)
+{
+    struct offline_client *offline_client;
+    struct connection *found;
+    struct list *cur;
+    size_t i;
+
+    /* Names are unique across shards, so every slice is checked. Shards are
+     * always locked in index order */
+    for (i = 0; i < num_shards; i++)
+        pthread_mutex_lock(&shards[i].online_lock);
+
+    for (i = 0, found = NULL; i < num_shards && !found; i++)
+        found = get_client_by_name(&shards[i], name);
+
+    if (found)
+    {
+        /* Only ACK if this is already connected */
+        if (found == conn)
+            ack_connect(conn, 0, 0);
+
+        unlock_shards();
+        intern_put(name);
+        return found == conn ? 0 : -1;
+    }
+
+    /* Already connected, remove from list and add offline entry */
+    if (conn->name)
+    {
+        add_offline_client(conn);
+        remove_online_client(conn);
+        intern_put(conn->name);
+        conn->name = NULL;
+    }
+
+    if (insert_by_name(conn->shard->online_clients, name, conn))
+    {
+        unlock_shards();
+        intern_put(name);
+        return -1;
+    }
+    conn->name = name;
+
+    unlock_shards();
+
+    /* Subscribed before connecting, kept from now on unless asked not to */
+    for (cur = conn->subbed_topics.next; cur != &conn->subbed_topics; cur = cur->next)
+        atomic_store(&LIST_ENTRY(cur, struct subscription, entry)->subscriber->kept, !conn->clean_session);
+
+    pthread_mutex_lock(&offline_lock);
+
+    /* The session's topics join the connection's before anything is moved
+     * over, one that cannot be tracked is dropped rather than resumed half way */
+    offline_client = get_offline_client_by_name(conn->name);
+    if (offline_client && (conn->clean_session || bitset_union(&conn->topic_ids, &offline_client->topic_ids)))
+    {
+        if (!conn->clean_session)
+            fprintf(stderr, "Unable to resume the session of %s, dropping it\n", conn->name->str);
+        drop_offline_client(offline_client);
+        trim_topic_logs();
+        offline_client = NULL;
+    }
+
+    ack_connect(conn, offline_client != NULL, compact);
+
+    if (offline_client)
+        reconnect_offline_client(offline_client, conn);
+
+    pthread_mutex_unlock(&offline_lock);
+
+    return 0;
+}
+
+static void connect_as(struct connection *conn, const char *name_str, char **cmd_toks, size_t num_toks)
+{
+    struct interned *name;
+    int compact;
+
+    /* Only switched before anything can be sent to the connection, so no
+     * publisher is left queueing text to it */
+    compact = num_toks > 2 && !strcmp(cmd_toks[2], "COMPACT") && conn->protocol == PROTOCOL_TEXT && !conn->name
+              && list_empty(&conn->subbed_topics);
+
+    name = intern(name_str);
+    if (!name)
+        return;
+
+    connect_client(conn, name, compact);
+}
+
+static void connect_command(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks)
+{
+    if (num_toks < 2)
+        return; /* Specification does not demand we respond */
+
+    connect_as(conn, cmd_toks[0], cmd_toks, num_toks);
+}
+
+/* RECONNECT's argument order is reversed for some reason. Told apart from a
+ * CONN by the verb, a client may be called RECONNECT */
+static void reconnect_command(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks)
+{
+    if (num_toks < 2)
+        return;
+
+    connect_as(conn, cmd_toks[1], cmd_toks, num_toks);
+}
+
+static void publish_command(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks)
+{
+    static char *NOT_FOUND = "<ERROR: Subject Not Found>";
+    static char *NOT_SUBBED = "<ERROR: Not Subscribed>";
+    struct interned *name;
+    struct topic *topic;
+    int subscribed;
+
+    if (num_toks < 4)
+        return; /* Specification does not demand we respond */
+
+    topic = get_topic(cmd_toks[2]);
+    if (!topic)
+    {
+        reply_text(conn, NOT_FOUND, strlen(NOT_FOUND));
+        return;
+    }
+
+    /* A name nobody holds cannot be subscribed to anything */
+    name = find_name(conn, cmd_toks[0]);
+    if (!name)
+    {
+        reply_text(conn, NOT_SUBBED, strlen(NOT_SUBBED));
+        return;
+    }
+
+    epoch_enter();
+    subscribed = is_subscribed(atomic_load_explicit(&topic->subs, memory_order_acquire), name);
+    epoch_exit();
+    intern_put(name);
+
+    if (!subscribed)
+    {
+        reply_text(conn, NOT_SUBBED, strlen(NOT_SUBBED));
+        return;
+    }
+
+    publish_msg(conn->shard, topic, cmd_toks[0], lens[0], cmd_toks[3], lens[3]);
+
+    return;
+}
+
+/* Takes over the reference to name */
+static int subscribe_client(struct connection *conn, struct interned *name, struct topic *topic)
+{
+    struct subscription *topic_sub;
+
+    if (add_subscription(topic, name, conn, &topic_sub))
+        return -1;
+
+    /* Already subscribed if NULL, which is just ACKed */
+    if (!topic_sub)
+        return 0;
+
+    /* Without its bit the topic would not count the client once offline */
+    if (bitset_set(&conn->topic_ids, topic->id))
+    {
+        remove_subscription(topic_sub);
         free(topic_sub);
-        pthread_mutex_unlock(&topic->subs_lock);
+        return -1;
+    }
+    list_add_tail(&conn->subbed_topics, &topic_sub->entry);
+
+    return 0;
+}
+
+static void subscribe_command(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks)
+{
+    static char *NOT_FOUND = "<ERROR: Subscription Failed - Subject Not Found>";
+    static char *FAILED = "<ERROR: Subscription Failed>";
+    static char *SUB_ACK = "<SUB_ACK>";
+    struct interned *name;
+    struct topic *topic;
+
+    if (num_toks < 3)
+        return; /* Specification does not demand we respond */
+
+    topic = get_topic(cmd_toks[2]);
+    if (!topic)
+    {
+        reply_text(conn, NOT_FOUND, strlen(NOT_FOUND));
+        return;
+    }
+
+    name = find_name(conn, cmd_toks[0]);
+    if (!name)
+        name = intern(cmd_toks[0]);
+    if (!name)
+        return;
+
+    if (subscribe_client(conn, name, topic))
+    {
+        reply_text(conn, FAILED, strlen(FAILED));
+        return;
+    }
+
+    reply_text(conn, SUB_ACK, strlen(SUB_ACK));
+
+    return;
+}
+
+/* The session is kept once the connection has closed */
+static void disconnect_client(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->shard->online_lock);
+
+    remove_online_client(conn);
+    conn->closing = 1;
+
+    pthread_mutex_unlock(&conn->shard->online_lock);
+}
+
+static void disconnect_command(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks)
+{
+    static char *DISC_ACK = "<DISC_ACK>";
+
+    disconnect_client(conn);
+
+    /* Result doesn't matter, we are closing this */
+    reply_text(conn, DISC_ACK, strlen(DISC_ACK));
+
+    return;
+}
+
+/* Replies with how many of each command every shard has handled */
+static void stats_command(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks)
+{
+    char reply[64 * NUM_VERBS];
+    size_t i, j, count;
+    int len;
+
+    len = snprintf(reply, sizeof(reply), "<STATS");
+    for (i = 0; i < NUM_VERBS; i++)
+    {
+        for (j = 0, count = 0; j < num_shards; j++)
+            count += atomic_load_explicit(&shards[j].verb_counts[i], memory_order_relaxed);
+        len += snprintf(reply + len, sizeof(reply) - len, ", %s %zu", verb_info[i].name, count);
+    }
+    len += snprintf(reply + len, sizeof(reply) - len, ">");
+
+    reply_text(conn, reply, len);
+}
+
+static void count_verb(struct connection *conn, enum verb verb)
+{
+    atomic_fetch_add_explicit(&conn->shard->verb_counts[verb], 1, memory_order_relaxed);
+}
+
+typedef void (*command_handler)(struct connection *conn, char **cmd_toks, size_t *lens, size_t num_toks);
+
+static const command_handler COMMAND_HANDLERS[NUM_VERBS] = {
+    [VERB_CONN] = connect_command,
+    [VERB_SUB] = subscribe_command,
+    [VERB_PUB] = publish_command,
+    [VERB_DISC] = disconnect_command,
+    [VERB_RECONNECT] = reconnect_command,
+    [VERB_STATS] = stats_command,
+};
+
+static void run_command(struct connection *conn, char **toks, size_t *lens, size_t num_toks)
+{
+    enum verb verb;
+
+    /* A verb after a client name wins, as names may be verbs too: <STATS,
+     * PUB, t, x> is a publish by STATS, not a STATS request */
+    verb = num_toks > 1 ? verb_lookup(toks[1], lens[1]) : VERB_NONE;
+    if (verb == VERB_NONE || verb_info[verb].leading)
+    {
+        verb = verb_lookup(toks[0], lens[0]);
+        if (verb == VERB_NONE || !verb_info[verb].leading)
+            return;
+    }
+
+    count_verb(conn, verb);
+    COMMAND_HANDLERS[verb](conn, toks, lens, num_toks);
+}
+
+/* Names end up in text frames, so they have to be valid there */
+static int valid_name(const char *name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (name[i] < ' ' || name[i] > '~' || name[i] == ',' || name[i] == '<' || name[i] == '>')
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Tokens are split in place, the frame is not used again once handled */
+static int dispatch_frame(void *ctx, char *frame, size_t len)
+{
+    struct connection *conn = (struct connection *)ctx;
+    char *toks[MAX_FRAME_TOKENS];
+    size_t lens[MAX_FRAME_TOKENS], num_toks;
+
+    num_toks = frame_split(frame, len, toks, lens, MAX_FRAME_TOKENS);
+    if (num_toks)
+        run_command(conn, toks, lens, num_toks);
+    else
+        fprintf(stderr, "Unable to parse command, dropping\n");
+
+    /* Anything pipelined after a DISC is dropped, the rest of the read after
+     * a switch to the compact framing is fed to it */
+    return conn->closing || conn->protocol != PROTOCOL_TEXT;
+}
+
+/* Fields are used in place like text tokens. Only the payload of a PUB is
+ * left as it came, everything else is still held to what text can carry */
+static int dispatch_compact(void *ctx, char *frame, size_t len)
+{
+    struct connection *conn = (struct connection *)ctx;
+    char *toks[MAX_FRAME_TOKENS];
+    size_t lens[MAX_FRAME_TOKENS], num_toks, i;
+
+    num_toks = compact_split(frame, len, toks, lens, MAX_FRAME_TOKENS);
+    for (i = 0; i < num_toks; i++)
+    {
+        if (i != 3 && (!lens[i] || !valid_name(toks[i], lens[i])))
+            num_toks = 0;
+    }
+
+    if (num_toks)
+        run_command(conn, toks, lens, num_toks);
+    else
+        fprintf(stderr, "Unable to parse command, dropping\n");
+
+    return conn->closing;
+}
+
+static void mqtt_connect(struct connection *conn, struct mqtt_packet *packet)
+{
+    unsigned char connack[MQTT_CONNACK_SIZE];
+    char id[MQTT_MAX_CONTROL_SIZE + 1];
+    struct mqtt_connect connect;
+    struct interned *name;
+    int code;
+
+    /* A second CONNECT is a protocol violation */
+    if (conn->name)
+    {
+        conn->closing = 1;
+        return;
+    }
+
+    code = mqtt_parse_connect(packet, &connect);
+    if (code < 0)
+    {
+        conn->closing = 1;
+        return;
+    }
+
+    if (code == MQTT_CONNACK_ACCEPTED && !valid_name(connect.client_id, connect.client_id_len))
+        code = MQTT_CONNACK_ID_REJECTED;
+
+    if (code == MQTT_CONNACK_ACCEPTED)
+    {
+        memcpy(id, connect.client_id, connect.client_id_len);
+        id[connect.client_id_len] = '\0';
+        conn->clean_session = connect.clean_session;
+
+        /* Names are not taken over from whoever holds them */
+        name = intern(id);
+        if (name && !connect_client(conn, name, 0))
+            return;
+        code = MQTT_CONNACK_ID_REJECTED;
+    }
+
+    mqtt_encode_connack(connack, 0, code);
+    reply_conn(conn, (char *)connack, sizeof(connack));
+    conn->closing = 1;
+}
+
+static void mqtt_subscribe(struct connection *conn, struct mqtt_packet *packet)
+{
+    unsigned char codes[MQTT_MAX_CONTROL_SIZE], suback[MQTT_MAX_HEADER_SIZE + 2 + MQTT_MAX_CONTROL_SIZE];
+    struct mqtt_subscribe subscribe;
+    struct topic *topic;
+    const char *filter;
+    size_t len, count = 0;
+    unsigned int qos;
+
+    if (mqtt_parse_subscribe(packet, &subscribe))
+    {
+        conn->closing = 1;
+        return;
+    }
+
+    /* Every filter is granted QoS 0. Wildcards match no topic and fail */
+    while (mqtt_next_filter(&subscribe, &filter, &len, &qos))
+    {
+        topic = find_topic(filter, len);
+        if (topic && !subscribe_client(conn, intern_get(conn->name), topic))
+            codes[count++] = 0;
+        else
+            codes[count++] = MQTT_SUBACK_FAILURE;
+    }
+
+    reply_conn(conn, (char *)suback, mqtt_encode_suback(suback, subscribe.packet_id, codes, count));
+}
+
+static void mqtt_publish(struct connection *conn, struct mqtt_packet *packet)
+{
+    struct mqtt_publish publish;
+    struct topic *topic;
+
+    /* Nothing is acknowledged, so only QoS 0 is taken */
+    if (mqtt_parse_publish(packet, &publish) || publish.qos)
+    {
+        conn->closing = 1;
+        return;
+    }
+
+    /* Unlike PUB this needs no subscription, MQTT publishers rarely have one.
+     * QoS 0 has no way to report an unknown topic */
+    topic = find_topic(publish.topic, publish.topic_len);
+    if (topic)
+        publish_msg(conn->shard, topic, conn->name->str, conn->name->len - 1, publish.payload, publish.payload_len);
+}
+
+static int dispatch_packet(void *ctx, struct mqtt_packet *packet)
+{
+    struct connection *conn = (struct connection *)ctx;
+    unsigned char pingresp[MQTT_PINGRESP_SIZE];
+
+    /* Nothing but CONNECT until the client has a name */
+    if (!conn->name && packet->type != MQTT_CONNECT)
+    {
+        conn->closing = 1;
+        return 1;
+    }
+
+    switch (packet->type)
+    {
+    case MQTT_CONNECT:
+        count_verb(conn, VERB_CONN);
+        mqtt_connect(conn, packet);
+        break;
+    case MQTT_SUBSCRIBE:
+        count_verb(conn, VERB_SUB);
+        mqtt_subscribe(conn, packet);
+        break;
+    case MQTT_PUBLISH:
+        count_verb(conn, VERB_PUB);
+        mqtt_publish(conn, packet);
+        break;
+    case MQTT_PINGREQ:
+        mqtt_encode_pingresp(pingresp);
+        reply_conn(conn, (char *)pingresp, sizeof(pingresp));
+        break;
+    case MQTT_DISCONNECT:
+        count_verb(conn, VERB_DISC);
+        disconnect_client(conn);
+        break;
+    default:
+        /* Including UNSUBSCRIBE and the acknowledgements of higher QoS */
+        conn->closing = 1;
+        break;
+    }
+
+    return conn->closing;
+}
+
+/* The backend reads EOF and closes the connection as if the peer had left */
+static void reap_idle_conn(struct timer *timer, void *ctx)
+{
+    struct connection *conn = ctx;
+
+    shutdown(conn->sock, SHUT_RD);
+}
+
+void conn_active(struct connection *conn)
+{
+    struct timer_wheel *wheel;
+
+    if (!idle_timeout || !conn->reactor)
+        return;
+
+    /* The clock is only kept up to date while something is pending */
+    wheel = &conn->reactor->idle_timers;
+    if (!wheel->count)
+        timer_advance(wheel, get_time_ms());
+    timer_add(wheel, &conn->idle_timer, wheel->now + idle_timeout);
+}
+
+void handle_data(struct connection *conn, char *data, size_t len)
+{
+    size_t used;
+
+    conn_active(conn);
+
+    switch (conn->protocol)
+    {
+    case PROTOCOL_TEXT:
+        used = frame_feed(&conn->frame, data, len, dispatch_frame, conn);
+        if (conn->closing || conn->protocol == PROTOCOL_TEXT)
+            break;
+        /* Switched to the compact framing part way through the read */
+        data += used;
+        len -= used;
+        /* fall through */
+    case PROTOCOL_COMPACT:
+        if (compact_feed(&conn->frame, data, len, dispatch_compact, conn))
+            conn->closing = 1;
+        break;
+    case PROTOCOL_MQTT:
+        if (mqtt_feed(&conn->frame, data, len, dispatch_packet, conn))
+            conn->closing = 1;
+        break;
+    }
+}
+
+static void *handle_connection(void *data)
+{
+    struct connection *conn = (struct connection *)data;
+    struct pollfd fds[2];
+    char buf[READ_BUF_SIZE];
+    uint64_t count, last_active = get_time_ms(), now;
+    int timeout = -1;
+    ssize_t len;
+
+    /* Other threads queue output and wake us through wake_fd */
+    fds[0].fd = conn->sock;
+    fds[1].fd = conn->wake_fd;
+    fds[1].events = POLLIN;
+
+    while (!conn->closing)
+    {
+        fds[0].events = POLLIN;
+        if (outq_bytes(&conn->outq))
+            fds[0].events |= POLLOUT;
+
+        /* One thread per connection, a deadline is simpler than a wheel */
+        if (idle_timeout)
+        {
+            now = get_time_ms();
+            if (now - last_active >= idle_timeout)
+                break;
+            timeout = last_active + idle_timeout - now;
+        }
+
+        if (poll(fds, 2, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("poll");
+            conn->closing = 1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            if (read(conn->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                perror("read");
+            atomic_store(&conn->flush_pending, 0);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            len = recv(conn->sock, buf, sizeof(buf), 0);
+            if (len == -1 && (errno == ENOTCONN || errno == ECONNRESET))
+            {
+                perror("recv");
+                conn->closing = 1;
+            }
+            else if (len > 0)
+            {
+                last_active = get_time_ms();
+                handle_data(conn, buf, len);
+            }
+            else
+            {
+                conn->closing = 1;
+            }
+        }
+
+        if ((fds[1].revents & POLLIN) || (fds[0].revents & POLLOUT))
+            write_conn(conn);
+    }
+
+    close_connection(conn);
+
+    return NULL;
+}
+
+/* Must lock offline_lock, which the timer thread holds */
+static void expire_messages(struct timer *timer, void *ctx)
+{
+    struct topic *topic = ctx;
+    uint64_t oldest;
+
+    /* The monotonic clock starts at boot, the TTL may be longer than that */
+    if (timers.now > message_ttl && msglog_expire(&topic->log, timers.now - message_ttl))
+        logs_expired = 1;
+
+    /* Comes back when the next oldest is due, or a TTL from now if there is
+     * none, which is never too late for a message published in between */
+    oldest = msglog_oldest_stamp(&topic->log);
+    timer_add(&timers, timer, oldest == UINT64_MAX ? timers.now + message_ttl : oldest + message_ttl);
+}
+
+static void init_topics()
+{
+    struct topic *topic;
+    size_t i;
+
+    num_topics = sizeof(DEFAULT_TOPIC_NAMES) / sizeof(*DEFAULT_TOPIC_NAMES);
+
+    topics = hash_init(8);
+    if (!topics)
+        exit(EXIT_FAILURE);
+
+    topic_list = malloc(num_topics * sizeof(*topic_list));
+    if (!topic_list)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_topics; i++)
+    {
+        topic = malloc(sizeof(*topic));
+        if (!topic)
+        {
+            perror("malloc");
+            free(topics);
+            exit(EXIT_FAILURE);
+        }
+
+        topic->id = i;
+        topic->name = intern(DEFAULT_TOPIC_NAMES[i]);
+        if (!topic->name)
+        {
+            free(topics);
+            free(topic);
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_init(&topic->subs_lock, NULL);
+        msglog_init(&topic->log);
+        timer_init(&topic->expiry, expire_messages, topic);
+        topic->log.usage = &retained_bytes;
+        atomic_init(&topic->retaining, 1);
+        atomic_init(&topic->num_offline, 0);
+        topic->subs = build_snapshot(NULL, NULL, 0, NULL);
+        if (!topic->subs)
+        {
+            intern_put(topic->name);
+            free(topic);
+            free(topics);
+            exit(EXIT_FAILURE);
+        }
+
+        if (hash_insert_hashed(topics, topic->name->str, topic->name->len, topic->name->hash, topic))
+            exit(EXIT_FAILURE);
+        topic_list[i] = topic;
+    }
+}
+
+/* For clients rebuilt at startup. Takes over the reference to name */
+static struct offline_client *alloc_offline_client(struct interned *name)
+{
+    struct offline_client *client;
+
+    client = calloc(sizeof(*client), 1);
+    if (!client)
+    {
+        perror("calloc");
+        intern_put(name);
+        return NULL;
+    }
+
+    client->cursors = calloc(num_topics, sizeof(*client->cursors));
+    if (!client->cursors)
+    {
+        perror("calloc");
+        intern_put(name);
+        free(client);
+        return NULL;
+    }
+
+    client->name = name;
+    list_init(&client->subs);
+    bitset_init(&client->topic_ids);
+    timer_init(&client->expiry, expire_offline_client, client);
+
+    return client;
+}
+
+static void recover_publish(struct store_record *record, void *data)
+{
+    struct msgbuf *frame;
+    const char *toks[4];
+    size_t lens[4];
+
+    if (record->stream >= num_topics)
+        return;
+
+    frame = msgbuf_alloc(record->len + 1);
+    if (!frame)
+        return;
+
+    memcpy(frame->data, data, record->len);
+    frame->data[record->len] = '\0';
+    frame->len = record->len;
+    frame->stamp = get_time_ms(); /* The TTL starts over */
+
+    if (split_publish(frame, toks, lens))
+    {
+        fprintf(stderr, "Stored message %llu on %s is not a whole publish, dropping it\n",
+                (unsigned long long)record->seq, topic_list[record->stream]->name->str);
+        msgbuf_put(frame);
         return;
     }
+    frame->binary = !frame_can_carry(toks[3], lens[3]);
 
-    hash_insert(topic->subs, subscriber->client_name, strlen(subscriber->client_name) + 1, &subscriber->entry);
+    msglog_restore(&topic_list[record->stream]->log, record->seq, frame);
+    msgbuf_put(frame);
+}
 
-    pthread_mutex_unlock(&topic->subs_lock);
+/* Returns a reference to the name a record ends with, or NULL if it is not one */
+static struct interned *recover_name(char *data, size_t len)
+{
+    if (!len || memchr(data, '\0', len) != data + len - 1)
+        return NULL;
 
-    list_add_tail(&conn->subbed_topics, &topic_sub->entry);
+    return intern(data);
+}
+
+static void recover_offline_client(uint64_t segment, struct store_record *record, void *data)
+{
+    struct stored_session *session = data;
+    struct offline_client *client, *old;
+    struct subscription *sub;
+    struct interned *name;
+    size_t i, size;
+
+    if (record->len < sizeof(*session))
+        return;
+    size = sizeof(*session) + (size_t)session->num_subs * sizeof(*session->subs);
+    if (size > record->len || record->len - size != session->name_len)
+        return;
+
+    name = recover_name((char *)data + size, session->name_len);
+    if (!name)
+        return;
+
+    /* Only the latest session of a client counts */
+    old = lookup_by_name(offline_clients, name);
+    if (old)
+        drop_offline_client(old);
+
+    client = alloc_offline_client(name);
+    if (!client)
+        return;
+
+    client->segment = segment;
+    client->stored = 1;
+
+    for (i = 0; i < session->num_subs; i++)
+    {
+        if (session->subs[i].topic >= num_topics
+            || add_subscription(topic_list[session->subs[i].topic], intern_get(name), NULL, &sub) || !sub)
+            continue;
+
+        if (bitset_set(&client->topic_ids, session->subs[i].topic))
+        {
+            remove_subscription(sub);
+            free(sub);
+            continue;
+        }
+        list_add_tail(&client->subs, &sub->entry);
+        client->cursors[session->subs[i].topic] = session->subs[i].cursor;
+    }
+
+    if (insert_by_name(offline_clients, name, client))
+    {
+        remove_subscriptions(&client->subs);
+        bitset_free(&client->topic_ids);
+        intern_put(name);
+        free(client->cursors);
+        free(client);
+        return;
+    }
+    count_offline_subs(client, 1);
+}
+
+static void recover_online_client(struct store_record *record, void *data)
+{
+    struct offline_client *client;
+    struct interned *name;
+
+    name = recover_name(data, record->len);
+    if (!name)
+        return;
+
+    client = lookup_by_name(offline_clients, name);
+    if (client)
+        drop_offline_client(client);
+
+    intern_put(name);
+}
+
+static void recover_record(void *ctx, uint64_t segment, struct store_record *record, void *data)
+{
+    switch (record->type)
+    {
+    case RECORD_PUBLISH:
+        recover_publish(record, data);
+        break;
+    case RECORD_OFFLINE:
+        recover_offline_client(segment, record, data);
+        break;
+    case RECORD_ONLINE:
+        recover_online_client(record, data);
+        break;
+    }
+}
+
+/* Opens the store and rebuilds the offline clients and the topic logs from it */
+static void init_store(struct server_config *config)
+{
+    struct offline_client *client;
+    size_t iter = 0, i;
+
+    store = store_open(config->store_dir, STORE_DEFAULT_SEGMENT_SIZE, config->commit_ms, num_topics,
+                       recover_record, NULL);
+    if (!store)
+        exit(EXIT_FAILURE);
+
+    /* Logs carry on from the newest cursor even if nothing after it was kept */
+    while ((client = hash_next(offline_clients, &iter)))
+    {
+        store_pin(store, client->segment);
+        for (i = 0; i < num_topics; i++)
+        {
+            if (is_offline_client_subscribed(client, topic_list[i]))
+                msglog_seek(&topic_list[i]->log, client->cursors[i]);
+        }
+    }
+
+    for (i = 0; i < num_topics; i++)
+    {
+        topic_list[i]->log.on_append_ctx = topic_list[i];
+        topic_list[i]->log.on_append = store_publish;
+    }
+
+    pthread_mutex_lock(&offline_lock);
+    trim_topic_logs();
+    pthread_mutex_unlock(&offline_lock);
+
+    /* Segments still hold what was evicted before the restart */
+    if (retain_budget && atomic_load(&retained_bytes) > retain_budget)
+        enforce_budget();
+
+    printf("Recovered %zu offline clients from %s\n", hash_count(offline_clients), config->store_dir);
+}
+
+/* Subscriber sets are immutable, so taking them only holds back reclamation
+ * while the names are copied. Offline clients are included, they stay in the
+ * sets of the topics they subscribe to */
+static void write_snapshot(void)
+{
+    struct subscriber **kept = NULL, **tmp;
+    struct snapshot_builder builder;
+    struct sub_snapshot *subs;
+    size_t i, j, num_kept, size = 0;
+    int ret = 0;
+
+    if (snapshot_init(&builder))
+        return;
+
+    epoch_enter();
+    for (i = 0; i < num_topics && !ret; i++)
+    {
+        subs = atomic_load_explicit(&topic_list[i]->subs, memory_order_acquire);
+        if (subs->count > size)
+        {
+            tmp = realloc(kept, subs->count * sizeof(*kept));
+            if (!tmp)
+            {
+                perror("realloc");
+                ret = -1;
+                break;
+            }
+            kept = tmp;
+            size = subs->count;
+        }
+
+        for (j = 0, num_kept = 0; j < subs->count; j++)
+        {
+            /* Connections that never sent CONN or asked for no session
+             * have nothing kept once they go, so they are left out */
+            if (atomic_load_explicit(&subs->subs[j]->kept, memory_order_relaxed))
+                kept[num_kept++] = subs->subs[j];
+        }
+
+        ret = snapshot_add_topic(&builder, topic_list[i]->name->str, topic_list[i]->name->len, num_kept);
+        for (j = 0; j < num_kept && !ret; j++)
+            ret = snapshot_add_sub(&builder, kept[j]->client_name->str, kept[j]->client_name->len);
+    }
+    epoch_exit();
+
+    if (!ret)
+        snapshot_write(&builder, snapshot_path);
+
+    free(kept);
+    snapshot_free(&builder);
+}
+
+static void *snapshot_loop(void *arg)
+{
+    for (;;)
+    {
+        sleep(snapshot_interval);
+        write_snapshot();
+    }
+
+    return NULL;
+}
+
+/* Subscribers restored to a topic, added to its set in one go */
+struct restored_subs
+{
+    struct subscriber **subs;
+    size_t count;
+    size_t size;
+};
+
+/* Every client in the snapshot comes back as offline, subscribed to what it
+ * was, so reconnecting is enough to carry on. Messages published before the
+ * restart are only replayed from the store */
+static void restore_sub(void *ctx, const char *topic_name, const char *client_name)
+{
+    struct restored_subs *restored = ctx, *pending;
+    struct subscriber **subs;
+    struct offline_client *client;
+    struct subscription *sub;
+    struct interned *name;
+    struct topic *topic;
+
+    topic = get_topic((char *)topic_name);
+    if (!topic)
+        return;
+
+    name = intern(client_name);
+    if (!name)
+        return;
+
+    client = lookup_by_name(offline_clients, name);
+    if (!client)
+    {
+        client = alloc_offline_client(intern_get(name));
+        if (!client)
+        {
+            intern_put(name);
+            return;
+        }
+
+        if (insert_by_name(offline_clients, name, client))
+        {
+            intern_put(client->name);
+            free(client->cursors);
+            free(client);
+            intern_put(name);
+            return;
+        }
+    }
+    intern_put(name);
+
+    if (is_offline_client_subscribed(client, topic))
+        return;
+
+    pending = &restored[topic->id];
+    if (pending->count == pending->size)
+    {
+        pending->size = pending->size ? pending->size * 2 : 64;
+        subs = realloc(pending->subs, pending->size * sizeof(*subs));
+        if (!subs)
+        {
+            perror("realloc");
+            pending->size = pending->count;
+            return;
+        }
+        pending->subs = subs;
+    }
+
+    sub = alloc_subscription(topic, intern_get(client->name));
+    if (!sub)
+        return;
+
+    /* Not in the topic's set yet, so it can be freed right away */
+    if (bitset_set(&client->topic_ids, topic->id))
+    {
+        free_subscriber(sub->subscriber);
+        free(sub);
+        return;
+    }
+
+    pending->subs[pending->count++] = sub->subscriber;
+    list_add_tail(&client->subs, &sub->entry);
+    atomic_fetch_add(&topic->num_offline, 1);
+    client->cursors[topic->id] = msglog_tail(&topic->log);
+}
+
+static void load_snapshot(void)
+{
+    struct restored_subs *restored;
+    struct sub_snapshot *snapshot;
+    struct offline_client *client;
+    struct timespec start, end;
+    size_t iter = 0, i;
+    long count;
+
+    restored = calloc(num_topics, sizeof(*restored));
+    if (!restored)
+    {
+        perror("calloc");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    count = snapshot_load(snapshot_path, restore_sub, restored);
+    for (i = 0; i < num_topics; i++)
+    {
+        if (restored[i].count)
+        {
+            pthread_mutex_lock(&topic_list[i]->subs_lock);
+            snapshot = build_snapshot(atomic_load(&topic_list[i]->subs), restored[i].subs, restored[i].count, NULL);
+            if (snapshot)
+                replace_snapshot(topic_list[i], snapshot);
+            pthread_mutex_unlock(&topic_list[i]->subs_lock);
+        }
+        free(restored[i].subs);
+    }
+    free(restored);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (count < 0)
+        return;
 
-    reply_conn(conn, SUB_ACK, strlen(SUB_ACK));
+    /* Clients the store did not know about are stored from now on */
+    if (store)
+    {
+        pthread_mutex_lock(&offline_lock);
+        while ((client = hash_next(offline_clients, &iter)))
+        {
+            if (!client->stored)
+                store_offline_client(client);
+        }
+        pthread_mutex_unlock(&offline_lock);
+    }
 
-    return;
+    printf("Restored %ld subscriptions from %s in %.1f ms\n", count, snapshot_path,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
 }
 
-static void disconnect_command(struct connection *conn, char **cmd_toks, size_t num_toks)
+static void *timer_loop(void *arg)
 {
-    static char *DISC_ACK = "<DISC_ACK>";
-    int res;
-
-    pthread_mutex_lock(&online_lock);
-
-    list_remove(&conn->entry); /* In case of resending the CONNECT command */
-    conn->closing = 1;
+    struct timespec tick = {0, TIMER_TICK_MS * 1000000};
 
-    pthread_mutex_unlock(&online_lock);
+    for (;;)
+    {
+        nanosleep(&tick, NULL);
 
-    res = send(conn->sock, DISC_ACK, strlen(DISC_ACK), 0);
-    if (res == -1)
-        perror("send"); /* Result doesn't matter, we are closing this */
+        pthread_mutex_lock(&offline_lock);
+        timer_advance(&timers, get_time_ms());
+        if (logs_expired)
+        {
+            trim_topic_logs();
+            logs_expired = 0;
+        }
+        pthread_mutex_unlock(&offline_lock);
+    }
 
-    return;
+    return NULL;
 }
 
-static void parse_command(struct connection *conn, char *cmd, size_t len)
+/* Arms session expiry for the clients rebuilt at startup, from now, and
+ * message TTL for every topic */
+static void start_timers(void)
 {
-    static char *DELIM = ", ";
-    size_t num_toks;
-    char **toks;
-
-    if (len < 2 || cmd[0] != '<' || cmd[len - 1] != '>')
-        return; /* Requests must be surrounded by <> */
+    struct offline_client *client;
+    pthread_t timer_thread;
+    size_t iter = 0, i;
+    int thread_ret;
 
-    num_toks = split_string(cmd + 1, len - 2, DELIM, &toks);
-    if (!num_toks)
-    {
-        fprintf(stderr, "Unable to parse command, dropping\n");
+    if (!session_expiry && !message_ttl)
         return;
-    }
 
-    if (!strcmp(toks[0], "DISC"))
+    pthread_mutex_lock(&offline_lock);
+    while ((client = hash_next(offline_clients, &iter)))
+        arm_offline_client(client);
+    for (i = 0; message_ttl && i < num_topics; i++)
+        timer_add(&timers, &topic_list[i]->expiry, timers.now + message_ttl);
+    pthread_mutex_unlock(&offline_lock);
+
+    if ((thread_ret = pthread_create(&timer_thread, NULL, timer_loop, NULL)))
     {
-        disconnect_command(conn, toks, num_toks);
-        goto out;
+        fprintf(stderr, "pthread_create: %d\n", thread_ret);
+        exit(EXIT_FAILURE);
     }
+    pthread_detach(timer_thread);
+}
 
-    /* Remaining commands require at least two arguments */
-    if (num_toks < 2)
-        goto out;
+struct connection *new_connection(int sock, struct shard *shard, enum protocol protocol)
+{
+    struct connection *conn;
 
-    if (!strcmp(toks[1], "PUB"))
-        publish_command(conn, toks, num_toks);
-    else if (!strcmp(toks[1], "SUB"))
-        subscribe_command(conn, toks, num_toks);
-    else if (!strcmp(toks[1], "CONN"))
-        connect_command(conn, toks, num_toks);
-    else if (!strcmp(toks[0], "RECONNECT"))
-        connect_command(conn, toks, num_toks);
+    conn = malloc(sizeof(*conn));
+    if (!conn)
+    {
+        perror("malloc");
+        return NULL;
+    }
 
-out:
-    free(toks);
+    conn->sock = sock;
+    conn->protocol = protocol;
+    conn->clean_session = 0;
+    conn->name = NULL;
+    conn->closing = 0;
+    conn->reactor = NULL;
+    conn->shard = shard;
+    conn->io_data = NULL;
+    conn->closed = 0;
+    conn->wake_fd = -1;
+    conn->write_failed = 0;
+    timer_init(&conn->idle_timer, reap_idle_conn, conn);
+    atomic_init(&conn->refs, 1);
+    atomic_init(&conn->flush_pending, 0);
+    atomic_init(&conn->throttled, 0);
+    atomic_init(&conn->dropped, 0);
+    outq_init(&conn->outq);
+    frame_init(&conn->frame);
+    list_init(&conn->ready_entry);
+    list_init(&conn->subbed_topics);
+    bitset_init(&conn->topic_ids);
+
+    return conn;
 }
 
-static void *handle_connection(void *data)
+/* Reads until the socket would block, as required by edge triggering */
+static void read_connection(struct reactor *reactor, struct connection *conn)
 {
-    struct connection *conn = (struct connection *)data;
-    static char buf[1024];
     ssize_t len;
 
     while (!conn->closing)
     {
-        len = recv(conn->sock, buf, sizeof(buf), 0);
-        if (len == -1 && (errno == ENOTCONN || errno == ECONNRESET))
+        len = recv(conn->sock, reactor->buf, sizeof(reactor->buf), 0);
+        if (len > 0)
         {
-            perror("recv");
-            conn->closing = 1;
+            handle_data(conn, reactor->buf, len);
         }
-        else if (len > 0)
+        else if (len == -1 && errno == EINTR)
         {
-            parse_command(conn, buf, len);
+            continue;
+        }
+        else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
         }
         else
         {
+            if (len == -1)
+                perror("recv");
             conn->closing = 1;
         }
     }
+}
 
-    close_connection(conn);
+static int add_to_reactor(struct reactor *reactor, struct connection *conn)
+{
+    struct epoll_event event;
 
-    return NULL;
+    conn->reactor = reactor;
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->sock, &event) == -1)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
 }
 
-static void init_topics()
+static void accept_connections(struct reactor *reactor, int listen_sock, enum protocol protocol)
 {
-    size_t i, num_topics = sizeof(DEFAULT_TOPIC_NAMES) / sizeof(*DEFAULT_TOPIC_NAMES);
-    struct topic *topic;
-
-    topics = hash_init(8);
-    if (!topics)
-        exit(EXIT_FAILURE);
+    struct connection *conn;
+    int conn_sock;
 
-    for (i = 0; i < num_topics; i++)
+    for (;;)
     {
-        topic = malloc(sizeof(*topic));
-        if (!topic)
+        conn_sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK);
+        if (conn_sock == -1)
         {
-            perror("malloc");
-            free(topics);
-            exit(EXIT_FAILURE);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
         }
 
-        topic->name = strdup(DEFAULT_TOPIC_NAMES[i]);
-        if (!topic->name)
+        conn = new_connection(conn_sock, reactor->shard, protocol);
+        if (!conn)
         {
-            perror("strdup");
-            free(topics);
-            free(topic);
-            exit(EXIT_FAILURE);
+            close(conn_sock);
+            continue;
         }
 
-        pthread_mutex_init(&topic->subs_lock, NULL);
-        list_init(&topic->entry);
-        topic->subs = hash_init(16);
-        if (!topic->subs)
+        if (add_to_reactor(reactor, conn))
         {
-            perror("strdup");
-            free(topic->name);
-            free(topic);
-            free(topics);
+            close(conn_sock);
+            conn_put(conn);
+        }
+    }
+}
+
+static void *reactor_loop(void *data)
+{
+    struct reactor *reactor = (struct reactor *)data;
+    struct epoll_event events[MAX_EVENTS];
+    struct connection *conn;
+    int i, num_events;
+    uint64_t count;
+
+    for (;;)
+    {
+        num_events = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS,
+                                reactor->idle_timers.count ? TIMER_TICK_MS : -1);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll_wait");
             exit(EXIT_FAILURE);
         }
 
-        hash_insert(topics, topic->name, strlen(topic->name) + 1, &topic->entry);
+        for (i = 0; i < num_events; i++)
+        {
+            if (events[i].data.ptr == &reactor->listen_sock)
+            {
+                accept_connections(reactor, reactor->listen_sock, PROTOCOL_TEXT);
+                continue;
+            }
+
+            if (events[i].data.ptr == &reactor->mqtt_listen_sock)
+            {
+                accept_connections(reactor, reactor->mqtt_listen_sock, PROTOCOL_MQTT);
+                continue;
+            }
+
+            if (events[i].data.ptr == &reactor->shard->inbox_fd)
+            {
+                drain_shard_inbox(reactor->shard);
+                continue;
+            }
+
+            /* The ready list is flushed below regardless */
+            if (events[i].data.ptr == &reactor->wake_fd)
+            {
+                if (read(reactor->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                    perror("read");
+                continue;
+            }
+
+            conn = events[i].data.ptr;
+
+            /* The first event is for the connect, the clock starts there */
+            if (!timer_pending(&conn->idle_timer))
+                conn_active(conn);
+
+            if (events[i].events & EPOLLOUT)
+                write_conn(conn);
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                read_connection(reactor, conn);
+
+            if (conn->closing)
+            {
+                epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+                close_connection(conn);
+            }
+        }
+
+        /* Everything queued while handling this batch goes out together */
+        flush_ready_conns(reactor);
+
+        if (reactor->idle_timers.count)
+            timer_advance(&reactor->idle_timers, get_time_ms());
     }
+
+    return NULL;
 }
 
-void start_server(unsigned short port)
+static void init_shards(size_t count)
 {
-    int sock, conn_sock, thread_ret;
-    struct sockaddr_in addr;
-    struct connection *conn;
-    unsigned int addr_len;
-    int enable = 1;
+    size_t i;
 
-    online_clients = hash_init(16);
-    if (!online_clients)
+    shards = calloc(sizeof(*shards), count);
+    if (!shards)
     {
-        perror("hash_init");
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    num_shards = count;
 
-    offline_clients = hash_init(16);
-    if (!offline_clients)
+    for (i = 0; i < count; i++)
     {
-        perror("hash_init");
-        exit(EXIT_FAILURE);
+        shards[i].online_clients = hash_init(16);
+        if (!shards[i].online_clients)
+        {
+            perror("hash_init");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_init(&shards[i].online_lock, NULL);
+        pthread_mutex_init(&shards[i].inbox_lock, NULL);
+        list_init(&shards[i].inbox);
+
+        shards[i].inbox_fd = eventfd(0, EFD_NONBLOCK);
+        if (shards[i].inbox_fd == -1)
+        {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
     }
+}
 
-    init_topics();
+int open_listener(unsigned short port, int reuse_port)
+{
+    struct sockaddr_in addr;
+    int sock, enable = 1;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr_len = sizeof(addr);
 
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1)
@@ -732,42 +2689,322 @@ void start_server(unsigned short port)
         exit(EXIT_FAILURE);
     }
 
-    if (bind(sock, (struct sockaddr *)&addr, addr_len) == -1)
+    /* Lets every shard bind its own socket, the kernel balances between them */
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)))
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
     {
         perror("bind");
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sock, 5) == -1)
+    if (listen(sock, SOMAXCONN) == -1)
     {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    for (;;)
+    return sock;
+}
+
+void pin_thread(pthread_t thread, size_t index)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int ret;
+
+    if (num_cpus <= 0)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(index % num_cpus, &cpus);
+
+    if ((ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus)))
+        fprintf(stderr, "pthread_setaffinity_np: %d\n", ret);
+}
+
+/* The socket's address is its epoll data, as reactor_loop() tells them apart by it */
+static void add_listener(struct reactor *reactor, int *listen_sock)
+{
+    struct epoll_event event;
+
+    if (fcntl(*listen_sock, F_SETFL, O_NONBLOCK) == -1)
     {
-        conn_sock = accept(sock, (struct sockaddr *)&addr, &addr_len);
-        if (conn_sock == -1)
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = listen_sock;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, *listen_sock, &event) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* In shard mode each reactor owns a shard and its own listening socket */
+static void init_reactors(struct server_config *config)
+{
+    struct epoll_event event;
+    size_t i, count = config->num_threads;
+    int thread_ret;
+
+    reactors = calloc(sizeof(*reactors), count);
+    if (!reactors)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    num_reactors = count;
+
+    for (i = 0; i < count; i++)
+    {
+        reactors[i].epoll_fd = epoll_create1(0);
+        if (reactors[i].epoll_fd == -1)
+        {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        reactors[i].listen_sock = -1;
+        reactors[i].mqtt_listen_sock = -1;
+        reactors[i].shard = &shards[i % num_shards];
+
+        init_reactor_queue(&reactors[i]);
+
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &reactors[i].wake_fd;
+        if (epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].wake_fd, &event) == -1)
         {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+
+        if (config->mode == SERVER_MODE_SHARD)
+        {
+            reactors[i].listen_sock = open_listener(config->port, 1);
+            add_listener(&reactors[i], &reactors[i].listen_sock);
+
+            if (config->mqtt_port)
+            {
+                reactors[i].mqtt_listen_sock = open_listener(config->mqtt_port, 1);
+                add_listener(&reactors[i], &reactors[i].mqtt_listen_sock);
+            }
+
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = &reactors[i].shard->inbox_fd;
+            if (epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].shard->inbox_fd, &event) == -1)
+            {
+                perror("epoll_ctl");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if ((thread_ret = pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i])))
+        {
+            fprintf(stderr, "pthread_create: %d\n", thread_ret);
+            exit(EXIT_FAILURE);
+        }
+
+        if (config->pin_cpus)
+            pin_thread(reactors[i].thread, i);
+    }
+}
+
+/* Idle sessions are bounded by descriptors rather than threads in epoll mode */
+void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+    {
+        perror("getrlimit");
+        return;
+    }
+
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        perror("setrlimit");
+}
+
+/* Hands a connection to a reactor, or a thread of its own in thread mode */
+static void accept_client(struct server_config *config, int sock, enum protocol protocol)
+{
+    static size_t next_reactor = 0;
+    struct connection *conn;
+    int conn_sock, thread_ret;
+
+    conn_sock = accept4(sock, NULL, NULL, config->mode == SERVER_MODE_THREAD ? 0 : SOCK_NONBLOCK);
+    if (conn_sock == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
             perror("accept");
-            continue;
+        return;
+    }
+
+    conn = new_connection(conn_sock, &shards[0], protocol);
+    if (!conn)
+    {
+        close(conn_sock);
+        return;
+    }
+
+    if (config->mode == SERVER_MODE_EPOLL)
+    {
+        if (add_to_reactor(&reactors[next_reactor++ % num_reactors], conn))
+        {
+            close(conn_sock);
+            conn_put(conn);
         }
+        return;
+    }
 
-        conn = malloc(sizeof(*conn));
-        conn->sock = conn_sock;
-        conn->name = NULL;
-        conn->closing = 0;
-        list_init(&conn->entry);
-        list_init(&conn->subbed_topics);
+    conn->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (conn->wake_fd == -1)
+    {
+        perror("eventfd");
+        close(conn_sock);
+        conn_put(conn);
+        return;
+    }
+
+    if ((thread_ret = pthread_create(&conn->thread, NULL, handle_connection, conn)))
+    {
+        close(conn_sock);
+        conn_put(conn);
+        fprintf(stderr, "pthread_create: %d\n", thread_ret);
+        return;
+    }
+
+    pthread_detach(conn->thread);
+}
+
+void start_server(struct server_config *config)
+{
+    struct pollfd listeners[2];
+    size_t num_listeners = 1;
+    pthread_t snapshot_thread;
+    int thread_ret;
+    size_t i;
+
+    high_watermark = config->high_watermark;
+    low_watermark = config->low_watermark;
+
+    session_expiry = config->session_expiry;
+    message_ttl = config->message_ttl;
+    idle_timeout = config->idle_timeout;
+    retain_budget = config->retain_budget;
+    retain_policy = config->retain_policy;
+    timer_wheel_init(&timers, get_time_ms());
+
+    fanout_threshold = config->fanout_threshold;
+    if (fanout_threshold)
+    {
+        /* Delivery stays serial if the pool cannot start */
+        fanout_pool = fanout_create(config->num_threads);
+        if (!fanout_pool)
+            fprintf(stderr, "Unable to start the fan-out pool\n");
+    }
+
+    offline_clients = hash_init(16);
+    if (!offline_clients)
+    {
+        perror("hash_init");
+        exit(EXIT_FAILURE);
+    }
 
-        if ((thread_ret = pthread_create(&conn->thread, NULL, handle_connection, conn)))
+    init_topics();
+
+    if (config->store_dir)
+        init_store(config);
+
+    if (config->snapshot_path)
+    {
+        snapshot_path = config->snapshot_path;
+        snapshot_interval = config->snapshot_interval;
+        load_snapshot();
+
+        if ((thread_ret = pthread_create(&snapshot_thread, NULL, snapshot_loop, NULL)))
         {
-            free(conn);
             fprintf(stderr, "pthread_create: %d\n", thread_ret);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(snapshot_thread);
+    }
+
+    start_timers();
+
+    init_shards(config->mode == SERVER_MODE_THREAD || config->mode == SERVER_MODE_EPOLL ? 1 : config->num_threads);
+
+#ifdef HAVE_LIBURING
+    if (config->mode == SERVER_MODE_URING)
+    {
+        raise_fd_limit();
+        start_uring(config, shards, num_shards);
+
+        printf("Exiting\n");
+        return;
+    }
+#endif
+
+    if (config->mode != SERVER_MODE_THREAD)
+    {
+        raise_fd_limit();
+        init_reactors(config);
+    }
+
+    /* Shards accept on their own, there is nothing left to do here */
+    if (config->mode == SERVER_MODE_SHARD)
+    {
+        for (i = 0; i < num_reactors; i++)
+            pthread_join(reactors[i].thread, NULL);
+
+        printf("Exiting\n");
+        return;
+    }
+
+    /* Readiness is polled so one thread serves both listeners, the
+     * accepts themselves never block */
+    listeners[0].fd = open_listener(config->port, 0);
+    if (config->mqtt_port)
+    {
+        listeners[1].fd = open_listener(config->mqtt_port, 0);
+        num_listeners = 2;
+    }
+
+    for (i = 0; i < num_listeners; i++)
+    {
+        listeners[i].events = POLLIN;
+        if (fcntl(listeners[i].fd, F_SETFL, O_NONBLOCK) == -1)
+        {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (;;)
+    {
+        if (poll(listeners, num_listeners, -1) == -1)
+        {
+            if (errno != EINTR)
+                perror("poll");
+            continue;
+        }
+
+        for (i = 0; i < num_listeners; i++)
+        {
+            if (listeners[i].revents & POLLIN)
+                accept_client(config, listeners[i].fd, i ? PROTOCOL_MQTT : PROTOCOL_TEXT);
         }
     }
 
-    close(sock);
+    for (i = 0; i < num_listeners; i++)
+        close(listeners[i].fd);
 
     printf("Exiting\n");
 }
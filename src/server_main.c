@@ -1,7 +1,10 @@
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "server.h"
+#include "store.h"
 
 enum
 {
@@ -10,19 +13,167 @@ enum
 
 void usage()
 {
-    printf("Usage: mqttd [port]\n");
+    printf("Usage: mqttd [-m thread|epoll|shard|uring] [-t threads] [-a] [-w high_bytes] [-l low_bytes] [-f subscribers] [-d store_dir] [-c commit_ms] [-s snapshot_file] [-i seconds] [-x seconds] [-T seconds] [-k seconds] [-b retain_bytes] [-p oldest|session|topic] [-q mqtt_port] [port]\n");
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
-    int p;
+    struct server_config config = {
+        .mode = SERVER_MODE_THREAD,
+        .num_threads = 0,
+        .pin_cpus = 0,
+        .high_watermark = DEFAULT_HIGH_WATERMARK,
+        .low_watermark = DEFAULT_LOW_WATERMARK,
+        .fanout_threshold = DEFAULT_FANOUT_THRESHOLD,
+        .store_dir = NULL,
+        .commit_ms = STORE_DEFAULT_COMMIT_MS,
+        .snapshot_path = NULL,
+        .snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL,
+        .session_expiry = 0,
+        .message_ttl = 0,
+        .idle_timeout = 0,
+        .retain_budget = 0,
+        .retain_policy = RETAIN_DROP_OLDEST,
+    };
+    long long watermark;
+    long threads, threshold, commit_ms, interval, seconds;
+    int p, mqtt_port = 0, opt;
 
-    if (argc > 2)
+    while ((opt = getopt(argc, argv, "m:t:aw:l:f:d:c:s:i:x:T:k:b:p:q:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            if (!strcmp(optarg, "thread"))
+                config.mode = SERVER_MODE_THREAD;
+            else if (!strcmp(optarg, "epoll"))
+                config.mode = SERVER_MODE_EPOLL;
+            else if (!strcmp(optarg, "shard"))
+                config.mode = SERVER_MODE_SHARD;
+            else if (!strcmp(optarg, "uring"))
+            {
+#ifdef HAVE_LIBURING
+                config.mode = SERVER_MODE_URING;
+#else
+                printf("mqttd was built without io_uring support\n");
+                usage();
+#endif
+            }
+            else
+                usage();
+            break;
+        case 't':
+            threads = atol(optarg);
+            if (threads <= 0)
+            {
+                printf("invalid thread count\n");
+                usage();
+            }
+            config.num_threads = threads;
+            break;
+        case 'a':
+            config.pin_cpus = 1;
+            break;
+        case 'w':
+        case 'l':
+            watermark = atoll(optarg);
+            if (watermark <= 0)
+            {
+                printf("invalid watermark\n");
+                usage();
+            }
+            if (opt == 'w')
+                config.high_watermark = watermark;
+            else
+                config.low_watermark = watermark;
+            break;
+        case 'f':
+            threshold = atol(optarg);
+            if (threshold < 0)
+            {
+                printf("invalid fan-out threshold\n");
+                usage();
+            }
+            config.fanout_threshold = threshold;
+            break;
+        case 'd':
+            config.store_dir = optarg;
+            break;
+        case 'c':
+            commit_ms = atol(optarg);
+            if (commit_ms <= 0)
+            {
+                printf("invalid commit interval\n");
+                usage();
+            }
+            config.commit_ms = commit_ms;
+            break;
+        case 's':
+            config.snapshot_path = optarg;
+            break;
+        case 'i':
+            interval = atol(optarg);
+            if (interval <= 0)
+            {
+                printf("invalid snapshot interval\n");
+                usage();
+            }
+            config.snapshot_interval = interval;
+            break;
+        case 'x':
+        case 'T':
+        case 'k':
+            seconds = atol(optarg);
+            if (seconds <= 0)
+            {
+                printf("invalid timeout\n");
+                usage();
+            }
+            if (opt == 'x')
+                config.session_expiry = seconds * 1000;
+            else if (opt == 'T')
+                config.message_ttl = seconds * 1000;
+            else
+                config.idle_timeout = seconds * 1000;
+            break;
+        case 'b':
+            watermark = atoll(optarg);
+            if (watermark <= 0)
+            {
+                printf("invalid retention budget\n");
+                usage();
+            }
+            config.retain_budget = watermark;
+            break;
+        case 'p':
+            if (!strcmp(optarg, "oldest"))
+                config.retain_policy = RETAIN_DROP_OLDEST;
+            else if (!strcmp(optarg, "session"))
+                config.retain_policy = RETAIN_DROP_SESSION;
+            else if (!strcmp(optarg, "topic"))
+                config.retain_policy = RETAIN_STOP_TOPIC;
+            else
+                usage();
+            break;
+        case 'q':
+            mqtt_port = atoi(optarg);
+            if (mqtt_port < 1024 || mqtt_port > USHRT_MAX)
+            {
+                printf("invalid MQTT port\n");
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind > 1)
         usage();
 
-    if (argc == 2)
-        p = atoi(argv[1]);
+    if (argc - optind == 1)
+        p = atoi(argv[optind]);
     else
         p = DEFAULT_PORT;
 
@@ -44,7 +195,30 @@ int main(int argc, char **argv)
         usage();
     }
 
-    printf("Starting mqttd on port %hu\n", p);
-    start_server(p);
+    if (!config.num_threads)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        config.num_threads = threads > 0 ? threads : 1;
+    }
+
+    if (config.low_watermark > config.high_watermark)
+    {
+        printf("low watermark must not be above the high watermark\n");
+        usage();
+    }
+
+    if (mqtt_port == p)
+    {
+        printf("the MQTT port must differ from the text port\n");
+        usage();
+    }
+
+    config.port = p;
+    config.mqtt_port = mqtt_port;
+
+    printf("Starting mqttd on port %hu\n", config.port);
+    if (config.mqtt_port)
+        printf("MQTT 3.1.1 on port %hu\n", config.mqtt_port);
+    start_server(&config);
     return 0;
 }
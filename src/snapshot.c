@@ -0,0 +1,325 @@
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+enum
+{
+    SNAPSHOT_VERSION = 1,
+};
+
+static const char SNAPSHOT_MAGIC[8] = "MQTTDSNP";
+
+/* The names section follows, then the topics section. Names are a length and
+ * the bytes padded to 4, a topic is its name, a count and that many indices
+ * into the names */
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_names;
+    uint32_t num_topics;
+    uint32_t reserved;
+    uint64_t size; /* Of the whole file */
+    uint64_t names_size;
+    uint64_t check; /* Hashes of both sections */
+};
+
+static size_t padded(size_t len)
+{
+    return (len + 3) & ~(size_t)3;
+}
+
+static int buf_reserve(struct snapshot_buf *buf, size_t len)
+{
+    size_t size = buf->size ? buf->size : 4096;
+    char *data;
+
+    if (buf->len + len <= buf->size)
+        return 0;
+
+    while (size < buf->len + len)
+        size *= 2;
+
+    data = realloc(buf->data, size);
+    if (!data)
+    {
+        perror("realloc");
+        return -1;
+    }
+
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+static int buf_put_u32(struct snapshot_buf *buf, uint32_t value)
+{
+    if (buf_reserve(buf, sizeof(value)))
+        return -1;
+
+    memcpy(buf->data + buf->len, &value, sizeof(value));
+    buf->len += sizeof(value);
+    return 0;
+}
+
+static int buf_put_name(struct snapshot_buf *buf, const char *name, size_t len)
+{
+    if (buf_put_u32(buf, len) || buf_reserve(buf, padded(len)))
+        return -1;
+
+    memcpy(buf->data + buf->len, name, len);
+    memset(buf->data + buf->len + len, 0, padded(len) - len);
+    buf->len += padded(len);
+    return 0;
+}
+
+static uint64_t section_check(char *names, size_t names_len, char *topics, size_t topics_len)
+{
+    return hash_bytes(names, names_len) * 31 + hash_bytes(topics, topics_len);
+}
+
+static int write_all(int fd, void *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len)
+    {
+        ret = write(fd, data, len);
+        if (ret == -1)
+            return -1;
+        data = (char *)data + ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+int snapshot_init(struct snapshot_builder *builder)
+{
+    memset(builder, 0, sizeof(*builder));
+
+    builder->names = hash_init(64);
+    if (!builder->names)
+        return -1;
+
+    return 0;
+}
+
+void snapshot_free(struct snapshot_builder *builder)
+{
+    hash_free(builder->names);
+    free(builder->name_buf.data);
+    free(builder->topic_buf.data);
+}
+
+int snapshot_add_topic(struct snapshot_builder *builder, const char *name, size_t len, size_t num_subs)
+{
+    if (buf_put_name(&builder->topic_buf, name, len) || buf_put_u32(&builder->topic_buf, num_subs))
+        return -1;
+
+    builder->num_topics++;
+    return 0;
+}
+
+int snapshot_add_sub(struct snapshot_builder *builder, const char *client, size_t len)
+{
+    uintptr_t index;
+
+    index = (uintptr_t)hash_lookup(builder->names, (void *)client, len);
+    if (!index)
+    {
+        if (buf_put_name(&builder->name_buf, client, len))
+            return -1;
+
+        index = ++builder->num_names;
+        if (hash_insert(builder->names, (void *)client, len, (void *)index))
+            return -1;
+    }
+
+    return buf_put_u32(&builder->topic_buf, index - 1);
+}
+
+int snapshot_write(struct snapshot_builder *builder, const char *path)
+{
+    struct snapshot_header header;
+    char tmp_path[PATH_MAX], dir_path[PATH_MAX];
+    int fd, dir_fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.num_names = builder->num_names;
+    header.num_topics = builder->num_topics;
+    header.size = sizeof(header) + builder->name_buf.len + builder->topic_buf.len;
+
+    header.names_size = builder->name_buf.len;
+    header.check = section_check(builder->name_buf.data, builder->name_buf.len, builder->topic_buf.data,
+                                 builder->topic_buf.len);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(tmp_path);
+        return -1;
+    }
+
+    if (write_all(fd, &header, sizeof(header)) || write_all(fd, builder->name_buf.data, builder->name_buf.len)
+        || write_all(fd, builder->topic_buf.data, builder->topic_buf.len) || fsync(fd))
+    {
+        perror(tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path))
+    {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    /* The rename only lasts once the directory is synced */
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    dir_fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return 0;
+}
+
+/* Returns the name at *offset and moves past it, or NULL if it overruns end */
+static const char *read_name(const char *map, size_t *offset, size_t end)
+{
+    uint32_t len;
+    const char *name;
+
+    if (end - *offset < sizeof(len))
+        return NULL;
+    memcpy(&len, map + *offset, sizeof(len));
+    *offset += sizeof(len);
+
+    if (!len || end - *offset < padded(len))
+        return NULL;
+    name = map + *offset;
+    if (name[len - 1] != '\0')
+        return NULL;
+
+    *offset += padded(len);
+    return name;
+}
+
+static long read_snapshot(const char *map, size_t size, snapshot_sub_fn fn, void *ctx)
+{
+    const struct snapshot_header *header = (const struct snapshot_header *)map;
+    uint32_t i, j, num_subs, index;
+    size_t offset = sizeof(*header);
+    const char **names, *topic;
+    long count = 0;
+
+    names = malloc((header->num_names ? header->num_names : 1) * sizeof(*names));
+    if (!names)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    for (i = 0; i < header->num_names; i++)
+    {
+        names[i] = read_name(map, &offset, size);
+        if (!names[i])
+            goto invalid;
+    }
+
+    for (i = 0; i < header->num_topics; i++)
+    {
+        topic = read_name(map, &offset, size);
+        if (!topic || size - offset < sizeof(num_subs))
+            goto invalid;
+        memcpy(&num_subs, map + offset, sizeof(num_subs));
+        offset += sizeof(num_subs);
+
+        if ((size - offset) / sizeof(index) < num_subs)
+            goto invalid;
+
+        for (j = 0; j < num_subs; j++)
+        {
+            memcpy(&index, map + offset, sizeof(index));
+            offset += sizeof(index);
+            if (index >= header->num_names)
+                goto invalid;
+
+            fn(ctx, topic, names[index]);
+            count++;
+        }
+    }
+
+    free(names);
+    return count;
+
+invalid:
+    free(names);
+    return -1;
+}
+
+long snapshot_load(const char *path, snapshot_sub_fn fn, void *ctx)
+{
+    const struct snapshot_header *header;
+    struct stat st;
+    long count;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    /* Validated as a whole first, so a torn snapshot restores nothing */
+    header = (const struct snapshot_header *)map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) || header->version != SNAPSHOT_VERSION
+        || header->size != (uint64_t)st.st_size || header->names_size > st.st_size - sizeof(*header))
+    {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    count = -1;
+    if (section_check(map + sizeof(*header), header->names_size, map + sizeof(*header) + header->names_size,
+                      st.st_size - sizeof(*header) - header->names_size) == header->check)
+        count = read_snapshot(map, st.st_size, fn, ctx);
+    if (count < 0)
+        fprintf(stderr, "%s: snapshot is damaged\n", path);
+
+    munmap(map, st.st_size);
+    return count;
+}
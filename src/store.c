@@ -0,0 +1,578 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+
+enum
+{
+    SEGMENT_HEADER_SIZE = 64,
+    SEGMENT_VERSION = 1,
+    SEGMENT_NAME_LEN = 20, /* 16 hex digits and ".seg" */
+};
+
+static const char SEGMENT_MAGIC[8] = "MQTTDSEG";
+
+struct segment_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t number;
+};
+
+static size_t record_size(size_t len)
+{
+    return (sizeof(struct store_record) + len + 7) & ~(size_t)7;
+}
+
+static uint64_t record_check(struct store_record *record, void *data)
+{
+    uint64_t check = hash_bytes(data, record->len) ^ record->seq
+                     ^ ((uint64_t)record->stream << 48 | (uint64_t)record->type << 32 | record->len);
+
+    return check ? check : 1;
+}
+
+static void segment_path(struct store *store, uint64_t number, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.seg", store->dir, (unsigned long long)number);
+}
+
+static struct store_segment *alloc_segment(struct store *store, uint64_t number)
+{
+    struct store_segment *seg;
+
+    seg = calloc(sizeof(*seg), 1);
+    if (!seg)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    seg->stream_end = calloc(store->num_streams, sizeof(*seg->stream_end));
+    if (!seg->stream_end)
+    {
+        perror("calloc");
+        free(seg);
+        return NULL;
+    }
+
+    seg->number = number;
+    seg->fd = -1;
+    list_init(&seg->entry);
+
+    return seg;
+}
+
+static void free_segment(struct store *store, struct store_segment *seg)
+{
+    if (seg->map)
+        munmap(seg->map, store->segment_size);
+    if (seg->fd != -1)
+        close(seg->fd);
+    free(seg->stream_end);
+    free(seg);
+}
+
+static void note_record(struct store_segment *seg, struct store_record *record, size_t num_streams)
+{
+    if (record->stream < num_streams && record->seq + 1 > seg->stream_end[record->stream])
+        seg->stream_end[record->stream] = record->seq + 1;
+}
+
+/* Must lock store->lock. Creates the next segment and makes it the one appended to.
+ * It is left to the flusher to make the file durable, see store_sync() */
+static struct store_segment *new_segment(struct store *store, uint64_t number)
+{
+    struct segment_header *header;
+    struct store_segment *seg;
+    char path[PATH_MAX];
+
+    seg = alloc_segment(store, number);
+    if (!seg)
+        return NULL;
+
+    segment_path(store, number, path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (seg->fd == -1)
+    {
+        perror(path);
+        free_segment(store, seg);
+        return NULL;
+    }
+
+    /* Sparse, so the unwritten rest reads as zeroes */
+    if (ftruncate(seg->fd, store->segment_size))
+    {
+        perror("ftruncate");
+        goto fail;
+    }
+
+    seg->map = mmap(NULL, store->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED)
+    {
+        perror("mmap");
+        seg->map = NULL;
+        goto fail;
+    }
+
+    header = (struct segment_header *)seg->map;
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = SEGMENT_VERSION;
+    header->number = number;
+    seg->written = SEGMENT_HEADER_SIZE;
+
+    list_add_tail(&store->segments, &seg->entry);
+    return seg;
+
+fail:
+    free_segment(store, seg);
+    unlink(path);
+    return NULL;
+}
+
+/* Reads back a segment left by an earlier run. Stops at the first record
+ * that is missing or torn, nothing after it was ever acknowledged */
+static int load_segment(struct store *store, uint64_t number, store_record_fn fn, void *ctx)
+{
+    struct segment_header *header;
+    struct store_record *record;
+    struct store_segment *seg;
+    char path[PATH_MAX], *map;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    segment_path(store, number, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) || st.st_size < SEGMENT_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s: not a segment, skipping it\n", path);
+        close(fd);
+        return 0;
+    }
+    size = st.st_size;
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    header = (struct segment_header *)map;
+    if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) || header->version != SEGMENT_VERSION
+        || header->number != number)
+    {
+        fprintf(stderr, "%s: not a segment, skipping it\n", path);
+        munmap(map, size);
+        return 0;
+    }
+
+    seg = alloc_segment(store, number);
+    if (!seg)
+    {
+        munmap(map, size);
+        return -1;
+    }
+
+    seg->written = SEGMENT_HEADER_SIZE;
+    while (seg->written + sizeof(*record) <= size)
+    {
+        record = (struct store_record *)(map + seg->written);
+        if (!record->type || record_size(record->len) > size - seg->written
+            || record->check != record_check(record, record + 1))
+            break;
+
+        note_record(seg, record, store->num_streams);
+        fn(ctx, number, record, record + 1);
+        seg->written += record_size(record->len);
+    }
+
+    munmap(map, size);
+    seg->synced = seg->written;
+    seg->full = 1; /* Never appended to again, a new run starts a new segment */
+    list_add_tail(&store->segments, &seg->entry);
+
+    return 0;
+}
+
+static int cmp_number(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Returns the numbers of the segments in the directory, sorted */
+static uint64_t *list_segments(struct store *store, size_t *count)
+{
+    uint64_t *numbers = NULL, *tmp;
+    unsigned long long number;
+    size_t size = 0;
+    struct dirent *entry;
+    char suffix[8];
+    DIR *dir;
+
+    *count = 0;
+
+    dir = opendir(store->dir);
+    if (!dir)
+    {
+        perror(store->dir);
+        return NULL;
+    }
+
+    while ((entry = readdir(dir)))
+    {
+        if (strlen(entry->d_name) != SEGMENT_NAME_LEN
+            || sscanf(entry->d_name, "%16llx%7s", &number, suffix) != 2 || strcmp(suffix, ".seg"))
+            continue;
+
+        if (*count == size)
+        {
+            size = size ? size * 2 : 16;
+            tmp = realloc(numbers, size * sizeof(*numbers));
+            if (!tmp)
+            {
+                perror("realloc");
+                free(numbers);
+                closedir(dir);
+                *count = 0;
+                return NULL;
+            }
+            numbers = tmp;
+        }
+        numbers[(*count)++] = number;
+    }
+
+    closedir(dir);
+    if (*count)
+        qsort(numbers, *count, sizeof(*numbers), cmp_number);
+
+    return numbers;
+}
+
+void store_sync(struct store *store)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE), from, to;
+    struct store_segment *seg;
+    struct list *cur;
+
+    pthread_mutex_lock(&store->flush_lock);
+    pthread_mutex_lock(&store->lock);
+
+    /* Segments are only removed under flush_lock and only added at the end,
+     * so the list can be walked with store->lock dropped around each sync */
+    for (cur = store->segments.next; cur != &store->segments; cur = cur->next)
+    {
+        seg = LIST_ENTRY(cur, struct store_segment, entry);
+        if (!seg->map)
+            continue;
+
+        from = seg->synced & ~(page_size - 1);
+        to = seg->written;
+        if (seg->synced != to)
+        {
+            pthread_mutex_unlock(&store->lock);
+            if (msync(seg->map + from, to - from, MS_SYNC))
+                perror("msync");
+            /* A new segment's file and directory entry have to survive before its records can */
+            if (!seg->synced && (fsync(seg->fd) || fsync(store->dir_fd)))
+                perror("fsync");
+            pthread_mutex_lock(&store->lock);
+            seg->synced = to;
+        }
+
+        if (seg->full && seg->synced == seg->written)
+        {
+            munmap(seg->map, store->segment_size);
+            seg->map = NULL;
+            close(seg->fd);
+            seg->fd = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&store->lock);
+    pthread_mutex_unlock(&store->flush_lock);
+}
+
+/* Group commit: one sync per interval covers every append made during it */
+static void *flush_loop(void *arg)
+{
+    struct store *store = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&store->lock);
+    while (!store->stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)store->commit_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&store->stop_cond, &store->lock, &deadline);
+
+        pthread_mutex_unlock(&store->lock);
+        store_sync(store);
+        pthread_mutex_lock(&store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    return NULL;
+}
+
+struct store *store_open(const char *dir, size_t segment_size, unsigned int commit_ms, size_t num_streams,
+                         store_record_fn fn, void *ctx)
+{
+    uint64_t *numbers, next = 0;
+    struct store_segment *seg;
+    struct store *store;
+    size_t count, i;
+
+    if (mkdir(dir, 0755) && errno != EEXIST)
+    {
+        perror(dir);
+        return NULL;
+    }
+
+    store = calloc(sizeof(*store), 1);
+    if (!store)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    store->dir = strdup(dir);
+    if (!store->dir)
+    {
+        perror("strdup");
+        free(store);
+        return NULL;
+    }
+
+    store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (store->dir_fd == -1)
+    {
+        perror(dir);
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+
+    store->segment_size = segment_size;
+    store->num_streams = num_streams;
+    store->commit_ms = commit_ms ? commit_ms : 1;
+    list_init(&store->segments);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_mutex_init(&store->flush_lock, NULL);
+    pthread_cond_init(&store->stop_cond, NULL);
+
+    numbers = list_segments(store, &count);
+    for (i = 0; i < count; i++)
+    {
+        if (load_segment(store, numbers[i], fn, ctx))
+        {
+            free(numbers);
+            goto fail;
+        }
+        next = numbers[i] + 1;
+    }
+    free(numbers);
+
+    if (!new_segment(store, next))
+        goto fail;
+
+    if (pthread_create(&store->flusher, NULL, flush_loop, store))
+    {
+        perror("pthread_create");
+        goto fail;
+    }
+
+    return store;
+
+fail:
+    while (!list_empty(&store->segments))
+    {
+        seg = LIST_ENTRY(store->segments.next, struct store_segment, entry);
+        list_remove(&seg->entry);
+        free_segment(store, seg);
+    }
+    close(store->dir_fd);
+    free(store->dir);
+    free(store);
+    return NULL;
+}
+
+void store_close(struct store *store)
+{
+    struct store_segment *seg;
+
+    pthread_mutex_lock(&store->lock);
+    store->stop = 1;
+    pthread_cond_signal(&store->stop_cond);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->flusher, NULL);
+
+    store_sync(store);
+
+    while (!list_empty(&store->segments))
+    {
+        seg = LIST_ENTRY(store->segments.next, struct store_segment, entry);
+        list_remove(&seg->entry);
+        free_segment(store, seg);
+    }
+
+    close(store->dir_fd);
+    free(store->dir);
+    free(store);
+}
+
+int store_append(struct store *store, uint16_t type, uint16_t stream, uint64_t seq, void *data, size_t len,
+                 uint64_t *segment)
+{
+    size_t size = record_size(len);
+    struct store_record *record;
+    struct store_segment *seg;
+
+    if (!type || size > store->segment_size - SEGMENT_HEADER_SIZE)
+    {
+        fprintf(stderr, "Record of %zu bytes is too large to store\n", len);
+        return -1;
+    }
+
+    pthread_mutex_lock(&store->lock);
+
+    seg = LIST_ENTRY(store->segments.prev, struct store_segment, entry);
+    if (seg->full || seg->written + size > store->segment_size)
+    {
+        seg->full = 1;
+        seg = new_segment(store, seg->number + 1);
+        if (!seg)
+        {
+            pthread_mutex_unlock(&store->lock);
+            return -1;
+        }
+    }
+
+    record = (struct store_record *)(seg->map + seg->written);
+    memcpy(record + 1, data, len);
+    record->len = len;
+    record->stream = stream;
+    record->seq = seq;
+    record->type = type;
+    record->check = record_check(record, data);
+
+    seg->written += size;
+    note_record(seg, record, store->num_streams);
+    if (segment)
+        *segment = seg->number;
+
+    pthread_mutex_unlock(&store->lock);
+
+    return 0;
+}
+
+static struct store_segment *find_segment(struct store *store, uint64_t number)
+{
+    struct store_segment *seg;
+    struct list *cur;
+
+    for (cur = store->segments.next; cur != &store->segments; cur = cur->next)
+    {
+        seg = LIST_ENTRY(cur, struct store_segment, entry);
+        if (seg->number == number)
+            return seg;
+    }
+
+    return NULL;
+}
+
+void store_pin(struct store *store, uint64_t segment)
+{
+    struct store_segment *seg;
+
+    pthread_mutex_lock(&store->lock);
+    seg = find_segment(store, segment);
+    if (seg)
+        seg->pins++;
+    pthread_mutex_unlock(&store->lock);
+}
+
+void store_unpin(struct store *store, uint64_t segment)
+{
+    struct store_segment *seg;
+
+    pthread_mutex_lock(&store->lock);
+    seg = find_segment(store, segment);
+    if (seg && seg->pins)
+        seg->pins--;
+    pthread_mutex_unlock(&store->lock);
+}
+
+/* Must lock store->lock */
+static int segment_needed(struct store *store, struct store_segment *seg, const uint64_t *first_seqs)
+{
+    size_t i;
+
+    /* The segment being appended to is always kept */
+    if (seg->pins || seg->entry.next == &store->segments)
+        return 1;
+
+    for (i = 0; i < store->num_streams; i++)
+    {
+        if (seg->stream_end[i] > first_seqs[i])
+            return 1;
+    }
+
+    return 0;
+}
+
+void store_trim(struct store *store, const uint64_t *first_seqs)
+{
+    struct list dropped = LIST_INIT(dropped);
+    struct store_segment *seg;
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&store->flush_lock);
+    pthread_mutex_lock(&store->lock);
+
+    while (!list_empty(&store->segments))
+    {
+        seg = LIST_ENTRY(store->segments.next, struct store_segment, entry);
+        if (segment_needed(store, seg, first_seqs))
+            break;
+
+        list_remove(&seg->entry);
+        list_add_tail(&dropped, &seg->entry);
+    }
+
+    pthread_mutex_unlock(&store->lock);
+    pthread_mutex_unlock(&store->flush_lock);
+
+    while (!list_empty(&dropped))
+    {
+        seg = LIST_ENTRY(dropped.next, struct store_segment, entry);
+        list_remove(&seg->entry);
+
+        segment_path(store, seg->number, path, sizeof(path));
+        if (unlink(path))
+            perror(path);
+        free_segment(store, seg);
+    }
+}
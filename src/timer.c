@@ -0,0 +1,134 @@
+#include "timer.h"
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+    size_t level, slot;
+
+    wheel->now = now;
+    wheel->count = 0;
+    for (level = 0; level < TIMER_LEVELS; level++)
+    {
+        for (slot = 0; slot < TIMER_SLOTS; slot++)
+            list_init(&wheel->slots[level][slot]);
+    }
+}
+
+void timer_init(struct timer *timer, timer_fn fn, void *ctx)
+{
+    list_init(&timer->entry);
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->ctx = ctx;
+}
+
+int timer_pending(struct timer *timer)
+{
+    return !list_empty(&timer->entry);
+}
+
+/* Files the timer by how far off it is. Timers past the top level wait in its
+ * furthest slot and are filed again when they come down */
+static void place(struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t expires = timer->expires, delta;
+    size_t level = 0;
+
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+
+    delta = expires - wheel->now;
+    while (level < TIMER_LEVELS - 1 && delta >> ((level + 1) * TIMER_LEVEL_BITS))
+        level++;
+
+    if (delta >> ((level + 1) * TIMER_LEVEL_BITS))
+        expires = wheel->now + ((uint64_t)1 << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1;
+
+    list_add_tail(&wheel->slots[level][(expires >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1)], &timer->entry);
+}
+
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t expires)
+{
+    if (timer_pending(timer))
+        list_remove(&timer->entry);
+    else
+        wheel->count++;
+
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (!timer_pending(timer))
+        return;
+
+    list_remove(&timer->entry);
+    list_init(&timer->entry);
+    wheel->count--;
+}
+
+/* Files the timers of a higher level slot again, now that the tick has
+ * reached the span it covers */
+static void cascade(struct timer_wheel *wheel, size_t level)
+{
+    struct list *slot, pending = LIST_INIT(pending);
+    struct timer *timer;
+
+    slot = &wheel->slots[level][(wheel->now >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1)];
+    list_move_append(&pending, slot);
+
+    while (!list_empty(&pending))
+    {
+        timer = LIST_ENTRY(pending.next, struct timer, entry);
+        list_remove(&timer->entry);
+
+        /* Due at this very tick, its level 0 slot is run next */
+        if (timer->expires <= wheel->now)
+            list_add_tail(&wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)], &timer->entry);
+        else
+            place(wheel, timer);
+    }
+}
+
+size_t timer_advance(struct timer_wheel *wheel, uint64_t now)
+{
+    struct timer *timer;
+    struct list *slot;
+    size_t ran = 0, level;
+
+    while (wheel->now < now)
+    {
+        /* Nothing can be due, skip the ticks in between */
+        if (!wheel->count)
+        {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now++;
+
+        /* Highest level first, so what comes down from it lands in slots
+         * not yet cascaded at this tick */
+        for (level = 1; level < TIMER_LEVELS; level++)
+        {
+            if (wheel->now & (((uint64_t)1 << (level * TIMER_LEVEL_BITS)) - 1))
+                break;
+        }
+        while (--level)
+            cascade(wheel, level);
+
+        slot = &wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)];
+        while (!list_empty(slot))
+        {
+            timer = LIST_ENTRY(slot->next, struct timer, entry);
+            list_remove(&timer->entry);
+            list_init(&timer->entry);
+            wheel->count--;
+
+            timer->fn(timer, timer->ctx);
+            ran++;
+        }
+    }
+
+    return ran;
+}
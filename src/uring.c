@@ -0,0 +1,466 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <liburing.h>
+
+#include "hash.h"
+#include "server.h"
+#include "uring.h"
+#include "utils.h"
+
+enum
+{
+    RING_ENTRIES = 4096,
+    RECV_BUF_COUNT = 1024, /* Must be a power of two */
+    RECV_BUF_SIZE = 4096,
+    RECV_BUF_GROUP = 0,
+};
+
+enum
+{
+    OP_ACCEPT,
+    OP_INBOX,
+    OP_WAKE,
+    OP_RECV,
+    OP_SEND,
+};
+
+/* Passed as user data so completions can be routed */
+struct uring_op
+{
+    int type;
+    struct uring_conn *uc;
+};
+
+struct uring_reactor
+{
+    struct reactor reactor;
+    struct io_uring ring;
+
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+
+    struct uring_op accept_op;
+    struct uring_op mqtt_accept_op;
+    struct uring_op inbox_op;
+    struct uring_op wake_op;
+};
+
+struct uring_conn
+{
+    struct connection *conn;
+
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    int recv_armed;
+    int recv_cancelled;
+
+    /* Only one sendmsg is in flight per connection to keep replies ordered */
+    int sending;
+    struct iovec iov[MAX_WRITE_IOV];
+    struct msghdr msg;
+};
+
+static struct uring_reactor *uring_reactors;
+
+static struct uring_reactor *get_uring_reactor(struct reactor *reactor)
+{
+    return (struct uring_reactor *)((char *)reactor - offsetof(struct uring_reactor, reactor));
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Flush the queue to make room if it is full */
+    while (!(sqe = io_uring_get_sqe(ring)))
+        io_uring_submit(ring);
+
+    return sqe;
+}
+
+static void arm_accept(struct uring_reactor *ur, int listen_sock, struct uring_op *op)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ur->ring);
+
+    io_uring_prep_multishot_accept(sqe, listen_sock, NULL, NULL, 0);
+    io_uring_sqe_set_data(sqe, op);
+}
+
+static void arm_poll(struct uring_reactor *ur, int fd, struct uring_op *op)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ur->ring);
+
+    io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+    io_uring_sqe_set_data(sqe, op);
+}
+
+static void arm_recv(struct uring_reactor *ur, struct uring_conn *uc)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ur->ring);
+
+    /* Buffers are picked by the kernel from the registered ring */
+    io_uring_prep_recv_multishot(sqe, uc->conn->sock, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUF_GROUP;
+    io_uring_sqe_set_data(sqe, &uc->recv_op);
+
+    uc->recv_armed = 1;
+}
+
+static void recycle_buf(struct uring_reactor *ur, unsigned short bid)
+{
+    io_uring_buf_ring_add(ur->buf_ring,
+                          ur->bufs + (size_t)bid * RECV_BUF_SIZE,
+                          RECV_BUF_SIZE,
+                          bid,
+                          io_uring_buf_ring_mask(RECV_BUF_COUNT),
+                          0);
+    io_uring_buf_ring_advance(ur->buf_ring, 1);
+}
+
+static void try_close(struct uring_reactor *ur, struct uring_conn *uc);
+
+/* Replaces write_conn() for io_uring connections. Gathers everything queued
+ * so far into a single sendmsg, submitted with the rest of the batch */
+static void uring_flush(struct connection *conn)
+{
+    struct uring_reactor *ur = get_uring_reactor(conn->reactor);
+    struct uring_conn *uc = conn->io_data;
+    struct io_uring_sqe *sqe;
+    size_t count = 0;
+
+    if (uc->sending)
+        return;
+
+    if (!conn->write_failed)
+        count = outq_fill_iov(&conn->outq, uc->iov, MAX_WRITE_IOV);
+
+    if (!count)
+    {
+        if (conn->closing)
+            try_close(ur, uc);
+        return;
+    }
+
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = count;
+
+    sqe = get_sqe(&ur->ring);
+    io_uring_prep_sendmsg(sqe, conn->sock, &uc->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, &uc->send_op);
+
+    uc->sending = 1;
+}
+
+/* Closing waits for the outstanding operations so none complete on freed memory */
+static void try_close(struct uring_reactor *ur, struct uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Let the last replies, such as DISC_ACK, go out first */
+    if (uc->sending || atomic_load(&uc->conn->flush_pending))
+        return;
+
+    if (uc->recv_armed)
+    {
+        if (!uc->recv_cancelled)
+        {
+            sqe = get_sqe(&ur->ring);
+            io_uring_prep_cancel64(sqe, (__u64)(uintptr_t)&uc->recv_op, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+            uc->recv_cancelled = 1;
+        }
+        return;
+    }
+
+    uc->conn->io_data = NULL;
+    close_connection(uc->conn);
+    free(uc);
+}
+
+static void handle_accept(struct uring_reactor *ur, struct io_uring_cqe *cqe, struct uring_op *op)
+{
+    enum protocol protocol = op == &ur->mqtt_accept_op ? PROTOCOL_MQTT : PROTOCOL_TEXT;
+    struct connection *conn;
+    struct uring_conn *uc;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_accept(ur, protocol == PROTOCOL_MQTT ? ur->reactor.mqtt_listen_sock : ur->reactor.listen_sock, op);
+
+    if (cqe->res < 0)
+    {
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    conn = new_connection(cqe->res, ur->reactor.shard, protocol);
+    if (!conn)
+    {
+        close(cqe->res);
+        return;
+    }
+
+    uc = calloc(sizeof(*uc), 1);
+    if (!uc)
+    {
+        perror("calloc");
+        close(cqe->res);
+        conn_put(conn);
+        return;
+    }
+
+    uc->conn = conn;
+    uc->recv_op.type = OP_RECV;
+    uc->recv_op.uc = uc;
+    uc->send_op.type = OP_SEND;
+    uc->send_op.uc = uc;
+
+    conn->reactor = &ur->reactor;
+    conn->io_data = uc;
+    conn_active(conn);
+
+    arm_recv(ur, uc);
+}
+
+static void handle_recv(struct uring_reactor *ur, struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+    struct connection *conn = uc->conn;
+    unsigned short bid;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (!conn->closing)
+            handle_data(conn, ur->bufs + (size_t)bid * RECV_BUF_SIZE, cqe->res);
+
+        recycle_buf(ur, bid);
+    }
+    else if (!cqe->res)
+    {
+        conn->closing = 1;
+    }
+    else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+    {
+        fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+        conn->closing = 1;
+    }
+
+    /* Multishot recv stops when it runs out of buffers, restart it */
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uc->recv_armed = 0;
+        if (!conn->closing)
+            arm_recv(ur, uc);
+    }
+
+    if (conn->closing)
+        try_close(ur, uc);
+}
+
+static void handle_send(struct uring_reactor *ur, struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+    struct connection *conn = uc->conn;
+
+    uc->sending = 0;
+
+    if (cqe->res == -EAGAIN || cqe->res == -EINTR)
+    {
+        uring_flush(conn);
+        return;
+    }
+
+    if (cqe->res < 0)
+    {
+        fprintf(stderr, "sendmsg: %s\n", strerror(-cqe->res));
+        conn->write_failed = 1;
+        conn->closing = 1;
+    }
+    else
+    {
+        outq_consume(&conn->outq, cqe->res);
+    }
+
+    /* Also finishes closing once nothing is left to send */
+    uring_flush(conn);
+}
+
+static void handle_cqe(struct uring_reactor *ur, struct io_uring_cqe *cqe)
+{
+    struct uring_op *op = io_uring_cqe_get_data(cqe);
+    uint64_t count;
+
+    if (!op)
+        return; /* Cancellation result */
+
+    switch (op->type)
+    {
+    case OP_ACCEPT:
+        handle_accept(ur, cqe, op);
+        return;
+    case OP_INBOX:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            arm_poll(ur, ur->reactor.shard->inbox_fd, &ur->inbox_op);
+        drain_shard_inbox(ur->reactor.shard);
+        return;
+    case OP_WAKE:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            arm_poll(ur, ur->reactor.wake_fd, &ur->wake_op);
+        if (read(ur->reactor.wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            perror("read");
+        return;
+    case OP_RECV:
+        handle_recv(ur, op->uc, cqe);
+        return;
+    case OP_SEND:
+        handle_send(ur, op->uc, cqe);
+        return;
+    }
+}
+
+static void init_uring_reactor(struct uring_reactor *ur)
+{
+    struct io_uring_params params;
+    unsigned short i;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+    ret = io_uring_queue_init_params(RING_ENTRIES, &ur->ring, &params);
+    if (ret == -EINVAL)
+    {
+        /* Older kernels do not know the flags above */
+        memset(&params, 0, sizeof(params));
+        ret = io_uring_queue_init_params(RING_ENTRIES, &ur->ring, &params);
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    ur->bufs = malloc((size_t)RECV_BUF_COUNT * RECV_BUF_SIZE);
+    if (!ur->bufs)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    ur->buf_ring = io_uring_setup_buf_ring(&ur->ring, RECV_BUF_COUNT, RECV_BUF_GROUP, 0, &ret);
+    if (!ur->buf_ring)
+    {
+        fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < RECV_BUF_COUNT; i++)
+    {
+        io_uring_buf_ring_add(ur->buf_ring,
+                              ur->bufs + (size_t)i * RECV_BUF_SIZE,
+                              RECV_BUF_SIZE,
+                              i,
+                              io_uring_buf_ring_mask(RECV_BUF_COUNT),
+                              i);
+    }
+    io_uring_buf_ring_advance(ur->buf_ring, RECV_BUF_COUNT);
+
+    ur->accept_op.type = OP_ACCEPT;
+    ur->mqtt_accept_op.type = OP_ACCEPT;
+    ur->inbox_op.type = OP_INBOX;
+    ur->wake_op.type = OP_WAKE;
+
+}
+
+static void *uring_loop(void *data)
+{
+    struct uring_reactor *ur = (struct uring_reactor *)data;
+    struct __kernel_timespec tick = {0, TIMER_TICK_MS * 1000000};
+    struct io_uring_cqe *cqe;
+    unsigned int head, count;
+    int ret;
+
+    /* SINGLE_ISSUER rings must be created by the thread submitting to them */
+    init_uring_reactor(ur);
+    io_uring_register_ring_fd(&ur->ring);
+
+    arm_accept(ur, ur->reactor.listen_sock, &ur->accept_op);
+    if (ur->reactor.mqtt_listen_sock != -1)
+        arm_accept(ur, ur->reactor.mqtt_listen_sock, &ur->mqtt_accept_op);
+    arm_poll(ur, ur->reactor.shard->inbox_fd, &ur->inbox_op);
+    arm_poll(ur, ur->reactor.wake_fd, &ur->wake_op);
+
+    for (;;)
+    {
+        /* Everything queued while handling the last batch goes out in one submission */
+        if (ur->reactor.idle_timers.count)
+            ret = io_uring_submit_and_wait_timeout(&ur->ring, &cqe, 1, &tick, NULL);
+        else
+            ret = io_uring_submit_and_wait(&ur->ring, 1);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY && ret != -ETIME)
+        {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+
+        count = 0;
+        io_uring_for_each_cqe(&ur->ring, head, cqe)
+        {
+            handle_cqe(ur, cqe);
+            count++;
+        }
+        io_uring_cq_advance(&ur->ring, count);
+
+        /* Queues sendmsgs for everything replied to in this batch */
+        flush_ready_conns(&ur->reactor);
+
+        if (ur->reactor.idle_timers.count)
+            timer_advance(&ur->reactor.idle_timers, get_time_ms());
+    }
+
+    return NULL;
+}
+
+void start_uring(struct server_config *config, struct shard *shards, size_t num_shards)
+{
+    int thread_ret;
+    size_t i;
+
+    uring_reactors = calloc(sizeof(*uring_reactors), num_shards);
+    if (!uring_reactors)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_shards; i++)
+    {
+        uring_reactors[i].reactor.epoll_fd = -1;
+        uring_reactors[i].reactor.shard = &shards[i];
+        uring_reactors[i].reactor.flush = uring_flush;
+        init_reactor_queue(&uring_reactors[i].reactor);
+        uring_reactors[i].reactor.listen_sock = open_listener(config->port, 1);
+        uring_reactors[i].reactor.mqtt_listen_sock = config->mqtt_port ? open_listener(config->mqtt_port, 1) : -1;
+
+        if ((thread_ret = pthread_create(&uring_reactors[i].reactor.thread, NULL, uring_loop, &uring_reactors[i])))
+        {
+            fprintf(stderr, "pthread_create: %d\n", thread_ret);
+            exit(EXIT_FAILURE);
+        }
+
+        if (config->pin_cpus)
+            pin_thread(uring_reactors[i].reactor.thread, i);
+    }
+
+    for (i = 0; i < num_shards; i++)
+        pthread_join(uring_reactors[i].reactor.thread, NULL);
+}
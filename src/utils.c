@@ -82,3 +82,11 @@ uint64_t get_current_time(void)
 
     return time.tv_sec;
 }
+
+uint64_t get_time_ms(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
@@ -0,0 +1,61 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "verb.h"
+
+enum
+{
+    VERB_SLOTS = 16, /* Power of two */
+};
+
+/* Perfect over the verbs, from their first and last letters and length. A
+ * constant expression, so the table below is laid out by the compiler */
+#define VERB_HASH(first, last, len) (((first) * 2 + (last) + (len)) & (VERB_SLOTS - 1))
+#define VERB_BIT(first, last, len) (1u << VERB_HASH(first, last, len))
+
+/* Adding a verb means a line in each of these, the enum and verb_info */
+#define VERB_KEYS(X) \
+    X(VERB_CONN, 'C', 'N', 4) \
+    X(VERB_SUB, 'S', 'B', 3) \
+    X(VERB_PUB, 'P', 'B', 3) \
+    X(VERB_DISC, 'D', 'C', 4) \
+    X(VERB_RECONNECT, 'R', 'T', 9) \
+    X(VERB_STATS, 'S', 'S', 5)
+
+#define VERB_SLOT_ENTRY(verb, first, last, len) [VERB_HASH(first, last, len)] = verb + 1,
+#define VERB_BIT_SUM(verb, first, last, len) + VERB_BIT(first, last, len)
+#define VERB_BIT_OR(verb, first, last, len) | VERB_BIT(first, last, len)
+
+/* Only distinct slots add up to the same as they OR to */
+_Static_assert((0 VERB_KEYS(VERB_BIT_SUM)) == (0 VERB_KEYS(VERB_BIT_OR)), "two verbs hash to the same slot");
+
+/* The verb + 1 in each slot, 0 for none */
+static const uint8_t verb_slots[VERB_SLOTS] = {VERB_KEYS(VERB_SLOT_ENTRY)};
+
+const struct verb_info verb_info[NUM_VERBS] = {
+    [VERB_CONN] = {"CONN", 4, 0},
+    [VERB_SUB] = {"SUB", 3, 0},
+    [VERB_PUB] = {"PUB", 3, 0},
+    [VERB_DISC] = {"DISC", 4, 1},
+    [VERB_RECONNECT] = {"RECONNECT", 9, 1},
+    [VERB_STATS] = {"STATS", 5, 1},
+};
+
+enum verb verb_lookup(const char *str, size_t len)
+{
+    const struct verb_info *info;
+    int slot;
+
+    if (!len)
+        return VERB_NONE;
+
+    slot = verb_slots[VERB_HASH((unsigned char)str[0], (unsigned char)str[len - 1], len)];
+    if (!slot)
+        return VERB_NONE;
+
+    info = &verb_info[slot - 1];
+    if (info->len != len || memcmp(info->name, str, len))
+        return VERB_NONE;
+
+    return slot - 1;
+}
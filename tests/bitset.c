@@ -0,0 +1,38 @@
+#include "bitset.h"
+#include "test.h"
+
+int main(void)
+{
+    struct bitset set, other;
+    size_t i, wrong;
+
+    bitset_init(&set);
+    bitset_init(&other);
+
+    run_test(!bitset_test(&set, 0), "expected: empty set\n");
+    run_test(!bitset_test(&set, 1000000), "expected: nothing past the end\n");
+
+    bitset_set(&set, 3);
+    bitset_set(&set, 64);
+    bitset_set(&set, 1000);
+    run_test(bitset_test(&set, 3) && bitset_test(&set, 64) && bitset_test(&set, 1000), "expected: bits set\n");
+    run_test(!bitset_test(&set, 4) && !bitset_test(&set, 63) && !bitset_test(&set, 999), "expected: neighbours clear\n");
+
+    bitset_clear(&set, 64);
+    bitset_clear(&set, 5000);
+    run_test(!bitset_test(&set, 64), "expected: bit 64 cleared\n");
+
+    /* The union keeps both sides, whichever is longer */
+    for (i = 0; i < 4096; i += 3)
+        bitset_set(&other, i);
+    bitset_union(&set, &other);
+    for (i = 0, wrong = 0; i < 5000; i++)
+        wrong += bitset_test(&set, i) != (i % 3 == 0 && i < 4096) + (i == 1000 && i % 3 != 0);
+    run_test(!wrong, "expected: union of both, got: %zu wrong\n", wrong);
+
+    bitset_free(&set);
+    bitset_free(&other);
+    run_test(!bitset_test(&set, 3), "expected: freed set is empty\n");
+
+    END_TEST();
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compact.h"
+#include "test.h"
+
+struct frames
+{
+    char seen[8][MAX_COMMAND_SIZE]; /* Larger frames only have their length kept */
+    size_t lens[8];
+    size_t count;
+    size_t stop_after;
+};
+
+static int record_frame(void *ctx, char *frame, size_t len)
+{
+    struct frames *frames = ctx;
+
+    if (len <= sizeof(frames->seen[0]))
+        memcpy(frames->seen[frames->count], frame, len);
+    frames->lens[frames->count] = len;
+    frames->count++;
+
+    return frames->count == frames->stop_after;
+}
+
+static int feed(struct frame_buf *buf, struct frames *frames, const char *data, size_t len)
+{
+    return compact_feed(buf, (char *)data, len, record_frame, frames);
+}
+
+int main(void)
+{
+    static const char *PUB[] = {"a", "PUB", "NEWS", "x, <y>\0z"};
+    static const size_t PUB_LENS[] = {1, 3, 4, 8};
+    static const char *SUB[] = {"a", "SUB", "WEATHER"};
+    static const size_t SUB_LENS[] = {1, 3, 7};
+    static char payload[COMPACT_MAX_FRAME_SIZE];
+    static char big[COMPACT_MAX_FRAME_SIZE + 16];
+    char stream[256], *toks[MAX_FRAME_TOKENS];
+    size_t lens[MAX_FRAME_TOKENS], len, pub_len, count, i;
+    struct frames frames;
+    struct frame_buf buf;
+
+    /* Fields go out as they are, delimiters and NULs included */
+    pub_len = compact_encode(stream, PUB, PUB_LENS, 4);
+    run_test(pub_len == compact_frame_size(PUB_LENS, 4), "expected: size matches, got: %zu\n", pub_len);
+    run_test(pub_len == 1 + 4 * 2 + 16, "expected: 25 bytes, got: %zu\n", pub_len);
+    run_test(stream[0] == 24 && stream[1] == 1 && stream[2] == 'a' && !stream[3], "expected: length, then a\n");
+
+    len = pub_len + compact_encode(stream + pub_len, SUB, SUB_LENS, 3);
+
+    /* Pipelined frames in one read */
+    memset(&frames, 0, sizeof(frames));
+    frame_init(&buf);
+    run_test(!feed(&buf, &frames, stream, len), "expected: stream accepted\n");
+    run_test(frames.count == 2 && frames.lens[0] == pub_len, "expected: 2 frames, got: %zu\n", frames.count);
+    run_test(!buf.len, "expected: empty buffer, got: %zu\n", buf.len);
+
+    /* The same stream a byte at a time */
+    memset(&frames, 0, sizeof(frames));
+    for (i = 0; i < len; i++)
+        feed(&buf, &frames, stream + i, 1);
+    run_test(frames.count == 2 && !memcmp(frames.seen[1], stream + pub_len, len - pub_len),
+             "expected: 2 frames byte by byte, got: %zu\n", frames.count);
+    run_test(!buf.len, "expected: empty buffer, got: %zu\n", buf.len);
+
+    /* The handler stops dispatch */
+    memset(&frames, 0, sizeof(frames));
+    frames.stop_after = 1;
+    feed(&buf, &frames, stream, len);
+    run_test(frames.count == 1, "expected: 1 frame, got: %zu\n", frames.count);
+
+    /* Splitting only follows lengths */
+    count = compact_split(frames.seen[0], frames.lens[0], toks, lens, MAX_FRAME_TOKENS);
+    run_test(count == 4, "expected: 4 fields, got: %zu\n", count);
+    run_test(!strcmp(toks[1], "PUB") && lens[2] == 4 && !strcmp(toks[2], "NEWS"), "expected: PUB and NEWS\n");
+    run_test(lens[3] == 8 && !memcmp(toks[3], "x, <y>\0z", 8) && !toks[3][8], "expected: payload intact\n");
+
+    /* Such a payload would break a text subscriber's frame, so it only goes
+     * out compact and MQTT. One without > or ", " is sent to text too */
+    run_test(!frame_can_carry(toks[3], lens[3]), "expected: payload kept from text subscribers\n");
+    run_test(!frame_can_carry("y>", 2) && frame_can_carry("x,<y\0", 5), "expected: only > and \", \" refused\n");
+
+    count = compact_split(frames.seen[0], frames.lens[0], toks, lens, 2);
+    run_test(count == 2, "expected: fields past max dropped, got: %zu\n", count);
+
+    /* Empty fields are kept */
+    lens[0] = 0;
+    len = compact_encode(stream, (const char *const *)toks, lens, 1);
+    run_test(compact_split(stream, len, toks, lens, MAX_FRAME_TOKENS) == 1 && !lens[0], "expected: empty field\n");
+
+    /* Malformed frames split into nothing */
+    len = compact_encode(stream, SUB, SUB_LENS, 3);
+    stream[len - 1] = 'x';
+    run_test(!compact_split(stream, len, toks, lens, MAX_FRAME_TOKENS), "expected: missing NUL refused\n");
+    stream[len - 1] = '\0';
+    stream[1] = 100;
+    run_test(!compact_split(stream, len, toks, lens, MAX_FRAME_TOKENS), "expected: overlong field refused\n");
+    stream[1] = 1;
+    run_test(!compact_split(stream, len - 1, toks, lens, MAX_FRAME_TOKENS), "expected: short frame refused\n");
+    run_test(!compact_split(stream, 1, toks, lens, MAX_FRAME_TOKENS), "expected: no fields\n");
+
+    /* Lengths that run on or are too large end the stream */
+    frame_free(&buf);
+    memset(&frames, 0, sizeof(frames));
+    memset(big, 0xff, COMPACT_MAX_VARINT + 1);
+    run_test(feed(&buf, &frames, big, COMPACT_MAX_VARINT + 1) == -1, "expected: long varint refused\n");
+    frame_free(&buf);
+
+    for (i = 0, len = COMPACT_MAX_FRAME_SIZE + 1; len >> 7; i++, len >>= 7)
+        big[i] = 0x80 | (len & 0x7f);
+    big[i++] = len;
+    run_test(feed(&buf, &frames, big, i) == -1 && !frames.count, "expected: oversized frame refused\n");
+    frame_free(&buf);
+
+    /* The largest allowed frame goes through, across reads */
+    lens[0] = COMPACT_MAX_FRAME_SIZE - 4 - 1;
+    toks[0] = payload;
+    memset(payload, 'x', lens[0]);
+    len = compact_encode(big, (const char *const *)toks, lens, 1);
+    run_test(len == COMPACT_MAX_FRAME_SIZE + 4, "expected: 4 byte length, got: %zu\n", len);
+    feed(&buf, &frames, big, 100);
+    feed(&buf, &frames, big + 100, len - 100);
+    run_test(!buf.len && buf.cap <= FRAME_KEEP_SIZE, "expected: buffer released, got: %zu\n", buf.cap);
+    run_test(frames.count == 1 && frames.lens[0] == len, "expected: largest frame, got: %zu\n", frames.count);
+    frame_free(&buf);
+
+    END_TEST();
+}
@@ -0,0 +1,89 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "test.h"
+
+enum
+{
+    NUM_READERS = 4,
+    NUM_UPDATES = 20000,
+    LIVE = 0x1234,
+    DEAD = 0xdead,
+};
+
+struct object
+{
+    int state;
+};
+
+static struct object *_Atomic shared;
+static atomic_int done;
+static atomic_int freed;
+static atomic_int bad_reads;
+
+static void free_object(void *ptr)
+{
+    struct object *object = ptr;
+
+    /* Poisoned first, a reader seeing this was handed freed memory */
+    object->state = DEAD;
+    atomic_fetch_add(&freed, 1);
+    free(object);
+}
+
+static void *read_loop(void *arg)
+{
+    struct object *object;
+
+    while (!atomic_load(&done))
+    {
+        epoch_enter();
+        object = atomic_load(&shared);
+        epoch_enter(); /* Nested sections must not end the outer one */
+        epoch_exit();
+        if (object->state != LIVE)
+            atomic_fetch_add(&bad_reads, 1);
+        epoch_exit();
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[NUM_READERS];
+    struct object *object;
+    size_t i, left;
+
+    object = malloc(sizeof(*object));
+    object->state = LIVE;
+    atomic_store(&shared, object);
+
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_create(&threads[i], NULL, read_loop, NULL);
+
+    for (i = 0; i < NUM_UPDATES; i++)
+    {
+        object = malloc(sizeof(*object));
+        object->state = LIVE;
+        epoch_retire(free_object, atomic_exchange(&shared, object));
+    }
+
+    atomic_store(&done, 1);
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_join(threads[i], NULL);
+
+    run_test(!atomic_load(&bad_reads), "expected: no reads of freed objects, got: %d\n", atomic_load(&bad_reads));
+
+    /* With every reader gone a couple of advances free everything */
+    for (i = 0, left = 1; i < 4 && left; i++)
+        left = epoch_reclaim();
+    run_test(!left, "expected: nothing left to free, got: %zu\n", left);
+    run_test(atomic_load(&freed) == NUM_UPDATES, "expected: %d freed, got: %d\n", NUM_UPDATES, atomic_load(&freed));
+
+    free(atomic_load(&shared));
+
+    END_TEST();
+}
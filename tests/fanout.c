@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "fanout.h"
+#include "test.h"
+
+enum
+{
+    NUM_WORKERS = 4,
+    NUM_CALLERS = 4,
+    NUM_ITEMS = 100000,
+    NUM_ROUNDS = 50,
+};
+
+static struct fanout_pool *pool;
+
+struct items
+{
+    atomic_int visits[NUM_ITEMS];
+    int round[NUM_ITEMS];
+    int in_order;
+};
+
+static void visit(void *ctx, size_t begin, size_t end)
+{
+    struct items *items = ctx;
+    size_t i;
+
+    for (i = begin; i < end; i++)
+        atomic_fetch_add(&items->visits[i], 1);
+}
+
+/* Every item must see round n before round n + 1, like a subscriber's messages */
+static void visit_round(void *ctx, size_t begin, size_t end)
+{
+    struct items *items = ctx;
+    size_t i;
+
+    for (i = begin; i < end; i++)
+    {
+        if (items->round[i] != atomic_load(&items->visits[0]))
+            items->in_order = 0;
+        items->round[i]++;
+    }
+}
+
+static void *call_rounds(void *data)
+{
+    struct items *items = data;
+    int i;
+
+    items->in_order = 1;
+    for (i = 0; i < NUM_ROUNDS; i++)
+    {
+        fanout_run(pool, visit_round, items, NUM_ITEMS);
+        atomic_fetch_add(&items->visits[0], 1);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[NUM_CALLERS];
+    struct items *items;
+    size_t i, wrong = 0;
+    int in_order = 1;
+
+    pool = fanout_create(NUM_WORKERS);
+    run_test(pool != NULL, "expected: a pool\n");
+    if (!pool)
+        END_TEST();
+
+    items = calloc(NUM_CALLERS, sizeof(*items));
+
+    /* Each item is handled exactly once */
+    fanout_run(pool, visit, &items[0], NUM_ITEMS);
+    for (i = 0; i < NUM_ITEMS; i++)
+        wrong += atomic_load(&items[0].visits[i]) != 1;
+    run_test(!wrong, "expected: every item once, got: %zu wrong\n", wrong);
+
+    /* Fewer items than chunks */
+    atomic_store(&items[0].visits[0], 0);
+    fanout_run(pool, visit, &items[0], 1);
+    run_test(atomic_load(&items[0].visits[0]) == 1, "expected: a single item once\n");
+    fanout_run(pool, visit, &items[0], 0);
+
+    /* Several callers at once, each waiting for its own rounds */
+    for (i = 0; i < NUM_CALLERS; i++)
+    {
+        items[i].visits[0] = 0;
+        pthread_create(&threads[i], NULL, call_rounds, &items[i]);
+    }
+
+    for (i = 0; i < NUM_CALLERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        in_order &= items[i].in_order;
+        in_order &= items[i].round[NUM_ITEMS - 1] == NUM_ROUNDS;
+    }
+    run_test(in_order, "expected: rounds completed in order\n");
+
+    free(items);
+    fanout_destroy(pool);
+
+    END_TEST();
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "test.h"
+#include "utils.h"
+
+struct frames
+{
+    char seen[8][MAX_COMMAND_SIZE + 1]; /* Larger frames only have their length kept */
+    size_t lens[8];
+    size_t count;
+    size_t stop_after;
+};
+
+static int record_frame(void *ctx, char *frame, size_t len)
+{
+    struct frames *frames = ctx;
+
+    if (len < sizeof(frames->seen[0]))
+    {
+        memcpy(frames->seen[frames->count], frame, len);
+        frames->seen[frames->count][len] = '\0';
+    }
+    frames->lens[frames->count] = len;
+    frames->count++;
+
+    return frames->count == frames->stop_after;
+}
+
+static void feed(struct frame_buf *buf, struct frames *frames, char *data)
+{
+    frame_feed(buf, data, strlen(data), record_frame, frames);
+}
+
+/* Splits a copy, frame_split() writes into the frame */
+static size_t split(const char *frame, char *copy, char **toks, size_t *lens)
+{
+    size_t len = strlen(frame);
+
+    memcpy(copy, frame, len + 1);
+    return frame_split(copy, len, toks, lens, MAX_FRAME_TOKENS);
+}
+
+/* frame_split() has to agree with split_string() on every body it is given */
+static int same_as_split_string(const char *body)
+{
+    char frame[MAX_COMMAND_SIZE + 1], *toks[MAX_FRAME_TOKENS], **expected;
+    size_t lens[MAX_FRAME_TOKENS], count, expected_count, i;
+    int same;
+
+    snprintf(frame, sizeof(frame), "<%s>", body);
+    count = frame_split(frame, strlen(frame), toks, lens, MAX_FRAME_TOKENS);
+    expected_count = split_string((char *)body, strlen(body), ", ", &expected);
+
+    same = count == expected_count;
+    for (i = 0; same && i < count; i++)
+        same = !strcmp(toks[i], expected[i]) && lens[i] == strlen(expected[i]);
+
+    if (expected_count)
+        free(expected);
+    return same;
+}
+
+int main(void)
+{
+    static char big[MAX_FRAME_SIZE + 2];
+    struct frames frames;
+    size_t pos, len;
+    struct frame_buf buf;
+
+    /* Pipelined frames in one read */
+    memset(&frames, 0, sizeof(frames));
+    frame_init(&buf);
+    feed(&buf, &frames, "<a, CONN><a, SUB, NEWS><a, PUB, NEWS, hi>");
+    run_test(frames.count == 3, "expected: 3 frames, got: %zu\n", frames.count);
+    run_test(!strcmp(frames.seen[1], "<a, SUB, NEWS>"), "expected: <a, SUB, NEWS>, got: %s\n", frames.seen[1]);
+    run_test(!buf.len, "expected: empty buffer, got: %zu\n", buf.len);
+
+    /* Frame split across reads, with garbage between frames */
+    memset(&frames, 0, sizeof(frames));
+    feed(&buf, &frames, "\r\n<a, PUB, NE");
+    run_test(frames.count == 0, "expected: 0 frames, got: %zu\n", frames.count);
+    feed(&buf, &frames, "WS, split");
+    feed(&buf, &frames, "> junk <DISC");
+    run_test(frames.count == 1, "expected: 1 frame, got: %zu\n", frames.count);
+    run_test(!strcmp(frames.seen[0], "<a, PUB, NEWS, split>"), "expected: <a, PUB, NEWS, split>, got: %s\n", frames.seen[0]);
+    feed(&buf, &frames, ">");
+    run_test(frames.count == 2, "expected: 2 frames, got: %zu\n", frames.count);
+    run_test(!strcmp(frames.seen[1], "<DISC>"), "expected: <DISC>, got: %s\n", frames.seen[1]);
+
+    /* Oversized frames are dropped without losing the next one */
+    memset(&frames, 0, sizeof(frames));
+    memset(big, 'x', sizeof(big) - 1);
+    big[0] = '<';
+    big[sizeof(big) - 1] = '\0';
+    feed(&buf, &frames, big);
+    feed(&buf, &frames, "x><DISC>");
+    run_test(frames.count == 1, "expected: 1 frame, got: %zu\n", frames.count);
+    run_test(!strcmp(frames.seen[0], "<DISC>"), "expected: <DISC>, got: %s\n", frames.seen[0]);
+
+    /* The largest payload goes through across reads, its room is not kept */
+    memset(&frames, 0, sizeof(frames));
+    memcpy(big, "<a, PUB, NEWS, ", 15);
+    memset(big + 15, 'x', MAX_PAYLOAD_SIZE);
+    big[15 + MAX_PAYLOAD_SIZE] = '>';
+    len = 15 + MAX_PAYLOAD_SIZE + 1;
+    for (pos = 0; pos < len; pos += 65536)
+        frame_feed(&buf, big + pos, len - pos < 65536 ? len - pos : 65536, record_frame, &frames);
+    run_test(frames.count == 1 && frames.lens[0] == len, "expected: 1 large frame, got: %zu\n", frames.count);
+    run_test(!buf.len && buf.cap <= FRAME_KEEP_SIZE, "expected: buffer released, got: %zu\n", buf.cap);
+
+    /* Handler can stop dispatching */
+    memset(&frames, 0, sizeof(frames));
+    frames.stop_after = 1;
+    feed(&buf, &frames, "<DISC><a, CONN>");
+    run_test(frames.count == 1, "expected: 1 frame, got: %zu\n", frames.count);
+
+    frame_free(&buf);
+
+    /* Splitting is done in place, tokens point into the frame */
+    {
+        static const char *bodies[] = {
+            "a, PUB, NEWS, hi", ", , a, , b, ", "a,b, c", "a,, b", "a ,b", "a, b,", ",a", "DISC", "",
+            "client-with-a-long-name, PUB, campus/building-1/floor-2/room-3/power, 1234.5,6",
+        };
+        char copy[MAX_COMMAND_SIZE + 1], body[64], *toks[MAX_FRAME_TOKENS];
+        size_t lens[MAX_FRAME_TOKENS], count, i, j;
+        int differ = 0;
+
+        count = split("<a, PUB, NEWS, hi>", copy, toks, lens);
+        run_test(count == 4 && !strcmp(toks[2], "NEWS") && lens[3] == 2 && toks[0] == copy + 1,
+                 "expected: 4 tokens in place, got: %zu\n", count);
+
+        count = split("<a, SUB, NE>WS>", copy, toks, lens);
+        run_test(!count, "expected: stray > rejected, got: %zu tokens\n", count);
+        count = split("a, SUB, NEWS>", copy, toks, lens);
+        run_test(!count, "expected: missing < rejected, got: %zu tokens\n", count);
+
+        count = split("<a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r>", copy, toks, lens);
+        run_test(count == MAX_FRAME_TOKENS && !strcmp(toks[MAX_FRAME_TOKENS - 1], "p"),
+                 "expected: %d tokens, got: %zu\n", MAX_FRAME_TOKENS, count);
+
+        for (i = 0; i < sizeof(bodies) / sizeof(*bodies); i++)
+            run_test(same_as_split_string(bodies[i]), "expected: same tokens as split_string for \"%s\"\n", bodies[i]);
+
+        /* Every mix of the characters that matter, across the 16 byte chunks */
+        for (i = 0; i < 20000; i++)
+        {
+            for (j = 0; j < 40 && (i * 7 + j) % 41; j++)
+                body[j] = "ab, ,"[(i * 31 + j * j * 17 + (i >> 3) * j) % 5];
+            body[j] = '\0';
+            differ += !same_as_split_string(body);
+        }
+        run_test(!differ, "expected: same tokens as split_string, got: %d differences\n", differ);
+    }
+
+    /* Payloads that would end the frame or split into more tokens */
+    run_test(frame_can_carry("a,b <c", 6), "expected: , and < carried\n");
+    run_test(frame_can_carry("a,", 2) && frame_can_carry("\0", 1), "expected: trailing , and NUL carried\n");
+    run_test(!frame_can_carry("a>b", 3), "expected: > refused\n");
+    run_test(!frame_can_carry("a, b", 4) && !frame_can_carry(", ", 2), "expected: , followed by space refused\n");
+    run_test(!frame_can_carry("", 0), "expected: empty payload refused\n");
+
+    END_TEST();
+}
@@ -1,58 +1,21 @@
+#include <stdio.h>
 #include <string.h>
 
 #include "hash.h"
 #include "test.h"
 
-struct item
+enum
 {
-    struct list entry;
+    NUM_KEYS = 10000,
+};
 
+struct item
+{
     char *key;
     char *val;
 };
 
-static char *get_value(struct hash_table *table, void *key, size_t key_len)
-{
-    struct list *bucket, *cur;
-    struct item *item;
-    size_t hash;
-
-    hash = hash_bytes(key, key_len) % table->size;
-    bucket = &table->buckets[hash];
-
-    cur = bucket->next;
-    while (cur != bucket)
-    {
-        item = LIST_ENTRY(cur, struct item, entry);
-        if (!strcmp(item->key, (char *)key))
-            return item->val;
-    }
-
-    return NULL;
-}
-
-static struct item *del_item(struct hash_table *table, void *key, size_t key_len)
-{
-    struct list *bucket, *cur;
-    struct item *item;
-    size_t hash;
-
-    hash = hash_bytes(key, key_len) % table->size;
-    bucket = &table->buckets[hash];
-
-    cur = bucket->next;
-    while (cur != bucket)
-    {
-        item = LIST_ENTRY(cur, struct item, entry);
-        if (!strcmp(item->key, (char *)key))
-        {
-            list_remove(&item->entry);
-            return item;
-        }
-    }
-
-    return NULL;
-}
+static char keys[NUM_KEYS][16];
 
 int main(void)
 {
@@ -65,28 +28,108 @@ int main(void)
         .key = "baz",
         .val = "qux"
     };
+    size_t i, iter, found, wrong, capacity;
+    int resizing;
     struct item *item_ptr;
+    char long_key[128];
     char *buf;
 
-    hash_insert(table, item1.key, strlen(item1.key) + 1, &item1.entry);
-    hash_insert(table, item2.key, strlen(item2.key) + 1, &item2.entry);
+    hash_insert(table, item1.key, strlen(item1.key) + 1, &item1);
+    hash_insert(table, item2.key, strlen(item2.key) + 1, &item2);
 
-    buf = get_value(table, item1.key, strlen(item1.key) + 1);
-    run_test(buf == item1.val, "expected: %p, got: %p\n", &item1.val, buf);
-    buf = get_value(table, item2.key, strlen(item2.key) + 1);
-    run_test(buf == item2.val, "expected: %p, got: %p\n", &item2.val, buf);
-    buf = get_value(table, item2.val, strlen(item2.val) + 1);
+    item_ptr = hash_lookup(table, item1.key, strlen(item1.key) + 1);
+    run_test(item_ptr == &item1, "expected: %p, got: %p\n", &item1, item_ptr);
+    item_ptr = hash_lookup(table, item2.key, strlen(item2.key) + 1);
+    run_test(item_ptr == &item2, "expected: %p, got: %p\n", &item2, item_ptr);
+    buf = hash_lookup(table, item2.val, strlen(item2.val) + 1);
     run_test(!buf, "expected: %p, got: %p\n", NULL, buf);
 
-    item_ptr = del_item(table, item1.key, strlen(item1.key) + 1);
+    item_ptr = hash_remove(table, item1.key, strlen(item1.key) + 1);
     run_test(item_ptr == &item1, "expected: %p, got: %p\n", &item1, item_ptr);
-    item_ptr = del_item(table, item1.key, strlen(item1.key) + 1);
+    item_ptr = hash_remove(table, item1.key, strlen(item1.key) + 1);
     run_test(!item_ptr, "expected: %p, got: %p\n", NULL, item_ptr);
-    item_ptr = del_item(table, item2.key, strlen(item2.key) + 1);
+    item_ptr = hash_remove(table, item2.key, strlen(item2.key) + 1);
     run_test(item_ptr == &item2, "expected: %p, got: %p\n", &item2, item_ptr);
+    run_test(hash_empty(table), "expected: empty table\n");
+
+    /* A hash kept from hash_bytes() finds the same entry */
+    hash_insert_hashed(table, item1.key, strlen(item1.key) + 1, hash_bytes(item1.key, strlen(item1.key) + 1), &item1);
+    item_ptr = hash_lookup(table, item1.key, strlen(item1.key) + 1);
+    run_test(item_ptr == &item1, "expected: %p, got: %p\n", &item1, item_ptr);
+    item_ptr = hash_remove_hashed(table, item1.key, strlen(item1.key) + 1, hash_bytes(item1.key, strlen(item1.key) + 1));
+    run_test(item_ptr == &item1, "expected: %p, got: %p\n", &item1, item_ptr);
+
+    /* Short, medium and long keys each take their own path through wyhash */
+    for (i = 0, wrong = 0; i < 100; i++)
+    {
+        snprintf(long_key, sizeof(long_key), "%0100zu", i);
+        wrong += hash_wyhash(long_key, i) == hash_wyhash(long_key, i + 1);
+        wrong += hash_wyhash(long_key, 100) == hash_wyhash(long_key, 99);
+    }
+    run_test(!wrong, "expected: distinct hashes, got: %zu equal\n", wrong);
+
+    /* Grows well past its initial size */
+    for (i = 0; i < NUM_KEYS; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "client%zu", i);
+        hash_insert(table, keys[i], strlen(keys[i]) + 1, keys[i]);
+    }
+    run_test(hash_count(table) == NUM_KEYS, "expected: %d items, got: %zu\n", NUM_KEYS, hash_count(table));
+
+    for (i = 0, wrong = 0; i < NUM_KEYS; i++)
+        wrong += hash_lookup(table, keys[i], strlen(keys[i]) + 1) != keys[i];
+    run_test(!wrong, "expected: every key found, got: %zu missing\n", wrong);
+
+    /* Removing half leaves the other half reachable past the holes */
+    for (i = 0; i < NUM_KEYS; i += 2)
+        hash_remove(table, keys[i], strlen(keys[i]) + 1);
+    for (i = 0, wrong = 0; i < NUM_KEYS; i++)
+        wrong += hash_lookup(table, keys[i], strlen(keys[i]) + 1) != (i % 2 ? keys[i] : NULL);
+    run_test(!wrong, "expected: only odd keys, got: %zu wrong\n", wrong);
+
+    for (iter = 0, found = 0; (buf = hash_next(table, &iter)); found++)
+        ;
+    run_test(found == NUM_KEYS / 2, "expected: %d iterated, got: %zu\n", NUM_KEYS / 2, found);
+
+    /* Shrinks again once mostly empty, and stays correct while moving */
+    capacity = table->cur.capacity;
+    for (i = 1, wrong = 0, resizing = 0; i < NUM_KEYS - 20; i += 2)
+    {
+        hash_remove(table, keys[i], strlen(keys[i]) + 1);
+        resizing |= table->old.capacity != 0;
+        wrong += hash_lookup(table, keys[i + 2], strlen(keys[i + 2]) + 1) != keys[i + 2];
+    }
+    run_test(resizing, "expected: a gradual shrink\n");
+    run_test(!wrong, "expected: remaining keys found while shrinking, got: %zu missing\n", wrong);
+    run_test(table->cur.capacity < capacity / 8, "expected: under %zu slots, got: %zu\n",
+             capacity / 8, table->cur.capacity);
+    run_test(hash_count(table) == 10, "expected: 10 left, got: %zu\n", hash_count(table));
+
+    /* Everything is still seen while items are split across both arrays */
+    for (i = 0; i < NUM_KEYS; i += 2)
+    {
+        hash_insert(table, keys[i], strlen(keys[i]) + 1, keys[i]);
+        if (table->old.capacity)
+            break;
+    }
+    for (iter = 0, found = 0; (buf = hash_next(table, &iter)); found++)
+        ;
+    run_test(table->old.capacity && found == hash_count(table), "expected: %zu iterated mid resize, got: %zu\n",
+             hash_count(table), found);
+    for (i = 0; i < NUM_KEYS; i++)
+        if (hash_lookup(table, keys[i], strlen(keys[i]) + 1))
+            hash_remove(table, keys[i], strlen(keys[i]) + 1);
+    run_test(hash_empty(table), "expected: empty table, got: %zu\n", hash_count(table));
+
+    /* Deleted slots are reused rather than growing forever */
+    for (i = 0; i < 100 * NUM_KEYS; i++)
+    {
+        hash_insert(table, keys[0], strlen(keys[0]) + 1, keys[0]);
+        hash_remove(table, keys[0], strlen(keys[0]) + 1);
+    }
+    run_test(table->cur.capacity <= 4 * NUM_KEYS, "expected: bounded capacity, got: %zu\n", table->cur.capacity);
 
     hash_free(table);
 
     END_TEST();
 }
-
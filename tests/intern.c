@@ -0,0 +1,82 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "intern.h"
+#include "test.h"
+
+enum
+{
+    NUM_THREADS = 4,
+    NUM_ROUNDS = 20000,
+};
+
+static atomic_int mismatches;
+
+/* Every thread keeps interning and dropping the same few names, so the last
+ * reference often races against another thread finding the name */
+static void *churn(void *arg)
+{
+    static const char *words[] = {"alice", "bob", "NEWS"};
+    struct interned *name, *again;
+    size_t i;
+
+    (void)arg;
+    for (i = 0; i < NUM_ROUNDS; i++)
+    {
+        name = intern(words[i % 3]);
+        again = intern_find(words[i % 3]);
+        if (name != again || strcmp(name->str, words[i % 3]))
+            atomic_fetch_add(&mismatches, 1);
+        intern_put(again);
+        intern_put(name);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    struct interned *alice, *bob, *other;
+    pthread_t threads[NUM_THREADS];
+    uint32_t id;
+    size_t i;
+
+    alice = intern("alice");
+    bob = intern("bob");
+    run_test(alice && bob && alice != bob, "expected: two names\n");
+    run_test(alice->id != bob->id, "expected: distinct IDs, got: %u twice\n", alice->id);
+    run_test(alice->len == strlen("alice") + 1, "expected: length %zu, got: %zu\n", strlen("alice") + 1, alice->len);
+
+    other = intern("alice");
+    run_test(other == alice, "expected: %p, got: %p\n", alice, other);
+    intern_put(other);
+
+    other = intern_find("carol");
+    run_test(!other, "expected: %p, got: %p\n", NULL, other);
+
+    /* The ID of a freed name is handed out again */
+    id = bob->id;
+    intern_put(bob);
+    other = intern_find("bob");
+    run_test(!other, "expected: bob freed, got: %p\n", other);
+    other = intern("carol");
+    run_test(other->id == id, "expected: ID %u reused, got: %u\n", id, other->id);
+    run_test(intern_id_limit() == 2, "expected: 2 IDs used, got: %u\n", intern_id_limit());
+    intern_put(other);
+
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, NULL);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    run_test(!atomic_load(&mismatches), "expected: one copy of each name, got: %d mismatches\n",
+             atomic_load(&mismatches));
+
+    /* alice was held throughout, so never freed */
+    run_test(intern_find("alice") == alice, "expected: alice kept\n");
+    intern_put(alice);
+    intern_put(alice);
+    run_test(intern_id_limit() <= 4, "expected: IDs reused, got: %u handed out\n", intern_id_limit());
+
+    END_TEST();
+}
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt.h"
+#include "test.h"
+
+struct packets
+{
+    struct mqtt_packet seen[8];
+    unsigned char bodies[8][MQTT_MAX_CONTROL_SIZE]; /* Larger bodies are not kept */
+    size_t count;
+    size_t stop_after;
+};
+
+static int record_packet(void *ctx, struct mqtt_packet *packet)
+{
+    struct packets *packets = ctx;
+
+    /* The body is only valid during the call */
+    if (packet->len <= sizeof(packets->bodies[0]))
+        memcpy(packets->bodies[packets->count], packet->body, packet->len);
+    packets->seen[packets->count] = *packet;
+    packets->seen[packets->count].body = packets->bodies[packets->count];
+    packets->count++;
+
+    return packets->count == packets->stop_after;
+}
+
+static int feed(struct frame_buf *buf, struct packets *packets, const unsigned char *data, size_t len)
+{
+    return mqtt_feed(buf, (char *)data, len, record_packet, packets);
+}
+
+static const unsigned char CONNECT[] = {
+    0x10, 0x13,                     /* CONNECT, 19 bytes */
+    0x00, 0x04, 'M', 'Q', 'T', 'T', /* Protocol name */
+    0x04,                           /* 3.1.1 */
+    0x02,                           /* Clean session */
+    0x00, 0x3c,                     /* Keep alive */
+    0x00, 0x07, 's', 'e', 'n', 's', 'o', 'r', '1',
+};
+
+static const unsigned char SUBSCRIBE[] = {
+    0x82, 0x0f,                                    /* SUBSCRIBE, 15 bytes */
+    0x00, 0x2a,                                    /* Packet ID */
+    0x00, 0x04, 'N', 'E', 'W', 'S', 0x00,          /* NEWS at QoS 0 */
+    0x00, 0x03, 'a', '/', '#', 0x01,               /* A wildcard at QoS 1 */
+};
+
+static const unsigned char PUBLISH[] = {
+    0x30, 0x0b,                                    /* PUBLISH at QoS 0, 11 bytes */
+    0x00, 0x04, 'N', 'E', 'W', 'S',
+    'h', 0x00, '>', ',', ' ',                      /* Payloads are binary */
+};
+
+static const unsigned char PINGREQ[] = {0xc0, 0x00};
+
+int main(void)
+{
+    unsigned char stream[sizeof(CONNECT) + sizeof(SUBSCRIBE) + sizeof(PUBLISH) + sizeof(PINGREQ)];
+    static unsigned char big[MQTT_MAX_PACKET_SIZE + 16];
+    unsigned char header[MQTT_MAX_HEADER_SIZE + 8], codes[2] = {0x00, 0x80};
+    struct mqtt_subscribe subscribe;
+    struct mqtt_connect connect;
+    struct mqtt_publish publish;
+    struct packets packets;
+    struct frame_buf buf;
+    const char *filter;
+    unsigned int qos;
+    size_t i, len;
+
+    len = 0;
+    memcpy(stream + len, CONNECT, sizeof(CONNECT));
+    len += sizeof(CONNECT);
+    memcpy(stream + len, SUBSCRIBE, sizeof(SUBSCRIBE));
+    len += sizeof(SUBSCRIBE);
+    memcpy(stream + len, PUBLISH, sizeof(PUBLISH));
+    len += sizeof(PUBLISH);
+    memcpy(stream + len, PINGREQ, sizeof(PINGREQ));
+    len += sizeof(PINGREQ);
+
+    /* Pipelined packets in one read */
+    memset(&packets, 0, sizeof(packets));
+    frame_init(&buf);
+    run_test(!feed(&buf, &packets, stream, len), "expected: stream accepted\n");
+    run_test(packets.count == 4, "expected: 4 packets, got: %zu\n", packets.count);
+    run_test(packets.seen[0].type == MQTT_CONNECT && packets.seen[1].type == MQTT_SUBSCRIBE
+                 && packets.seen[2].type == MQTT_PUBLISH && packets.seen[3].type == MQTT_PINGREQ,
+             "expected: CONNECT, SUBSCRIBE, PUBLISH, PINGREQ\n");
+    run_test(packets.seen[1].flags == 2 && packets.seen[1].len == 15, "expected: flags 2 and 15 bytes, got: %u, %zu\n",
+             packets.seen[1].flags, packets.seen[1].len);
+    run_test(!buf.len, "expected: empty buffer, got: %zu\n", buf.len);
+
+    /* The same stream a byte at a time, headers split included */
+    memset(&packets, 0, sizeof(packets));
+    for (i = 0; i < len; i++)
+        feed(&buf, &packets, stream + i, 1);
+    run_test(packets.count == 4, "expected: 4 packets byte by byte, got: %zu\n", packets.count);
+    run_test(packets.seen[2].len == 11 && !memcmp(packets.bodies[2], PUBLISH + 2, 11),
+             "expected: PUBLISH body intact\n");
+    run_test(!buf.len, "expected: empty buffer, got: %zu\n", buf.len);
+
+    /* The handler stops dispatch */
+    memset(&packets, 0, sizeof(packets));
+    packets.stop_after = 2;
+    feed(&buf, &packets, stream, len);
+    run_test(packets.count == 2, "expected: 2 packets, got: %zu\n", packets.count);
+    frame_free(&buf);
+
+    /* Remaining lengths that are too long or too large end the stream */
+    memset(&packets, 0, sizeof(packets));
+    big[0] = 0x30;
+    big[1] = big[2] = big[3] = big[4] = 0xff;
+    run_test(feed(&buf, &packets, big, 6) == -1, "expected: 5 byte length refused\n");
+    frame_free(&buf);
+
+    len = mqtt_encode_header(big, MQTT_PUBLISH, 0, MQTT_MAX_PACKET_SIZE + 1);
+    run_test(feed(&buf, &packets, big, len) == -1 && !packets.count, "expected: oversized packet refused\n");
+    frame_free(&buf);
+
+    /* Only a PUBLISH may be larger than a control packet */
+    len = mqtt_encode_header(big, MQTT_SUBSCRIBE, 2, MQTT_MAX_CONTROL_SIZE + 1);
+    run_test(feed(&buf, &packets, big, len) == -1, "expected: oversized SUBSCRIBE refused\n");
+    frame_free(&buf);
+
+    /* The largest allowed packet goes through */
+    len = mqtt_encode_header(big, MQTT_PUBLISH, 0, MQTT_MAX_PACKET_SIZE);
+    memset(big + len, 'x', MQTT_MAX_PACKET_SIZE);
+    feed(&buf, &packets, big, len + 100);
+    feed(&buf, &packets, big + len + 100, MQTT_MAX_PACKET_SIZE - 100);
+    run_test(packets.count == 1 && packets.seen[0].len == MQTT_MAX_PACKET_SIZE, "expected: largest packet, got: %zu\n",
+             packets.count);
+    frame_free(&buf);
+
+    /* CONNECT */
+    feed(&buf, &packets, CONNECT, sizeof(CONNECT));
+    run_test(mqtt_parse_connect(&packets.seen[1], &connect) == MQTT_CONNACK_ACCEPTED, "expected: CONNECT accepted\n");
+    run_test(connect.client_id_len == 7 && !memcmp(connect.client_id, "sensor1", 7) && connect.clean_session
+                 && connect.keep_alive == 60,
+             "expected: sensor1, clean, 60s\n");
+
+    memcpy(big, CONNECT, sizeof(CONNECT));
+    big[8] = 5;
+    packets.seen[1].body = big + 2;
+    run_test(mqtt_parse_connect(&packets.seen[1], &connect) == MQTT_CONNACK_BAD_PROTOCOL,
+             "expected: MQTT 5 refused\n");
+    big[8] = 4;
+    big[9] = 0x01;
+    run_test(mqtt_parse_connect(&packets.seen[1], &connect) == -1, "expected: reserved flag malformed\n");
+    big[9] = 0x02;
+    packets.seen[1].len--;
+    run_test(mqtt_parse_connect(&packets.seen[1], &connect) == -1, "expected: short client ID malformed\n");
+
+    /* SUBSCRIBE */
+    memset(&packets, 0, sizeof(packets));
+    feed(&buf, &packets, SUBSCRIBE, sizeof(SUBSCRIBE));
+    run_test(!mqtt_parse_subscribe(&packets.seen[0], &subscribe), "expected: SUBSCRIBE parsed\n");
+    run_test(subscribe.packet_id == 42 && subscribe.num_filters == 2, "expected: ID 42 and 2 filters, got: %u, %zu\n",
+             subscribe.packet_id, subscribe.num_filters);
+    run_test(mqtt_next_filter(&subscribe, &filter, &len, &qos) && len == 4 && !memcmp(filter, "NEWS", 4) && !qos,
+             "expected: NEWS at QoS 0\n");
+    run_test(mqtt_next_filter(&subscribe, &filter, &len, &qos) && len == 3 && qos == 1, "expected: a/# at QoS 1\n");
+    run_test(!mqtt_next_filter(&subscribe, &filter, &len, &qos), "expected: no more filters\n");
+
+    packets.seen[0].flags = 0;
+    run_test(mqtt_parse_subscribe(&packets.seen[0], &subscribe) == -1, "expected: bad flags malformed\n");
+    packets.seen[0].flags = 2;
+    packets.seen[0].len--;
+    run_test(mqtt_parse_subscribe(&packets.seen[0], &subscribe) == -1, "expected: missing QoS malformed\n");
+
+    /* PUBLISH */
+    memset(&packets, 0, sizeof(packets));
+    feed(&buf, &packets, PUBLISH, sizeof(PUBLISH));
+    run_test(!mqtt_parse_publish(&packets.seen[0], &publish), "expected: PUBLISH parsed\n");
+    run_test(publish.topic_len == 4 && !memcmp(publish.topic, "NEWS", 4) && !publish.qos && publish.payload_len == 5
+                 && !memcmp(publish.payload, "h\0>, ", 5),
+             "expected: NEWS with 5 byte payload, got: %zu\n", publish.payload_len);
+    packets.seen[0].flags = 6;
+    run_test(mqtt_parse_publish(&packets.seen[0], &publish) == -1, "expected: QoS 3 malformed\n");
+    packets.seen[0].flags = 2;
+    run_test(!mqtt_parse_publish(&packets.seen[0], &publish) && publish.qos == 1 && publish.packet_id == ('h' << 8)
+                 && publish.payload_len == 3,
+             "expected: QoS 1 with a packet ID\n");
+
+    /* Encoders */
+    len = mqtt_encode_header(header, MQTT_PUBLISH, 0, 321);
+    run_test(len == 3 && header[0] == 0x30 && header[1] == 0xc1 && header[2] == 0x02,
+             "expected: 2 byte remaining length, got: %zu\n", len);
+    len = mqtt_encode_header(header, MQTT_PUBLISH, 0, 2097152);
+    run_test(len == 5 && header[4] == 0x01, "expected: 4 byte remaining length, got: %zu\n", len);
+
+    mqtt_encode_connack(header, 1, MQTT_CONNACK_ACCEPTED);
+    run_test(!memcmp(header, "\x20\x02\x01\x00", MQTT_CONNACK_SIZE), "expected: CONNACK with session present\n");
+
+    len = mqtt_encode_suback(header, 42, codes, 2);
+    run_test(len == 6 && !memcmp(header, "\x90\x04\x00\x2a\x00\x80", 6), "expected: SUBACK, got: %zu bytes\n", len);
+
+    mqtt_encode_pingresp(header);
+    run_test(header[0] == 0xd0 && !header[1], "expected: PINGRESP\n");
+
+    /* What is encoded parses back */
+    len = mqtt_encode_publish(big, "NEWS", 4, 5);
+    memcpy(big + len, "hello", 5);
+    memset(&packets, 0, sizeof(packets));
+    feed(&buf, &packets, big, len + 5);
+    run_test(packets.count == 1 && !mqtt_parse_publish(&packets.seen[0], &publish) && publish.payload_len == 5
+                 && !memcmp(publish.payload, "hello", 5),
+             "expected: PUBLISH round trip\n");
+    frame_free(&buf);
+
+    END_TEST();
+}
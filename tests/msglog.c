@@ -0,0 +1,228 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "msglog.h"
+#include "test.h"
+
+enum
+{
+    NUM_MSGS = 1000,
+};
+
+struct replay
+{
+    size_t count;
+    size_t next; /* Expected number in the next frame */
+    size_t out_of_order;
+};
+
+static void check_frame(void *ctx, struct msgbuf *frame)
+{
+    struct replay *replay = ctx;
+    size_t num;
+
+    sscanf(frame->data, "m%zu", &num);
+    replay->out_of_order += num != replay->next;
+    replay->next = num + 1;
+    replay->count++;
+}
+
+static struct msgbuf *make_frame(size_t num)
+{
+    struct msgbuf *frame = msgbuf_alloc(32);
+
+    frame->len = snprintf(frame->data, 32, "m%zu", num) + 1;
+    return frame;
+}
+
+/* A client reconnecting while a publisher logs and then delivers live, the
+ * way the server does. It goes live first and replays after */
+struct reconnect
+{
+    struct msglog log;
+    _Atomic uint64_t replayed;
+    pthread_mutex_t lock; /* The client's queue */
+    struct replay received;
+};
+
+static void receive_frame(void *ctx, struct msgbuf *frame)
+{
+    struct reconnect *reconnect = ctx;
+
+    pthread_mutex_lock(&reconnect->lock);
+    check_frame(&reconnect->received, frame);
+    pthread_mutex_unlock(&reconnect->lock);
+}
+
+static void *publish_frames(void *ctx)
+{
+    struct reconnect *reconnect = ctx;
+    struct msgbuf *frame;
+    size_t i;
+
+    for (i = 0; i < NUM_MSGS; i++)
+    {
+        frame = make_frame(i);
+        msglog_append(&reconnect->log, frame);
+        if (frame->seq >= atomic_load(&reconnect->replayed))
+            receive_frame(reconnect, frame);
+        msgbuf_put(frame);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    struct replay replay = {0};
+    struct msgbuf *frame, *kept;
+    struct msglog log;
+    atomic_size_t usage = 0;
+    uint64_t cursor, end;
+    size_t i, round, missed;
+
+    msglog_init(&log);
+
+    cursor = msglog_tail(&log);
+    run_test(cursor == 0, "expected: cursor 0, got: %zu\n", (size_t)cursor);
+    end = msglog_replay(&log, cursor, check_frame, &replay);
+    run_test(end == 0 && !replay.count, "expected: nothing to replay, got: %zu\n", replay.count);
+
+    /* Appending past the initial size grows the ring in order */
+    kept = make_frame(0);
+    msglog_append(&log, kept);
+    for (i = 1; i < NUM_MSGS; i++)
+    {
+        frame = make_frame(i);
+        msglog_append(&log, frame);
+        msgbuf_put(frame);
+    }
+    run_test(msglog_count(&log) == NUM_MSGS, "expected: %d held, got: %zu\n", NUM_MSGS, msglog_count(&log));
+    run_test(atomic_load(&kept->refs) == 2, "expected: the log's reference, got: %d\n", atomic_load(&kept->refs));
+
+    end = msglog_replay(&log, cursor, check_frame, &replay);
+    run_test(end == NUM_MSGS, "expected: cursor %d, got: %zu\n", NUM_MSGS, (size_t)end);
+    run_test(replay.count == NUM_MSGS && !replay.out_of_order, "expected: %d in order, got: %zu, %zu out of order\n",
+             NUM_MSGS, replay.count, replay.out_of_order);
+
+    /* A cursor from the middle only sees what came after it */
+    memset(&replay, 0, sizeof(replay));
+    replay.next = 600;
+    msglog_replay(&log, 600, check_frame, &replay);
+    run_test(replay.count == NUM_MSGS - 600 && !replay.out_of_order, "expected: %d from 600, got: %zu\n",
+             NUM_MSGS - 600, replay.count);
+
+    /* Trimming drops references and makes older cursors start at the front */
+    msglog_trim(&log, 500);
+    run_test(atomic_load(&kept->refs) == 1, "expected: log reference dropped, got: %d\n", atomic_load(&kept->refs));
+    run_test(msglog_count(&log) == NUM_MSGS - 500, "expected: %d held, got: %zu\n", NUM_MSGS - 500,
+             msglog_count(&log));
+    memset(&replay, 0, sizeof(replay));
+    replay.next = 500;
+    msglog_replay(&log, 0, check_frame, &replay);
+    run_test(replay.count == NUM_MSGS - 500 && !replay.out_of_order, "expected: %d from 500, got: %zu\n",
+             NUM_MSGS - 500, replay.count);
+
+    /* Wrapping around the ring keeps the order */
+    for (i = NUM_MSGS; i < NUM_MSGS + 400; i++)
+    {
+        frame = make_frame(i);
+        msglog_append(&log, frame);
+        msgbuf_put(frame);
+    }
+    memset(&replay, 0, sizeof(replay));
+    replay.next = 500;
+    end = msglog_replay(&log, 0, check_frame, &replay);
+    run_test(end == NUM_MSGS + 400 && replay.count == NUM_MSGS - 100 && !replay.out_of_order,
+             "expected: %d in order after wrapping, got: %zu\n", NUM_MSGS - 100, replay.count);
+
+    msglog_trim(&log, ~(uint64_t)0);
+    run_test(!msglog_count(&log), "expected: empty log, got: %zu\n", msglog_count(&log));
+
+    msgbuf_put(kept);
+    msglog_free(&log);
+
+    /* Rebuilding starts wherever the first frame restored is, and a gap
+     * drops what came before it */
+    msglog_init(&log);
+    for (i = 100; i < 110; i++)
+    {
+        frame = make_frame(i);
+        msglog_restore(&log, i, frame);
+        msglog_restore(&log, i, frame);
+        msgbuf_put(frame);
+    }
+    run_test(msglog_head(&log) == 100 && msglog_count(&log) == 10, "expected: 10 held from 100, got: %zu from %zu\n",
+             msglog_count(&log), (size_t)msglog_head(&log));
+    frame = make_frame(200);
+    msglog_restore(&log, 200, frame);
+    msgbuf_put(frame);
+    run_test(msglog_head(&log) == 200 && msglog_count(&log) == 1, "expected: 1 held from 200, got: %zu from %zu\n",
+             msglog_count(&log), (size_t)msglog_head(&log));
+
+    /* Expiring drops the front up to the first frame stamped late enough */
+    for (i = 0; i < 10; i++)
+    {
+        frame = make_frame(i);
+        frame->stamp = 1000 + i * 10;
+        msglog_append(&log, frame);
+        msgbuf_put(frame);
+    }
+    run_test(msglog_expire(&log, 1045) == 6 && msglog_oldest_stamp(&log) == 1050,
+             "expected: 6 expired, oldest at 1050, got: %zu\n", (size_t)msglog_oldest_stamp(&log));
+    run_test(msglog_expire(&log, 0) == 0 && msglog_count(&log) == 5, "expected: 5 held, got: %zu\n",
+             msglog_count(&log));
+    msglog_expire(&log, UINT64_MAX);
+    run_test(msglog_oldest_stamp(&log) == UINT64_MAX, "expected: nothing left to expire\n");
+
+    /* Seeking never moves the tail back */
+    msglog_seek(&log, 150);
+    run_test(msglog_tail(&log) == 211, "expected: tail 211, got: %zu\n", (size_t)msglog_tail(&log));
+    msglog_seek(&log, 300);
+    run_test(msglog_tail(&log) == 300 && !msglog_count(&log), "expected: empty at 300, got: %zu at %zu\n",
+             msglog_count(&log), (size_t)msglog_tail(&log));
+    msglog_free(&log);
+
+    /* Bytes are counted per log and in the shared usage, and eviction frees
+     * the oldest first */
+    msglog_init(&log);
+    log.usage = &usage;
+    for (i = 0; i < 10; i++)
+    {
+        frame = make_frame(i);
+        frame->stamp = i;
+        msglog_append(&log, frame);
+        msgbuf_put(frame);
+    }
+    run_test(msglog_bytes(&log) == 30 && atomic_load(&usage) == 30, "expected: 30 bytes, got: %zu\n",
+             msglog_bytes(&log));
+    run_test(msglog_bytes_since(&log, 7) == 9, "expected: 9 bytes from 7, got: %zu\n", msglog_bytes_since(&log, 7));
+    run_test(msglog_evict(&log, 5, UINT64_MAX) == 2 && atomic_load(&usage) == 24,
+             "expected: 2 evicted for 5 bytes, got: %zu left\n", atomic_load(&usage));
+    run_test(msglog_evict(&log, 100, 4) == 3 && msglog_head(&log) == 5, "expected: evicted up to stamp 4, got: %zu\n",
+             (size_t)msglog_head(&log));
+    run_test(msglog_bytes_since(&log, 0) == 15, "expected: 15 bytes left, got: %zu\n", msglog_bytes_since(&log, 0));
+    msglog_free(&log);
+    run_test(!atomic_load(&usage), "expected: usage back to 0, got: %zu\n", atomic_load(&usage));
+
+    /* Replaying while publishes land gives every frame exactly once, in order */
+    for (round = 0, missed = 0; round < 200; round++)
+    {
+        struct reconnect reconnect = {.replayed = UINT64_MAX, .lock = PTHREAD_MUTEX_INITIALIZER};
+        pthread_t publisher;
+
+        msglog_init(&reconnect.log);
+        pthread_create(&publisher, NULL, publish_frames, &reconnect);
+        while (msglog_tail(&reconnect.log) < round * NUM_MSGS / 200)
+            ;
+        msglog_replay_mark(&reconnect.log, 0, receive_frame, &reconnect, &reconnect.replayed);
+        pthread_join(publisher, NULL);
+
+        missed += reconnect.received.count != NUM_MSGS || reconnect.received.out_of_order;
+        msglog_free(&reconnect.log);
+    }
+    run_test(!missed, "expected: every frame once and in order, got: %zu rounds wrong\n", missed);
+
+    END_TEST();
+}
@@ -0,0 +1,96 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "outq.h"
+#include "test.h"
+
+enum
+{
+    NUM_PRODUCERS = 4,
+    MSGS_PER_PRODUCER = 20000,
+};
+
+static struct outq queue;
+
+static void *produce(void *arg)
+{
+    size_t id = (size_t)arg, i;
+    char msg[32];
+
+    for (i = 0; i < MSGS_PER_PRODUCER; i++)
+    {
+        snprintf(msg, sizeof(msg), "%zu:%zu", id, i);
+        outq_push(&queue, msg, strlen(msg) + 1);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    size_t next[NUM_PRODUCERS] = {0}, received = 0, i, id, seq;
+    pthread_t threads[NUM_PRODUCERS];
+    struct iovec iov[16];
+    struct outq other;
+    struct msgbuf *buf;
+    size_t count, total;
+    int in_order = 1;
+
+    outq_init(&queue);
+
+    /* Partial writes keep the rest of the buffer */
+    outq_push(&queue, "hello", 5);
+    outq_push(&queue, "world", 5);
+    count = outq_fill_iov(&queue, iov, 16);
+    run_test(count == 2, "expected: 2 buffers, got: %zu\n", count);
+    outq_consume(&queue, 7);
+    count = outq_fill_iov(&queue, iov, 16);
+    run_test(count == 1 && iov[0].iov_len == 3 && !memcmp(iov[0].iov_base, "rld", 3),
+             "expected: rld, got: %zu buffers\n", count);
+    outq_consume(&queue, 3);
+    run_test(!outq_bytes(&queue), "expected: 0 bytes, got: %zu\n", outq_bytes(&queue));
+
+    /* Shared frames are referenced by each queue, not copied */
+    buf = msgbuf_alloc(5);
+    memcpy(buf->data, "frame", 5);
+    outq_init(&other);
+    outq_push_buf(&queue, buf);
+    outq_push_buf(&other, buf);
+    count = outq_fill_iov(&queue, iov, 16);
+    run_test(count == 1 && iov[0].iov_base == buf->data,
+             "expected: the shared buffer, got: %zu buffers\n", count);
+    outq_consume(&queue, 5);
+    run_test(atomic_load(&buf->refs) == 2, "expected: 2 refs, got: %d\n", atomic_load(&buf->refs));
+    outq_free(&other);
+    run_test(atomic_load(&buf->refs) == 1, "expected: 1 ref, got: %d\n", atomic_load(&buf->refs));
+    msgbuf_put(buf);
+
+    for (i = 0; i < NUM_PRODUCERS; i++)
+        pthread_create(&threads[i], NULL, produce, (void *)i);
+
+    /* Each producer's messages must come out in the order they went in */
+    while (received < NUM_PRODUCERS * MSGS_PER_PRODUCER)
+    {
+        count = outq_fill_iov(&queue, iov, 16);
+        for (i = 0, total = 0; i < count; i++)
+        {
+            sscanf(iov[i].iov_base, "%zu:%zu", &id, &seq);
+            if (seq != next[id]++)
+                in_order = 0;
+            total += iov[i].iov_len;
+            received++;
+        }
+        outq_consume(&queue, total);
+    }
+
+    for (i = 0; i < NUM_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+
+    run_test(in_order, "expected: per producer ordering\n");
+    run_test(!outq_bytes(&queue), "expected: 0 bytes, got: %zu\n", outq_bytes(&queue));
+
+    outq_free(&queue);
+
+    END_TEST();
+}
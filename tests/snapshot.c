@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "test.h"
+
+enum
+{
+    NUM_TOPICS = 3,
+    NUM_CLIENTS = 1000,
+};
+
+struct loaded
+{
+    size_t count;
+    size_t bad;
+    size_t per_topic[NUM_TOPICS];
+};
+
+static char topic_names[NUM_TOPICS][16];
+static char client_names[NUM_CLIENTS][16];
+
+static void check_sub(void *ctx, const char *topic, const char *client)
+{
+    struct loaded *loaded = ctx;
+    size_t t, c;
+
+    if (sscanf(topic, "topic%zu", &t) != 1 || sscanf(client, "client%zu", &c) != 1 || t >= NUM_TOPICS
+        || c % (t + 1))
+    {
+        loaded->bad++;
+        return;
+    }
+
+    loaded->per_topic[t]++;
+    loaded->count++;
+}
+
+/* Topic t is subscribed to by every client whose number is a multiple of t + 1 */
+static int build(struct snapshot_builder *builder)
+{
+    size_t t, c;
+    int ret = 0;
+
+    for (t = 0; t < NUM_TOPICS; t++)
+    {
+        ret |= snapshot_add_topic(builder, topic_names[t], strlen(topic_names[t]) + 1,
+                                  (NUM_CLIENTS + t) / (t + 1));
+        for (c = 0; c < NUM_CLIENTS; c += t + 1)
+            ret |= snapshot_add_sub(builder, client_names[c], strlen(client_names[c]) + 1);
+    }
+
+    return ret;
+}
+
+int main(void)
+{
+    char path[] = "/tmp/snapshot_testXXXXXX";
+    struct snapshot_builder builder;
+    struct loaded loaded = {0};
+    long count;
+    size_t i;
+    FILE *file;
+    int fd;
+
+    for (i = 0; i < NUM_TOPICS; i++)
+        snprintf(topic_names[i], sizeof(topic_names[i]), "topic%zu", i);
+    for (i = 0; i < NUM_CLIENTS; i++)
+        snprintf(client_names[i], sizeof(client_names[i]), "client%zu", i);
+
+    fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    /* An empty file is no snapshot */
+    count = snapshot_load(path, check_sub, &loaded);
+    run_test(count == -1 && !loaded.count, "expected: nothing loaded, got: %ld\n", count);
+
+    /* Every subscription comes back, with each name written only once */
+    snapshot_init(&builder);
+    run_test(!build(&builder), "expected: snapshot built\n");
+    run_test(builder.num_names == NUM_CLIENTS, "expected: %d names, got: %u\n", NUM_CLIENTS, builder.num_names);
+    run_test(!snapshot_write(&builder, path), "expected: snapshot written\n");
+    snapshot_free(&builder);
+
+    count = snapshot_load(path, check_sub, &loaded);
+    run_test(count == NUM_CLIENTS + 500 + 334 && count == (long)loaded.count && !loaded.bad,
+             "expected: %d subscriptions, got: %ld, %zu bad\n", NUM_CLIENTS + 500 + 334, count, loaded.bad);
+    for (i = 0; i < NUM_TOPICS; i++)
+        run_test(loaded.per_topic[i] == (NUM_CLIENTS + i) / (i + 1), "expected: %zu on topic %zu, got: %zu\n",
+                 (NUM_CLIENTS + i) / (i + 1), i, loaded.per_topic[i]);
+
+    /* A damaged snapshot restores nothing at all */
+    file = fopen(path, "r+");
+    fseek(file, -2, SEEK_END);
+    fputc('x', file);
+    fclose(file);
+
+    memset(&loaded, 0, sizeof(loaded));
+    count = snapshot_load(path, check_sub, &loaded);
+    run_test(count == -1 && !loaded.count, "expected: damaged snapshot ignored, got: %ld\n", count);
+
+    /* Truncated */
+    snapshot_init(&builder);
+    build(&builder);
+    snapshot_write(&builder, path);
+    snapshot_free(&builder);
+    truncate(path, 100);
+    count = snapshot_load(path, check_sub, &loaded);
+    run_test(count == -1 && !loaded.count, "expected: truncated snapshot ignored, got: %ld\n", count);
+
+    unlink(path);
+
+    END_TEST();
+}
@@ -0,0 +1,171 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "test.h"
+
+enum
+{
+    SMALL_SEGMENT_SIZE = 4096,
+    NUM_RECORDS = 1000,
+};
+
+struct scan
+{
+    size_t count;
+    size_t bad;
+    uint64_t next_seq;
+    uint64_t last_segment;
+};
+
+/* Records are "r<seq>" on stream seq % 2 */
+static void check_record(void *ctx, uint64_t segment, struct store_record *record, void *data)
+{
+    struct scan *scan = ctx;
+    char expected[32];
+
+    snprintf(expected, sizeof(expected), "r%llu", (unsigned long long)record->seq);
+    scan->bad += record->type != 1 || record->stream != record->seq % 2 || record->seq != scan->next_seq
+                 || record->len != strlen(expected) || memcmp(data, expected, record->len);
+    scan->next_seq = record->seq + 1;
+    scan->last_segment = segment;
+    scan->count++;
+}
+
+static int append(struct store *store, uint64_t seq, uint64_t *segment)
+{
+    char data[32];
+
+    snprintf(data, sizeof(data), "r%llu", (unsigned long long)seq);
+    return store_append(store, 1, seq % 2, seq, data, strlen(data), segment);
+}
+
+static size_t count_segments(const char *dir)
+{
+    struct dirent *entry;
+    size_t count = 0;
+    DIR *d;
+
+    d = opendir(dir);
+    if (!d)
+        return 0;
+    while ((entry = readdir(d)))
+        count += strstr(entry->d_name, ".seg") != NULL;
+    closedir(d);
+
+    return count;
+}
+
+static void remove_dir(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *d;
+
+    d = opendir(dir);
+    if (!d)
+        return;
+    while ((entry = readdir(d)))
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/store_testXXXXXX", path[PATH_MAX];
+    uint64_t first_seqs[2], segment, pinned = 0, next;
+    struct scan scan = {0};
+    struct store *store;
+    size_t i, segments;
+    int fd, failed = 0;
+    char byte;
+
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    /* Everything appended is read back in order after a reopen */
+    store = store_open(dir, STORE_DEFAULT_SEGMENT_SIZE, 1, 2, check_record, &scan);
+    run_test(store != NULL && !scan.count, "expected: empty store, got: %zu records\n", scan.count);
+    for (i = 0; i < 10; i++)
+        failed += append(store, i, &segment) != 0;
+    run_test(!failed && segment == 0, "expected: 10 appends to segment 0, got: %d failed\n", failed);
+    store_close(store);
+
+    store = store_open(dir, STORE_DEFAULT_SEGMENT_SIZE, 1, 2, check_record, &scan);
+    run_test(scan.count == 10 && !scan.bad, "expected: 10 records, got: %zu, %zu bad\n", scan.count, scan.bad);
+    store_close(store);
+
+    /* A torn record ends the segment, nothing after it is read */
+    snprintf(path, sizeof(path), "%s/%016llx.seg", dir, 0ULL);
+    fd = open(path, O_RDWR);
+    byte = 'x';
+    if (fd == -1 || pwrite(fd, &byte, 1, 64 + 5 * 32 + sizeof(struct store_record)) != 1)
+        perror(path);
+    close(fd);
+
+    memset(&scan, 0, sizeof(scan));
+    store = store_open(dir, STORE_DEFAULT_SEGMENT_SIZE, 1, 2, check_record, &scan);
+    run_test(scan.count == 5 && !scan.bad, "expected: 5 records before the torn one, got: %zu\n", scan.count);
+    store_close(store);
+    remove_dir(dir);
+
+    /* Small segments fill up and are dropped once every stream is past them,
+     * except from the pinned one onwards */
+    mkdir(dir, 0755);
+    store = store_open(dir, SMALL_SEGMENT_SIZE, 1, 2, check_record, &scan);
+    for (i = 0, failed = 0; i < NUM_RECORDS; i++)
+    {
+        failed += append(store, i, &segment) != 0;
+        if (i == NUM_RECORDS / 2)
+        {
+            pinned = segment;
+            store_pin(store, pinned);
+        }
+    }
+    segments = count_segments(dir);
+    run_test(!failed && segments > 4, "expected: several segments, got: %zu\n", segments);
+
+    first_seqs[0] = first_seqs[1] = NUM_RECORDS / 4;
+    store_trim(store, first_seqs);
+    run_test(count_segments(dir) < segments, "expected: fewer than %zu segments, got: %zu\n", segments,
+             count_segments(dir));
+
+    first_seqs[0] = first_seqs[1] = NUM_RECORDS;
+    store_trim(store, first_seqs);
+    run_test(count_segments(dir) == segment - pinned + 1, "expected: %zu segments from the pin, got: %zu\n",
+             (size_t)(segment - pinned + 1), count_segments(dir));
+
+    store_unpin(store, pinned);
+    store_trim(store, first_seqs);
+    run_test(count_segments(dir) == 1, "expected: only the last segment, got: %zu\n", count_segments(dir));
+    store_close(store);
+
+    /* What is left still reads back, and the next run continues numbering */
+    memset(&scan, 0, sizeof(scan));
+    store = store_open(dir, SMALL_SEGMENT_SIZE, 1, 2, check_record, &scan);
+    run_test(scan.last_segment == segment, "expected: segment %zu read back, got: %zu\n", (size_t)segment,
+             (size_t)scan.last_segment);
+    append(store, NUM_RECORDS, &next);
+    run_test(next == segment + 1, "expected: appends to segment %zu, got: %zu\n", (size_t)segment + 1,
+             (size_t)next);
+    store_close(store);
+
+    remove_dir(dir);
+
+    END_TEST();
+}
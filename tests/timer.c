@@ -0,0 +1,103 @@
+#include <stdlib.h>
+
+#include "test.h"
+#include "timer.h"
+
+enum
+{
+    NUM_TIMERS = 10000,
+    START = 1000000, /* Not aligned to any level */
+    SPAN = 1 << 24, /* Reaches level 3 */
+};
+
+struct fired
+{
+    struct timer_wheel *wheel;
+    size_t count;
+    size_t early;
+    size_t late;
+};
+
+static void check_fired(struct timer *timer, void *ctx)
+{
+    struct fired *fired = ctx;
+
+    fired->early += fired->wheel->now < timer->expires;
+    fired->late += fired->wheel->now > timer->expires;
+    fired->count++;
+}
+
+static void periodic(struct timer *timer, void *ctx)
+{
+    struct fired *fired = ctx;
+
+    fired->count++;
+    timer_add(fired->wheel, timer, timer->expires + 10);
+}
+
+int main(void)
+{
+    struct fired fired = {0}, ticks = {0};
+    struct timer_wheel wheel;
+    struct timer *timers, tick, far;
+    uint64_t now;
+    size_t i, ran;
+
+    timers = malloc(NUM_TIMERS * sizeof(*timers));
+    if (!timers)
+        return 1;
+
+    timer_wheel_init(&wheel, START);
+    fired.wheel = &wheel;
+    ticks.wheel = &wheel;
+
+    /* Spread over every level in use, half of them cancelled again */
+    srand(1);
+    for (i = 0; i < NUM_TIMERS; i++)
+    {
+        timer_init(&timers[i], check_fired, &fired);
+        timer_add(&wheel, &timers[i], START + 1 + (uint64_t)rand() % (i % 4 ? SPAN >> (6 * (i % 4)) : SPAN));
+    }
+    for (i = 0; i < NUM_TIMERS; i += 2)
+        timer_cancel(&wheel, &timers[i]);
+    run_test(wheel.count == NUM_TIMERS / 2, "expected: %d pending, got: %zu\n", NUM_TIMERS / 2, wheel.count);
+
+    /* Moving a pending timer only keeps the new time */
+    timer_add(&wheel, &timers[1], START + 5);
+    run_test(wheel.count == NUM_TIMERS / 2, "expected: still %d pending, got: %zu\n", NUM_TIMERS / 2, wheel.count);
+
+    /* Uneven steps, every timer fires on its own tick */
+    for (now = START, ran = 0; now < START + SPAN + 1000; now += 1 + rand() % 5000)
+        ran += timer_advance(&wheel, now);
+    ran += timer_advance(&wheel, now);
+    run_test(ran == NUM_TIMERS / 2 && fired.count == ran, "expected: %d fired, got: %zu\n", NUM_TIMERS / 2, ran);
+    run_test(!fired.early && !fired.late, "expected: all on time, got: %zu early, %zu late\n", fired.early,
+             fired.late);
+    run_test(!wheel.count, "expected: nothing pending, got: %zu\n", wheel.count);
+    for (i = 0, ran = 0; i < NUM_TIMERS; i++)
+        ran += timer_pending(&timers[i]);
+    run_test(!ran, "expected: no timer left pending, got: %zu\n", ran);
+
+    /* Times already past fire on the next tick */
+    fired.count = 0;
+    timer_add(&wheel, &timers[0], 1);
+    timer_advance(&wheel, wheel.now + 1);
+    run_test(fired.count == 1, "expected: past timer fired, got: %zu\n", fired.count);
+
+    /* A callback re-arming itself */
+    timer_init(&tick, periodic, &ticks);
+    timer_add(&wheel, &tick, wheel.now + 10);
+    timer_advance(&wheel, wheel.now + 1000);
+    run_test(ticks.count == 100, "expected: 100 ticks, got: %zu\n", ticks.count);
+    timer_cancel(&wheel, &tick);
+
+    /* Beyond the top level it waits, without firing early */
+    timer_init(&far, check_fired, &fired);
+    timer_add(&wheel, &far, wheel.now + ((uint64_t)1 << 40));
+    timer_advance(&wheel, wheel.now + SPAN);
+    run_test(timer_pending(&far) && fired.count == 1, "expected: far timer still pending\n");
+
+    free(timers);
+
+    END_TEST();
+}
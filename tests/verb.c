@@ -0,0 +1,33 @@
+#include <string.h>
+
+#include "test.h"
+#include "verb.h"
+
+int main(void)
+{
+    static const char *not_verbs[] = {"", "CON", "CONNN", "conn", "PUBS", "SUBB", "DIS", "RECONNECTS", "STAT",
+                                      "SSSSS", "CXXN", "NEWS", "alice"};
+    size_t i;
+    enum verb verb;
+
+    /* Every verb finds itself */
+    for (i = 0; i < NUM_VERBS; i++)
+    {
+        verb = verb_lookup(verb_info[i].name, strlen(verb_info[i].name));
+        run_test(verb == i && verb_info[i].len == strlen(verb_info[i].name), "expected: %s at %zu, got: %d\n",
+                 verb_info[i].name, i, verb);
+    }
+
+    /* Anything else, including strings hashing to a verb's slot, finds nothing */
+    for (i = 0; i < sizeof(not_verbs) / sizeof(*not_verbs); i++)
+    {
+        verb = verb_lookup(not_verbs[i], strlen(not_verbs[i]));
+        run_test(verb == VERB_NONE, "expected: no verb for \"%s\", got: %d\n", not_verbs[i], verb);
+    }
+
+    /* Only the given length counts, tokens are not always NUL terminated */
+    verb = verb_lookup("PUBLISH", 3);
+    run_test(verb == VERB_PUB, "expected: PUB from a prefix, got: %d\n", verb);
+
+    END_TEST();
+}